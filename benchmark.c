@@ -0,0 +1,1669 @@
+#include "virtualDirectory.h"
+#include "virtualFileSystem.h"
+#include "virtualQueue.h"
+#include "virtualStorage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+#include <io.h>
+#define fsync _commit
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// This program measures the performance of the virtual file system. Like
+// main.c, it's not a part of the system itself. Each benchmark creates its own
+// storage file in the working directory and deletes it afterwards.
+
+#define BENCHMARK_STORAGE_PATH "./benchmarkStorage"
+#define CREATION_BLOCK_SIZE 4096
+#define CREATION_BLOCK_COUNT (1024 * 1024)
+#define FILL_LEVEL_BUCKETS 10
+#define GROWTH_INITIAL_BLOCK_COUNT 64
+#define GROWTH_FILE_SIZE (64 * 1024 * 1024)
+#define GROWTH_WRITE_SIZE 4096
+#define PUNCH_BLOCK_SIZE 4096
+#define PUNCH_FILE_COUNT 2048
+#define PUNCH_FILE_SIZE (64 * 1024)
+#define COMPACTION_BLOCK_SIZE 4096
+#define COMPACTION_FILE_COUNT 16
+#define COMPACTION_FILE_SIZE (4 * 1024 * 1024)
+#define COMPACTION_PACED_RATE 65536
+#define JOURNAL_OPERATION_COUNT 500
+#define JOURNAL_FILE_SIZE 100
+#define TRANSFER_CHUNK_SIZE 65536
+#define SMALL_READ_REGION_SIZE (64 * 1024)
+#define SMALL_READ_SIZE 64
+#define SMALL_READ_COUNT 20000
+#define LOOKUP_FILE_COUNT 100
+#define LOOKUP_COUNT 2000
+#define LAYOUT_BLOCK_COUNT 65536
+#define LAYOUT_REGION_BLOCKS 4096
+#define LAYOUT_SEEK_COUNT 20000
+#define SEEK_FILE_SIZE (4 * 1024 * 1024)
+#define SEEK_BLOCK_COUNT 16384
+#define SEEK_COUNT 20000
+#define INTERLEAVED_FILE_COUNT 16
+#define INTERLEAVED_FILE_SIZE (256 * 1024)
+#define INTERLEAVED_READ_SIZE 256
+#define DIRECTORY_LOOKUP_COUNT 20000
+#define FLAT_DIRECTORY_MAX_ENTRIES 1000
+#define LISTING_ENTRY_COUNT 20000
+#define LISTING_PAGE_SIZE 100
+#define APPEND_RECORD_SIZE 16
+#define APPEND_RECORD_COUNT 1000000
+#define LOG_RECORD_HEADER_SIZE 16
+#define LOG_RECORD_PAYLOAD_SIZE 200
+#define LOG_RECORD_TRAILER_SIZE 8
+#define LOG_RECORD_COUNT 200000
+#define PARALLEL_MAX_THREADS 8
+#define PARALLEL_FILE_SIZE (1024 * 1024)
+#define PARALLEL_READ_SIZE 4096
+#define PARALLEL_READ_COUNT 50000
+#define DESCRIPTOR_REOPEN_COUNT 100000
+#define QUEUED_FILE_COUNT 16
+#define QUEUED_FILE_SIZE (1024 * 1024)
+#define QUEUED_READ_SIZE 4096
+#define QUEUED_READ_COUNT 100000
+#define QUEUED_READ_DEPTH 64
+
+typedef struct file_size_class
+{
+    int file_count;
+    size_t file_size;
+} file_size_class;
+
+// The mix of file sizes used for measuring throughput: many small files, some
+// medium-sized ones and a couple of large ones
+const file_size_class file_size_mix_[] = {
+    { 32, 1024 }, { 8, 64 * 1024 }, { 2, 1024 * 1024 }
+};
+const int file_size_class_count_ =
+    sizeof(file_size_mix_) / sizeof(file_size_class);
+
+const size_t block_size_sweep_[] = {
+    512, 4096, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024
+};
+const int block_size_sweep_count_ =
+    sizeof(block_size_sweep_) / sizeof(size_t);
+
+const size_t cache_size_sweep_[] = { 0, 16, 256 };
+const int cache_size_sweep_count_ =
+    sizeof(cache_size_sweep_) / sizeof(size_t);
+
+const size_t directory_cache_sweep_[] = {
+    0, DIRECTORY_DEFAULT_CACHE_CAPACITY
+};
+const int directory_cache_sweep_count_ =
+    sizeof(directory_cache_sweep_) / sizeof(size_t);
+
+const int directory_size_sweep_[] = { 10, 1000, 50000 };
+const int directory_size_sweep_count_ =
+    sizeof(directory_size_sweep_) / sizeof(int);
+
+const int thread_count_sweep_[] = { 1, 2, 4, PARALLEL_MAX_THREADS };
+const int thread_count_sweep_count_ =
+    sizeof(thread_count_sweep_) / sizeof(int);
+
+const int open_file_count_sweep_[] = { 100, 20000 };
+const int open_file_count_sweep_count_ =
+    sizeof(open_file_count_sweep_) / sizeof(int);
+
+const int queue_worker_sweep_[] = { 1, 4 };
+const int queue_worker_sweep_count_ =
+    sizeof(queue_worker_sweep_) / sizeof(int);
+
+const size_t growth_percent_sweep_[] = { 10, 50, 100 };
+const int growth_percent_sweep_count_ =
+    sizeof(growth_percent_sweep_) / sizeof(size_t);
+
+typedef struct parallel_reader
+{
+    file_descriptor file;
+    unsigned int seed;
+} parallel_reader;
+
+double current_time_us()
+{
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+
+    return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+}
+
+int open_benchmark_storage_with(storage_options options)
+{
+    remove(BENCHMARK_STORAGE_PATH);
+
+    options.path = BENCHMARK_STORAGE_PATH;
+
+    return storage_initialize_with(&options);
+}
+
+int open_benchmark_storage(size_t block_size, size_t block_count)
+{
+    storage_options options = storage_default_options();
+    options.block_size = block_size;
+    options.block_count = block_count;
+
+    return open_benchmark_storage_with(options);
+}
+
+void close_benchmark_storage()
+{
+    storage_close();
+    remove(BENCHMARK_STORAGE_PATH);
+}
+
+void benchmark_storage_creation(const char* name, bool header_table)
+{
+    // Create a 4 GiB storage file, and open it again to see how long loading
+    // the headers of a storage file with no blocks in use takes
+    storage_options options = storage_default_options();
+    options.block_size = CREATION_BLOCK_SIZE;
+    options.block_count = CREATION_BLOCK_COUNT;
+    options.header_table = header_table;
+
+    double start = current_time_us();
+
+    if (open_benchmark_storage_with(options) == -1)
+    {
+        printf("  %-6s: failed to create benchmark storage\n", name);
+
+        return;
+    }
+
+    double creation_elapsed = current_time_us() - start;
+
+    storage_close();
+
+    options.path = BENCHMARK_STORAGE_PATH;
+    start = current_time_us();
+    storage_initialize_with(&options);
+    double opening_elapsed = current_time_us() - start;
+
+    close_benchmark_storage();
+
+    printf("  %-6s: %8.2f ms to create, %8.2f ms to open\n", name,
+        creation_elapsed / 1e3, opening_elapsed / 1e3);
+}
+
+void benchmark_storage_creations()
+{
+    printf("Storage file creation (%d blocks of %d bytes)\n",
+        CREATION_BLOCK_COUNT, CREATION_BLOCK_SIZE);
+
+    benchmark_storage_creation("inline", false);
+    benchmark_storage_creation("table", true);
+}
+
+void benchmark_storage_growth(size_t growth_percent)
+{
+    // Write a large file into a storage file that starts out small and grows
+    // as it fills up, counting how many times it grows. A growth percentage
+    // of zero instead creates the storage file large enough to begin with
+    size_t block_size = storage_default_options().block_size;
+    size_t full_block_count = GROWTH_FILE_SIZE / block_size * 2;
+    storage_growth_policy policy = storage_default_growth_policy();
+    policy.growth_percent = growth_percent;
+    policy.max_block_count = full_block_count;
+
+    if (open_benchmark_storage(block_size, growth_percent > 0
+            ? GROWTH_INITIAL_BLOCK_COUNT : full_block_count) == -1)
+    {
+        printf("  %3zu%%: failed to create benchmark storage\n",
+            growth_percent);
+
+        return;
+    }
+
+    storage_set_growth_policy(policy);
+
+    char* buffer = malloc(GROWTH_WRITE_SIZE);
+    memset(buffer, 'g', GROWTH_WRITE_SIZE);
+
+    file_descriptor file = open_virtual("growing", O_CREAT);
+    size_t written_bytes = 0;
+    int growth_count = 0;
+
+    double start = current_time_us();
+
+    while (written_bytes < GROWTH_FILE_SIZE)
+    {
+        size_t block_count = storage_block_count();
+
+        if (write_virtual(file, buffer, GROWTH_WRITE_SIZE)
+            != GROWTH_WRITE_SIZE)
+        {
+            break;
+        }
+
+        growth_count += storage_block_count() != block_count;
+        written_bytes += GROWTH_WRITE_SIZE;
+    }
+
+    double elapsed = current_time_us() - start;
+    size_t final_block_count = storage_block_count();
+
+    close_virtual(file);
+    free(buffer);
+    close_benchmark_storage();
+    storage_set_growth_policy(storage_default_growth_policy());
+
+    char name[32];
+
+    if (growth_percent > 0)
+    {
+        snprintf(name, sizeof(name), "grown by %zu%%", growth_percent);
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "preallocated");
+    }
+
+    printf("  %-14s: %8.2f MB/s, %3d times grown to %zu blocks\n", name,
+        written_bytes / elapsed, growth_count, final_block_count);
+}
+
+void benchmark_storage_growths()
+{
+    printf("Writing %d MiB into a growing storage file (starting from %d "
+        "blocks)\n", GROWTH_FILE_SIZE / (1024 * 1024),
+        GROWTH_INITIAL_BLOCK_COUNT);
+
+    benchmark_storage_growth(0);
+
+    for (int i = 0; i < growth_percent_sweep_count_; i++)
+    {
+        benchmark_storage_growth(growth_percent_sweep_[i]);
+    }
+}
+
+double storage_disk_usage_mb()
+{
+    // Blocks of the storage file that take space on the disk, which is less
+    // than the file size when the file has holes
+    struct stat file_status;
+
+    if (stat(BENCHMARK_STORAGE_PATH, &file_status) == -1)
+    {
+        return 0;
+    }
+
+#ifdef _MSC_VER
+    return file_status.st_size / (1024.0 * 1024.0);
+#else
+    return file_status.st_blocks * 512 / (1024.0 * 1024.0);
+#endif
+}
+
+double storage_file_size_mb()
+{
+    struct stat file_status;
+
+    if (stat(BENCHMARK_STORAGE_PATH, &file_status) == -1)
+    {
+        return 0;
+    }
+
+    return file_status.st_size / (1024.0 * 1024.0);
+}
+
+void fill_punch_files(char* contents)
+{
+    char path[32];
+
+    for (int i = 0; i < PUNCH_FILE_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "file%d", i);
+
+        file_descriptor file = open_virtual(path, O_CREAT);
+        write_virtual(file, contents, PUNCH_FILE_SIZE);
+        close_virtual(file);
+    }
+
+    storage_flush();
+}
+
+void benchmark_hole_punch(const char* name, bool punch_holes,
+                          size_t journal_group_size)
+{
+    // Fill the storage with files, delete all of them and see how much of the
+    // storage file still takes disk space, and how much shrinking the storage
+    // afterwards cuts off the file. Filling the storage again grows it back
+    // past the size it had after shrinking
+    storage_options options = storage_default_options();
+    options.block_size = PUNCH_BLOCK_SIZE;
+    options.block_count = (size_t)PUNCH_FILE_COUNT * PUNCH_FILE_SIZE
+        / PUNCH_BLOCK_SIZE * 2;
+    options.punch_holes = punch_holes;
+    options.journal_group_size = journal_group_size;
+
+    if (open_benchmark_storage_with(options) == -1)
+    {
+        printf("  %-15s: failed to create benchmark storage\n", name);
+
+        return;
+    }
+
+    storage_growth_policy policy = storage_default_growth_policy();
+    policy.max_block_count = options.block_count;
+    storage_set_growth_policy(policy);
+
+    char* contents = malloc(PUNCH_FILE_SIZE);
+    memset(contents, 'p', PUNCH_FILE_SIZE);
+    char path[32];
+
+    fill_punch_files(contents);
+
+    double filled_mb = storage_disk_usage_mb();
+    double start = current_time_us();
+
+    for (int i = 0; i < PUNCH_FILE_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "file%d", i);
+        unlink_virtual(path);
+    }
+
+    storage_flush();
+
+    double elapsed = current_time_us() - start;
+    double emptied_mb = storage_disk_usage_mb();
+
+    storage_shrink();
+
+    double shrunk_mb = storage_file_size_mb();
+
+    fill_punch_files(contents);
+
+    double refilled_mb = storage_file_size_mb();
+
+    free(contents);
+    close_benchmark_storage();
+
+    printf("  %-15s: %7.2f us per delete, %7.1f MiB on disk before and "
+        "%7.1f MiB after, %7.1f MiB file after shrinking and %7.1f MiB "
+        "after filling again\n", name, elapsed / PUNCH_FILE_COUNT, filled_mb,
+        emptied_mb, shrunk_mb, refilled_mb);
+}
+
+void benchmark_hole_punches()
+{
+    printf("Deleting %d files of %d KiB\n", PUNCH_FILE_COUNT,
+        PUNCH_FILE_SIZE / 1024);
+
+    benchmark_hole_punch("no punching", false, 0);
+    benchmark_hole_punch("punching", true, 0);
+    benchmark_hole_punch("journaled", true, 3);
+}
+
+double read_compaction_files_mb_per_s()
+{
+    // Read every file from start to end and return the read throughput
+    char* buffer = malloc(TRANSFER_CHUNK_SIZE);
+    char path[32];
+    double start = current_time_us();
+
+    for (int i = 0; i < COMPACTION_FILE_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "file%d", i);
+
+        file_descriptor file = open_virtual(path, 0);
+
+        while (read_virtual(file, buffer, TRANSFER_CHUNK_SIZE) > 0)
+        {
+        }
+
+        close_virtual(file);
+    }
+
+    double elapsed = current_time_us() - start;
+    free(buffer);
+
+    return (double)COMPACTION_FILE_COUNT * COMPACTION_FILE_SIZE
+        / (1024 * 1024) / (elapsed / 1e6);
+}
+
+void benchmark_compaction(const char* name, size_t max_blocks_per_second)
+{
+    // Write the files a block at a time in turns so that no two consecutive
+    // blocks of a file are adjacent, then compact the storage and compare
+    // sequential reads of the files before and after
+    if (open_benchmark_storage(COMPACTION_BLOCK_SIZE,
+                               (size_t)COMPACTION_FILE_COUNT
+                               * COMPACTION_FILE_SIZE
+                               / COMPACTION_BLOCK_SIZE * 2) == -1)
+    {
+        printf("  %-9s: failed to create benchmark storage\n", name);
+
+        return;
+    }
+
+    char block[COMPACTION_BLOCK_SIZE];
+    memset(block, 'c', sizeof(block));
+
+    file_descriptor files[COMPACTION_FILE_COUNT];
+    char path[32];
+
+    for (int i = 0; i < COMPACTION_FILE_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "file%d", i);
+        files[i] = open_virtual(path, O_CREAT);
+    }
+
+    for (int j = 0; j < COMPACTION_FILE_SIZE / COMPACTION_BLOCK_SIZE; j++)
+    {
+        for (int i = 0; i < COMPACTION_FILE_COUNT; i++)
+        {
+            write_virtual(files[i], block, sizeof(block));
+        }
+    }
+
+    for (int i = 0; i < COMPACTION_FILE_COUNT; i++)
+    {
+        close_virtual(files[i]);
+    }
+
+    double fragmented_mb_per_s = read_compaction_files_mb_per_s();
+
+    virtual_compaction_options options = { max_blocks_per_second, 0 };
+    virtual_compaction_report report;
+
+    double start = current_time_us();
+    compact_virtual(&options, &report);
+    double elapsed = current_time_us() - start;
+
+    double compacted_mb_per_s = read_compaction_files_mb_per_s();
+
+    close_benchmark_storage();
+
+    printf("  %-9s: fragmentation %.2f -> %.2f, %zu blocks moved in "
+        "%8.1f ms, reads %7.1f MiB/s before and %7.1f MiB/s after\n", name,
+        report.fragmentation_before, report.fragmentation_after,
+        report.moved_blocks, elapsed / 1e3, fragmented_mb_per_s,
+        compacted_mb_per_s);
+}
+
+void benchmark_compactions()
+{
+    printf("Compacting %d files of %d KiB written a block at a time in "
+        "turns\n", COMPACTION_FILE_COUNT, COMPACTION_FILE_SIZE / 1024);
+
+    benchmark_compaction("unpaced", 0);
+    benchmark_compaction("paced", COMPACTION_PACED_RATE);
+}
+
+void benchmark_journal(const char* name, size_t journal_group_size,
+                       bool sync_each_operation)
+{
+    // Create a small file and delete it again, over and over. Syncing the
+    // storage file after each operation is what makes them durable without
+    // the journal, and the time of the last group commit is included
+    storage_options options = storage_default_options();
+    options.journal_group_size = journal_group_size;
+
+    if (open_benchmark_storage_with(options) == -1)
+    {
+        printf("  %-15s: failed to create benchmark storage\n", name);
+
+        return;
+    }
+
+    int storage_file = open(BENCHMARK_STORAGE_PATH, O_RDWR);
+    char contents[JOURNAL_FILE_SIZE];
+    memset(contents, 'j', sizeof(contents));
+
+    double start = current_time_us();
+
+    for (int i = 0; i < JOURNAL_OPERATION_COUNT; i++)
+    {
+        file_descriptor file = open_virtual("file", O_CREAT);
+        write_virtual(file, contents, sizeof(contents));
+        close_virtual(file);
+
+        if (sync_each_operation)
+        {
+            fsync(storage_file);
+        }
+
+        unlink_virtual("file");
+
+        if (sync_each_operation)
+        {
+            fsync(storage_file);
+        }
+    }
+
+    storage_flush();
+
+    double elapsed = current_time_us() - start;
+
+    close(storage_file);
+    close_benchmark_storage();
+
+    printf("  %-15s: %9.0f creates and deletes per second\n", name,
+        JOURNAL_OPERATION_COUNT * 2 / (elapsed / 1e6));
+}
+
+void benchmark_journals()
+{
+    printf("Creating and deleting a %d-byte file %d times\n",
+        JOURNAL_FILE_SIZE, JOURNAL_OPERATION_COUNT);
+
+    benchmark_journal("no journal", 0, false);
+    benchmark_journal("sync per call", 0, true);
+    benchmark_journal("group of 1", 1, false);
+    benchmark_journal("group of 64", 64, false);
+}
+
+void benchmark_append_latency()
+{
+    // Append to a single region until the storage runs out of space,
+    // recording how long each append takes relative to how full the storage
+    // was at the time. Each append is one block long, so every append
+    // allocates a block and this mostly measures the block allocator
+    storage_options options = storage_default_options();
+
+    if (open_benchmark_storage(options.block_size, options.block_count) == -1)
+    {
+        printf("Failed to create benchmark storage\n");
+
+        return;
+    }
+
+    size_t block_count = storage_block_count();
+    size_t record_size = storage_block_size();
+    char* record = malloc(record_size);
+    memset(record, 'x', record_size);
+
+    double bucket_time_us[FILL_LEVEL_BUCKETS] = { 0 };
+    size_t bucket_appends[FILL_LEVEL_BUCKETS] = { 0 };
+
+    storage_region region = storage_allocate_region();
+    storage_jump_to_region(region);
+
+    while (storage_free_block_count() > 0)
+    {
+        size_t used_blocks = block_count - storage_free_block_count();
+        size_t bucket = used_blocks * FILL_LEVEL_BUCKETS / block_count;
+
+        double start = current_time_us();
+        storage_write_in_region(record, record_size);
+        double elapsed = current_time_us() - start;
+
+        bucket_time_us[bucket] += elapsed;
+        bucket_appends[bucket]++;
+    }
+
+    free(record);
+    close_benchmark_storage();
+
+    printf("Append latency by storage fill level (%zu blocks)\n", block_count);
+
+    for (int i = 0; i < FILL_LEVEL_BUCKETS; i++)
+    {
+        if (bucket_appends[i] == 0)
+        {
+            continue;
+        }
+
+        printf("  %3d%% - %3d%%: %8.2f us per append (%zu appends)\n",
+            i * 100 / FILL_LEVEL_BUCKETS, (i + 1) * 100 / FILL_LEVEL_BUCKETS,
+            bucket_time_us[i] / bucket_appends[i], bucket_appends[i]);
+    }
+}
+
+void benchmark_record_append(const char* name, int length_flush_interval)
+{
+    // Append small records to a single file, writing its length to its
+    // metadata either on every append or only when the file is closed
+    size_t block_size = storage_default_options().block_size;
+    size_t block_count =
+        (size_t)APPEND_RECORD_SIZE * APPEND_RECORD_COUNT / block_size + 16;
+
+    if (open_benchmark_storage(block_size, block_count) == -1)
+    {
+        printf("  %-16s: failed to create benchmark storage\n", name);
+
+        return;
+    }
+
+    set_length_flush_interval_virtual(length_flush_interval);
+
+    char record[APPEND_RECORD_SIZE];
+    memset(record, 'x', APPEND_RECORD_SIZE);
+
+    double start = current_time_us();
+
+    file_descriptor file = open_virtual("records", O_CREAT | O_APPEND);
+
+    for (int i = 0; i < APPEND_RECORD_COUNT; i++)
+    {
+        write_virtual(file, record, APPEND_RECORD_SIZE);
+    }
+
+    close_virtual(file);
+
+    double elapsed = current_time_us() - start;
+
+    set_length_flush_interval_virtual(-1);
+    close_benchmark_storage();
+
+    printf("  %-16s: %8.3f us per append, %8.2f s total\n", name,
+        elapsed / APPEND_RECORD_COUNT, elapsed / 1e6);
+}
+
+void benchmark_record_appends()
+{
+    printf("Appending %d records of %d bytes\n", APPEND_RECORD_COUNT,
+        APPEND_RECORD_SIZE);
+
+    benchmark_record_append("length per write", 0);
+    benchmark_record_append("length on close", -1);
+}
+
+void benchmark_log_write(const char* name, bool vectored)
+{
+    // Write log records that are each assembled from a header, a payload and
+    // a trailer, either with one write per piece or one vectored write
+    size_t block_size = storage_default_options().block_size;
+    size_t record_size = LOG_RECORD_HEADER_SIZE + LOG_RECORD_PAYLOAD_SIZE
+        + LOG_RECORD_TRAILER_SIZE;
+    size_t block_count = record_size * LOG_RECORD_COUNT / block_size + 16;
+
+    if (open_benchmark_storage(block_size, block_count) == -1)
+    {
+        printf("  %-16s: failed to create benchmark storage\n", name);
+
+        return;
+    }
+
+    char header[LOG_RECORD_HEADER_SIZE];
+    char payload[LOG_RECORD_PAYLOAD_SIZE];
+    char trailer[LOG_RECORD_TRAILER_SIZE];
+    memset(header, 'h', LOG_RECORD_HEADER_SIZE);
+    memset(payload, 'p', LOG_RECORD_PAYLOAD_SIZE);
+    memset(trailer, 't', LOG_RECORD_TRAILER_SIZE);
+
+    struct iovec parts[] = { { header, LOG_RECORD_HEADER_SIZE },
+                             { payload, LOG_RECORD_PAYLOAD_SIZE },
+                             { trailer, LOG_RECORD_TRAILER_SIZE } };
+
+    file_descriptor file = open_virtual("log", O_CREAT | O_APPEND);
+
+    double start = current_time_us();
+
+    for (int i = 0; i < LOG_RECORD_COUNT; i++)
+    {
+        if (vectored)
+        {
+            writev_virtual(file, parts, 3);
+        }
+        else
+        {
+            write_virtual(file, header, LOG_RECORD_HEADER_SIZE);
+            write_virtual(file, payload, LOG_RECORD_PAYLOAD_SIZE);
+            write_virtual(file, trailer, LOG_RECORD_TRAILER_SIZE);
+        }
+    }
+
+    double elapsed = current_time_us() - start;
+
+    close_virtual(file);
+    close_benchmark_storage();
+
+    printf("  %-16s: %8.3f us per record\n", name, elapsed / LOG_RECORD_COUNT);
+}
+
+void benchmark_log_writes()
+{
+    printf("Writing %d log records of three parts\n", LOG_RECORD_COUNT);
+
+    benchmark_log_write("three writes", false);
+    benchmark_log_write("one writev", true);
+}
+
+void benchmark_block_size(size_t block_size)
+{
+    // Every file needs a metadata block and its content blocks, and a write
+    // that ends exactly at a block boundary allocates one extra block. The
+    // first block is reserved for the root directory
+    size_t block_count = 1;
+    size_t total_bytes = 0;
+
+    for (int i = 0; i < file_size_class_count_; i++)
+    {
+        size_t blocks_per_file =
+            (file_size_mix_[i].file_size + block_size) / block_size + 1;
+
+        block_count += file_size_mix_[i].file_count * blocks_per_file;
+        total_bytes += file_size_mix_[i].file_count * file_size_mix_[i].file_size;
+    }
+
+    if (open_benchmark_storage(block_size, block_count) == -1)
+    {
+        printf("  %7zu B: failed to create benchmark storage\n", block_size);
+
+        return;
+    }
+
+    char* chunk = malloc(TRANSFER_CHUNK_SIZE);
+    memset(chunk, 'x', TRANSFER_CHUNK_SIZE);
+
+    char path[32];
+
+    // Write every file in the mix in chunks
+    double write_start = current_time_us();
+
+    for (int i = 0; i < file_size_class_count_; i++)
+    {
+        for (int j = 0; j < file_size_mix_[i].file_count; j++)
+        {
+            snprintf(path, sizeof(path), "file%d_%d", i, j);
+            int file = open_virtual(path, O_CREAT);
+
+            for (size_t written = 0; written < file_size_mix_[i].file_size;
+                 written += TRANSFER_CHUNK_SIZE)
+            {
+                size_t bytes = file_size_mix_[i].file_size - written;
+                write_virtual(file, chunk, bytes < TRANSFER_CHUNK_SIZE
+                    ? bytes : TRANSFER_CHUNK_SIZE);
+            }
+
+            close_virtual(file);
+        }
+    }
+
+    double write_time = current_time_us() - write_start;
+
+    // Read every file back in chunks
+    double read_start = current_time_us();
+
+    for (int i = 0; i < file_size_class_count_; i++)
+    {
+        for (int j = 0; j < file_size_mix_[i].file_count; j++)
+        {
+            snprintf(path, sizeof(path), "file%d_%d", i, j);
+            int file = open_virtual(path, 0);
+
+            while (read_virtual(file, chunk, TRANSFER_CHUNK_SIZE) > 0)
+            {
+            }
+
+            close_virtual(file);
+        }
+    }
+
+    double read_time = current_time_us() - read_start;
+
+    free(chunk);
+    close_benchmark_storage();
+
+    printf("  %7zu B: write %8.2f MB/s, read %8.2f MB/s\n", block_size,
+        total_bytes / write_time, total_bytes / read_time);
+}
+
+void benchmark_block_sizes()
+{
+    printf("Throughput by block size\n");
+
+    for (int i = 0; i < block_size_sweep_count_; i++)
+    {
+        benchmark_block_size(block_size_sweep_[i]);
+    }
+}
+
+void benchmark_small_read_backend(const char* name, storage_backend backend)
+{
+    // Read small pieces from random positions of a region. Every read jumps to
+    // the start of the region and walks its blocks to the read position, so
+    // this measures seeking and small payload copies
+    storage_options options = storage_default_options();
+    options.backend = backend;
+
+    if (open_benchmark_storage_with(options) == -1)
+    {
+        printf("  %-6s: failed to create benchmark storage\n", name);
+
+        return;
+    }
+
+    char* data = malloc(SMALL_READ_REGION_SIZE);
+    memset(data, 'x', SMALL_READ_REGION_SIZE);
+
+    storage_region region = storage_allocate_region();
+    storage_jump_to_region(region);
+    storage_write_in_region(data, SMALL_READ_REGION_SIZE);
+
+    char buffer[SMALL_READ_SIZE];
+    srand(1);
+
+    double start = current_time_us();
+
+    for (int i = 0; i < SMALL_READ_COUNT; i++)
+    {
+        off_t position = rand() % (SMALL_READ_REGION_SIZE - SMALL_READ_SIZE);
+
+        storage_jump_to_region(region);
+        storage_seek_in_region(position);
+        storage_read_in_region(buffer, SMALL_READ_SIZE);
+    }
+
+    double elapsed = current_time_us() - start;
+
+    free(data);
+    close_benchmark_storage();
+
+    printf("  %-6s: %8.2f us per read\n", name, elapsed / SMALL_READ_COUNT);
+}
+
+void benchmark_small_reads()
+{
+    printf("Small random read latency by storage backend\n");
+
+    benchmark_small_read_backend("file", STORAGE_BACKEND_FILE);
+    benchmark_small_read_backend("mmap", STORAGE_BACKEND_MMAP);
+}
+
+void benchmark_lookup_cache(size_t cache_block_count)
+{
+    // Open files by path in a directory a few levels deep. Every open reads
+    // the same few directory and metadata blocks, which the block cache can
+    // keep in memory. The directory cache is disabled so that it doesn't
+    // avoid the directory reads
+    storage_options options = storage_default_options();
+    options.cache_block_count = cache_block_count;
+
+    if (open_benchmark_storage_with(options) == -1)
+    {
+        printf("  %4zu blocks: failed to create benchmark storage\n",
+            cache_block_count);
+
+        return;
+    }
+
+    directory_set_cache_capacity(0);
+
+    mkdir_virtual("usr");
+    mkdir_virtual("usr/share");
+    mkdir_virtual("usr/share/data");
+
+    char path[64];
+
+    for (int i = 0; i < LOOKUP_FILE_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "usr/share/data/file%d", i);
+        close_virtual(open_virtual(path, O_CREAT));
+    }
+
+    storage_cache_statistics before = storage_get_cache_statistics();
+    srand(1);
+
+    double start = current_time_us();
+
+    for (int i = 0; i < LOOKUP_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "usr/share/data/file%d",
+            rand() % LOOKUP_FILE_COUNT);
+        close_virtual(open_virtual(path, 0));
+    }
+
+    double elapsed = current_time_us() - start;
+
+    storage_cache_statistics after = storage_get_cache_statistics();
+    close_benchmark_storage();
+    directory_set_cache_capacity(DIRECTORY_DEFAULT_CACHE_CAPACITY);
+
+    printf("  %4zu blocks: %8.2f us per open, %zu hits, %zu misses\n",
+        cache_block_count, elapsed / LOOKUP_COUNT,
+        after.hits - before.hits, after.misses - before.misses);
+}
+
+void benchmark_lookup_caches()
+{
+    printf("Path lookup latency by block cache size\n");
+
+    for (int i = 0; i < cache_size_sweep_count_; i++)
+    {
+        benchmark_lookup_cache(cache_size_sweep_[i]);
+    }
+}
+
+void benchmark_directory_cache(size_t capacity)
+{
+    // Open existing and missing files by path in a directory a few levels
+    // deep without the block cache, so every directory read that the
+    // directory cache doesn't avoid goes to the storage file
+    if (open_benchmark_storage_with(storage_default_options()) == -1)
+    {
+        printf("  %4zu entries: failed to create benchmark storage\n",
+            capacity);
+
+        return;
+    }
+
+    directory_set_cache_capacity(capacity);
+
+    mkdir_virtual("usr");
+    mkdir_virtual("usr/share");
+    mkdir_virtual("usr/share/data");
+
+    char path[64];
+
+    for (int i = 0; i < LOOKUP_FILE_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "usr/share/data/file%d", i);
+        close_virtual(open_virtual(path, O_CREAT));
+    }
+
+    directory_cache_statistics before = directory_get_cache_statistics();
+    srand(1);
+
+    double start = current_time_us();
+
+    for (int i = 0; i < LOOKUP_COUNT; i++)
+    {
+        // Every fourth path is of a file that does not exist
+        snprintf(path, sizeof(path), "usr/share/data/%s%d",
+            i % 4 == 0 ? "missing" : "file", rand() % LOOKUP_FILE_COUNT);
+        close_virtual(open_virtual(path, 0));
+    }
+
+    double elapsed = current_time_us() - start;
+
+    directory_cache_statistics after = directory_get_cache_statistics();
+    close_benchmark_storage();
+    directory_set_cache_capacity(DIRECTORY_DEFAULT_CACHE_CAPACITY);
+
+    printf("  %4zu entries: %8.2f us per open, %zu hits, %zu negative hits, "
+        "%zu misses\n", capacity, elapsed / LOOKUP_COUNT,
+        after.hits - before.hits, after.negative_hits - before.negative_hits,
+        after.misses - before.misses);
+}
+
+void benchmark_directory_caches()
+{
+    printf("Path lookup latency by directory cache size\n");
+
+    for (int i = 0; i < directory_cache_sweep_count_; i++)
+    {
+        benchmark_directory_cache(directory_cache_sweep_[i]);
+    }
+}
+
+void benchmark_header_layout(const char* name, bool header_table)
+{
+    // Reopen a large storage file and seek to random positions of a long
+    // region. Opening loads every block header, and seeking walks the
+    // region's blocks using the loaded headers
+    storage_options options = storage_default_options();
+    options.path = BENCHMARK_STORAGE_PATH;
+    options.block_count = LAYOUT_BLOCK_COUNT;
+    options.header_table = header_table;
+
+    if (open_benchmark_storage_with(options) == -1)
+    {
+        printf("  %-6s: failed to create benchmark storage\n", name);
+
+        return;
+    }
+
+    size_t region_size = LAYOUT_REGION_BLOCKS * storage_block_size();
+    char* data = malloc(region_size);
+    memset(data, 'x', region_size);
+
+    storage_region region = storage_allocate_region();
+    storage_jump_to_region(region);
+    storage_write_in_region(data, region_size);
+
+    storage_close();
+
+    double open_start = current_time_us();
+
+    if (storage_initialize_with(&options) == -1)
+    {
+        printf("  %-6s: failed to reopen benchmark storage\n", name);
+        free(data);
+        remove(BENCHMARK_STORAGE_PATH);
+
+        return;
+    }
+
+    double open_time = current_time_us() - open_start;
+
+    srand(1);
+
+    double seek_start = current_time_us();
+
+    for (int i = 0; i < LAYOUT_SEEK_COUNT; i++)
+    {
+        storage_jump_to_region(region);
+        storage_seek_in_region(rand() % region_size);
+    }
+
+    double seek_time = current_time_us() - seek_start;
+
+    free(data);
+    close_benchmark_storage();
+
+    printf("  %-6s: open %8.2f ms, %8.2f us per seek\n", name,
+        open_time / 1000, seek_time / LAYOUT_SEEK_COUNT);
+}
+
+void benchmark_header_layouts()
+{
+    printf("Open and seek latency by block header layout (%d blocks)\n",
+        LAYOUT_BLOCK_COUNT);
+
+    benchmark_header_layout("inline", false);
+    benchmark_header_layout("table", true);
+}
+
+void benchmark_file_seeks()
+{
+    // Alternate between two large open files, seeking to a random position
+    // in one of them and reading a little from there. Every switch between
+    // the files and every seek moves the storage position within a file's
+    // content region
+    if (open_benchmark_storage(storage_default_options().block_size,
+                               SEEK_BLOCK_COUNT) == -1)
+    {
+        printf("Failed to create benchmark storage\n");
+
+        return;
+    }
+
+    char* data = malloc(SEEK_FILE_SIZE / 2);
+    memset(data, 'x', SEEK_FILE_SIZE / 2);
+
+    int files[2] = { open_virtual("first", O_CREAT),
+                     open_virtual("second", O_CREAT) };
+
+    for (int i = 0; i < 2; i++)
+    {
+        write_virtual(files[i], data, SEEK_FILE_SIZE / 2);
+    }
+
+    char buffer[SMALL_READ_SIZE];
+    srand(1);
+
+    double start = current_time_us();
+
+    for (int i = 0; i < SEEK_COUNT; i++)
+    {
+        int file = files[i % 2];
+
+        seek_virtual(file, rand() % (SEEK_FILE_SIZE / 2 - SMALL_READ_SIZE),
+                     SEEK_SET);
+        read_virtual(file, buffer, SMALL_READ_SIZE);
+    }
+
+    double elapsed = current_time_us() - start;
+
+    // The same reads with an explicit offset instead of a seek
+    srand(1);
+    start = current_time_us();
+
+    for (int i = 0; i < SEEK_COUNT; i++)
+    {
+        pread_virtual(files[i % 2], buffer, SMALL_READ_SIZE,
+                      rand() % (SEEK_FILE_SIZE / 2 - SMALL_READ_SIZE));
+    }
+
+    double positional_elapsed = current_time_us() - start;
+
+    close_virtual(files[0]);
+    close_virtual(files[1]);
+    free(data);
+    close_benchmark_storage();
+
+    printf("Random seek and read in two %d KiB files: %8.2f us per read\n",
+        SEEK_FILE_SIZE / 2 / 1024, elapsed / SEEK_COUNT);
+    printf("Random pread in two %d KiB files:         %8.2f us per read\n",
+        SEEK_FILE_SIZE / 2 / 1024, positional_elapsed / SEEK_COUNT);
+}
+
+void benchmark_interleaved_reads()
+{
+    // Read many open files sequentially at the same time, a small piece from
+    // each file in turn, like a program merging several input files would
+    size_t block_size = storage_default_options().block_size;
+    size_t blocks_per_file = INTERLEAVED_FILE_SIZE / block_size + 2;
+
+    if (open_benchmark_storage(block_size, INTERLEAVED_FILE_COUNT
+                               * blocks_per_file + 1) == -1)
+    {
+        printf("Failed to create benchmark storage\n");
+
+        return;
+    }
+
+    char* data = malloc(INTERLEAVED_FILE_SIZE);
+    memset(data, 'x', INTERLEAVED_FILE_SIZE);
+
+    int files[INTERLEAVED_FILE_COUNT];
+    char path[32];
+
+    for (int i = 0; i < INTERLEAVED_FILE_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "input%d", i);
+        files[i] = open_virtual(path, O_CREAT);
+        write_virtual(files[i], data, INTERLEAVED_FILE_SIZE);
+        seek_virtual(files[i], 0, SEEK_SET);
+    }
+
+    char buffer[INTERLEAVED_READ_SIZE];
+    size_t read_count = 0;
+
+    double start = current_time_us();
+
+    for (size_t position = 0; position < INTERLEAVED_FILE_SIZE;
+         position += INTERLEAVED_READ_SIZE)
+    {
+        for (int i = 0; i < INTERLEAVED_FILE_COUNT; i++)
+        {
+            read_virtual(files[i], buffer, INTERLEAVED_READ_SIZE);
+            read_count++;
+        }
+    }
+
+    double elapsed = current_time_us() - start;
+
+    for (int i = 0; i < INTERLEAVED_FILE_COUNT; i++)
+    {
+        close_virtual(files[i]);
+    }
+
+    free(data);
+    close_benchmark_storage();
+
+    printf("Interleaved reads of %d open files: %8.2f us per read\n",
+        INTERLEAVED_FILE_COUNT, elapsed / read_count);
+}
+
+#ifdef _MSC_VER
+DWORD WINAPI read_in_parallel(LPVOID argument)
+#else
+void* read_in_parallel(void* argument)
+#endif
+{
+    // Read blocks from random offsets of the thread's own file
+    parallel_reader* reader = argument;
+    char buffer[PARALLEL_READ_SIZE];
+
+    for (int i = 0; i < PARALLEL_READ_COUNT; i++)
+    {
+        reader->seed = reader->seed * 1103515245u + 12345u;
+        off_t offset = (reader->seed >> 8)
+            % (PARALLEL_FILE_SIZE / PARALLEL_READ_SIZE) * PARALLEL_READ_SIZE;
+
+        pread_virtual(reader->file, buffer, PARALLEL_READ_SIZE, offset);
+    }
+
+    return 0;
+}
+
+void benchmark_parallel_read(int thread_count, file_descriptor* files)
+{
+    parallel_reader readers[PARALLEL_MAX_THREADS];
+
+#ifdef _MSC_VER
+    HANDLE threads[PARALLEL_MAX_THREADS];
+#else
+    pthread_t threads[PARALLEL_MAX_THREADS];
+#endif
+
+    double start = current_time_us();
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        readers[i] = (parallel_reader) { files[i], i + 1 };
+
+#ifdef _MSC_VER
+        threads[i] = CreateThread(NULL, 0, read_in_parallel, &readers[i], 0,
+                                  NULL);
+#else
+        pthread_create(&threads[i], NULL, read_in_parallel, &readers[i]);
+#endif
+    }
+
+    for (int i = 0; i < thread_count; i++)
+    {
+#ifdef _MSC_VER
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+
+    double elapsed = current_time_us() - start;
+    double megabytes = (double)thread_count * PARALLEL_READ_COUNT
+        * PARALLEL_READ_SIZE / (1024 * 1024);
+
+    printf("  %d thread%s: %8.1f MiB/s\n", thread_count,
+        thread_count == 1 ? " " : "s", megabytes / (elapsed / 1e6));
+}
+
+void benchmark_parallel_reads()
+{
+    // Each thread reads a file of its own, so the threads only share the
+    // storage underneath
+    size_t block_size = 4096;
+    size_t blocks_per_file = PARALLEL_FILE_SIZE / block_size + 2;
+
+    if (open_benchmark_storage(block_size, PARALLEL_MAX_THREADS
+                               * blocks_per_file + 16) == -1)
+    {
+        printf("Failed to create benchmark storage\n");
+
+        return;
+    }
+
+    char* data = malloc(PARALLEL_FILE_SIZE);
+    memset(data, 'x', PARALLEL_FILE_SIZE);
+
+    file_descriptor files[PARALLEL_MAX_THREADS];
+    char path[32];
+
+    for (int i = 0; i < PARALLEL_MAX_THREADS; i++)
+    {
+        snprintf(path, sizeof(path), "parallel%d", i);
+        files[i] = open_virtual(path, O_CREAT);
+        write_virtual(files[i], data, PARALLEL_FILE_SIZE);
+    }
+
+    printf("Parallel reads of %d-byte pieces, one file per thread\n",
+        PARALLEL_READ_SIZE);
+
+    for (int i = 0; i < thread_count_sweep_count_; i++)
+    {
+        benchmark_parallel_read(thread_count_sweep_[i], files);
+    }
+
+    for (int i = 0; i < PARALLEL_MAX_THREADS; i++)
+    {
+        close_virtual(files[i]);
+    }
+
+    free(data);
+    close_benchmark_storage();
+}
+
+off_t random_queued_read_offset()
+{
+    return rand() % (QUEUED_FILE_SIZE / QUEUED_READ_SIZE) * QUEUED_READ_SIZE;
+}
+
+void benchmark_queued_read(int worker_count, file_descriptor* files,
+                           char* buffers)
+{
+    // Keep QUEUED_READ_DEPTH reads in progress, submitting a new read for
+    // every completed one. Each read has a buffer of its own, whose index is
+    // passed through the queue
+    virtual_queue* queue =
+        create_queue_virtual(worker_count, QUEUED_READ_DEPTH);
+
+    if (queue == NULL)
+    {
+        printf("  %d worker%s: failed to create queue\n", worker_count,
+            worker_count == 1 ? " " : "s");
+
+        return;
+    }
+
+    queue_request requests[QUEUED_READ_DEPTH];
+    queue_completion completions[QUEUED_READ_DEPTH];
+
+    for (int i = 0; i < QUEUED_READ_DEPTH; i++)
+    {
+        requests[i] = (queue_request) {
+            QUEUE_READ, files[rand() % QUEUED_FILE_COUNT],
+            buffers + i * QUEUED_READ_SIZE, QUEUED_READ_SIZE,
+            random_queued_read_offset(), NULL, 0, (void*)(intptr_t)i
+        };
+    }
+
+    double start = current_time_us();
+
+    int submitted_count = submit_virtual(queue, requests, QUEUED_READ_DEPTH);
+    int completed_count = 0;
+
+    while (completed_count < QUEUED_READ_COUNT)
+    {
+        int reaped_count = reap_virtual(queue, completions,
+                                        QUEUED_READ_DEPTH, 1);
+        int resubmitted_count = 0;
+
+        for (int i = 0; i < reaped_count; i++)
+        {
+            if (submitted_count + resubmitted_count < QUEUED_READ_COUNT)
+            {
+                int buffer = (int)(intptr_t)completions[i].user_data;
+
+                requests[resubmitted_count] = (queue_request) {
+                    QUEUE_READ, files[rand() % QUEUED_FILE_COUNT],
+                    buffers + buffer * QUEUED_READ_SIZE, QUEUED_READ_SIZE,
+                    random_queued_read_offset(), NULL, 0,
+                    completions[i].user_data
+                };
+                resubmitted_count++;
+            }
+        }
+
+        completed_count += reaped_count;
+        submitted_count += submit_virtual(queue, requests, resubmitted_count);
+    }
+
+    double elapsed = current_time_us() - start;
+
+    destroy_queue_virtual(queue);
+
+    printf("  %d worker%s: %8.2f us per read\n", worker_count,
+        worker_count == 1 ? " " : "s", elapsed / QUEUED_READ_COUNT);
+}
+
+void benchmark_queued_reads()
+{
+    // Random reads from several files, first one at a time with
+    // pread_virtual() and then through queues with QUEUED_READ_DEPTH reads
+    // in progress
+    size_t block_size = 4096;
+    size_t blocks_per_file = QUEUED_FILE_SIZE / block_size + 2;
+
+    if (open_benchmark_storage(block_size, QUEUED_FILE_COUNT
+                               * blocks_per_file + 16) == -1)
+    {
+        printf("Failed to create benchmark storage\n");
+
+        return;
+    }
+
+    char* data = malloc(QUEUED_FILE_SIZE);
+    char* buffers = malloc(QUEUED_READ_DEPTH * QUEUED_READ_SIZE);
+    memset(data, 'x', QUEUED_FILE_SIZE);
+
+    file_descriptor files[QUEUED_FILE_COUNT];
+    char path[32];
+
+    for (int i = 0; i < QUEUED_FILE_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "queued%d", i);
+        files[i] = open_virtual(path, O_CREAT);
+        write_virtual(files[i], data, QUEUED_FILE_SIZE);
+    }
+
+    printf("Random reads of %d-byte pieces from %d files\n",
+        QUEUED_READ_SIZE, QUEUED_FILE_COUNT);
+
+    srand(1);
+    double start = current_time_us();
+
+    for (int i = 0; i < QUEUED_READ_COUNT; i++)
+    {
+        pread_virtual(files[rand() % QUEUED_FILE_COUNT], buffers,
+                      QUEUED_READ_SIZE, random_queued_read_offset());
+    }
+
+    double elapsed = current_time_us() - start;
+
+    printf("  blocking:  %8.2f us per read\n", elapsed / QUEUED_READ_COUNT);
+
+    for (int i = 0; i < queue_worker_sweep_count_; i++)
+    {
+        benchmark_queued_read(queue_worker_sweep_[i], files, buffers);
+    }
+
+    for (int i = 0; i < QUEUED_FILE_COUNT; i++)
+    {
+        close_virtual(files[i]);
+    }
+
+    free(data);
+    free(buffers);
+    close_benchmark_storage();
+}
+
+void benchmark_open_file_count(int file_count)
+{
+    // Hold many files open and keep closing a random one and opening it
+    // again, like a server with a descriptor per connection would. Every file
+    // takes a metadata and a content block
+    size_t block_size = storage_default_options().block_size;
+
+    if (open_benchmark_storage(block_size, file_count * 2 + 64) == -1)
+    {
+        printf("  %6d open files: failed to create benchmark storage\n",
+            file_count);
+
+        return;
+    }
+
+    mkdir_virtual("open");
+
+    int* files = malloc(file_count * sizeof(int));
+    char path[32];
+    double start = current_time_us();
+
+    for (int i = 0; i < file_count; i++)
+    {
+        snprintf(path, sizeof(path), "open/file%d", i);
+        files[i] = open_virtual(path, O_CREAT);
+    }
+
+    double open_elapsed = current_time_us() - start;
+
+    srand(1);
+    start = current_time_us();
+
+    for (int i = 0; i < DESCRIPTOR_REOPEN_COUNT; i++)
+    {
+        int file = rand() % file_count;
+
+        snprintf(path, sizeof(path), "open/file%d", file);
+        close_virtual(files[file]);
+        files[file] = open_virtual(path, 0);
+    }
+
+    double reopen_elapsed = current_time_us() - start;
+
+    for (int i = 0; i < file_count; i++)
+    {
+        close_virtual(files[i]);
+    }
+
+    free(files);
+    close_benchmark_storage();
+
+    printf("  %6d open files: %8.2f us per create, %8.2f us per reopen\n",
+        file_count, open_elapsed / file_count,
+        reopen_elapsed / DESCRIPTOR_REOPEN_COUNT);
+}
+
+void benchmark_open_file_counts()
+{
+    printf("File open latency by number of open files\n");
+
+    for (int i = 0; i < open_file_count_sweep_count_; i++)
+    {
+        benchmark_open_file_count(open_file_count_sweep_[i]);
+    }
+}
+
+void benchmark_directory_size(const char* name, directory_format format,
+                              int entry_count)
+{
+    // Open random files by name in a single directory. Every file takes a
+    // metadata and a content block, and the directory itself needs a few
+    // more blocks for its entries. The directory cache is disabled so that
+    // every open reads the directory
+    size_t block_size = storage_default_options().block_size;
+
+    if (open_benchmark_storage(block_size, entry_count * 3 + 16) == -1)
+    {
+        printf("  %-6s %6d entries: failed to create benchmark storage\n",
+            name, entry_count);
+
+        return;
+    }
+
+    directory_set_default_format(format);
+    directory_set_cache_capacity(0);
+    mkdir_virtual("directory");
+
+    char path[64];
+    double start = current_time_us();
+
+    for (int i = 0; i < entry_count; i++)
+    {
+        snprintf(path, sizeof(path), "directory/file%d", i);
+        close_virtual(open_virtual(path, O_CREAT));
+    }
+
+    double creation_elapsed = current_time_us() - start;
+
+    srand(1);
+    start = current_time_us();
+
+    for (int i = 0; i < DIRECTORY_LOOKUP_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "directory/file%d", rand() % entry_count);
+        close_virtual(open_virtual(path, 0));
+    }
+
+    double lookup_elapsed = current_time_us() - start;
+
+    close_benchmark_storage();
+    directory_set_default_format(DIRECTORY_FORMAT_HASHED);
+    directory_set_cache_capacity(DIRECTORY_DEFAULT_CACHE_CAPACITY);
+
+    printf("  %-6s %6d entries: %9.2f us per create, %9.2f us per open\n",
+        name, entry_count, creation_elapsed / entry_count,
+        lookup_elapsed / DIRECTORY_LOOKUP_COUNT);
+}
+
+void benchmark_directory_sizes()
+{
+    // Creating files in a flat or tagged directory goes through every
+    // existing entry, so they are only measured up to a size that fills
+    // quickly
+    printf("File open latency by directory size\n");
+
+    for (int i = 0; i < directory_size_sweep_count_; i++)
+    {
+        if (directory_size_sweep_[i] <= FLAT_DIRECTORY_MAX_ENTRIES)
+        {
+            benchmark_directory_size("flat", DIRECTORY_FORMAT_FLAT,
+                                     directory_size_sweep_[i]);
+            benchmark_directory_size("tagged", DIRECTORY_FORMAT_TAGGED,
+                                     directory_size_sweep_[i]);
+        }
+
+        benchmark_directory_size("hashed", DIRECTORY_FORMAT_HASHED,
+                                 directory_size_sweep_[i]);
+        benchmark_directory_size("btree", DIRECTORY_FORMAT_BTREE,
+                                 directory_size_sweep_[i]);
+    }
+}
+
+void benchmark_directory_listing(const char* name, directory_format format)
+{
+    // List a large directory in order a page at a time, continuing each page
+    // from the last entry of the previous one
+    size_t block_size = storage_default_options().block_size;
+
+    if (open_benchmark_storage(block_size, LISTING_ENTRY_COUNT * 3 + 16) == -1)
+    {
+        printf("  %-6s: failed to create benchmark storage\n", name);
+
+        return;
+    }
+
+    directory_set_default_format(format);
+    mkdir_virtual("directory");
+
+    char path[64];
+
+    for (int i = 0; i < LISTING_ENTRY_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "directory/file%d", i);
+        close_virtual(open_virtual(path, O_CREAT));
+    }
+
+    virtual_directory_entry page[LISTING_PAGE_SIZE];
+    int listed_count = 0;
+    int page_count = 0;
+
+    double start = current_time_us();
+
+    while (true)
+    {
+        int entry_count = readdir_virtual("directory",
+            page_count > 0 ? &page[LISTING_PAGE_SIZE - 1] : NULL, page,
+            LISTING_PAGE_SIZE);
+
+        if (entry_count <= 0)
+        {
+            break;
+        }
+
+        listed_count += entry_count;
+        page_count++;
+
+        if (entry_count < LISTING_PAGE_SIZE)
+        {
+            break;
+        }
+    }
+
+    double elapsed = current_time_us() - start;
+
+    close_benchmark_storage();
+    directory_set_default_format(DIRECTORY_FORMAT_HASHED);
+
+    printf("  %-6s: %9.2f us per page of %d, %d entries listed\n", name,
+        elapsed / page_count, LISTING_PAGE_SIZE, listed_count);
+}
+
+void benchmark_directory_listings()
+{
+    printf("Paged listing of a directory of %d entries\n",
+        LISTING_ENTRY_COUNT);
+
+    benchmark_directory_listing("hashed", DIRECTORY_FORMAT_HASHED);
+    benchmark_directory_listing("btree", DIRECTORY_FORMAT_BTREE);
+}
+
+int main()
+{
+    benchmark_storage_creations();
+    benchmark_storage_growths();
+    benchmark_hole_punches();
+    benchmark_compactions();
+    benchmark_journals();
+    benchmark_append_latency();
+    benchmark_record_appends();
+    benchmark_log_writes();
+    benchmark_block_sizes();
+    benchmark_small_reads();
+    benchmark_lookup_caches();
+    benchmark_directory_caches();
+    benchmark_header_layouts();
+    benchmark_file_seeks();
+    benchmark_interleaved_reads();
+    benchmark_parallel_reads();
+    benchmark_queued_reads();
+    benchmark_open_file_counts();
+    benchmark_directory_sizes();
+    benchmark_directory_listings();
+
+    return 0;
+}
@@ -0,0 +1,375 @@
+// Cached entries are found through a hash table of their keys, and a doubly
+// linked list ordered by last use decides which entry is evicted next. Both
+// link entries by their indices in a single array of entries that is
+// allocated once. Each entry keeps a copy of its name, so finding an entry
+// never reads the storage.
+
+#include "directoryCache.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_ENTRY ((size_t)-1)
+
+typedef struct directory_cache_entry
+{
+    storage_region directory;
+    char type;
+    bool negative;
+    uint32_t name_hash;
+    unsigned char name_length;
+    char name[UCHAR_MAX];
+
+    storage_region metadata_region;
+    storage_region content_region;
+
+    // Neighbours in the list ordered by last use
+    size_t newer_entry;
+    size_t older_entry;
+
+    // Next entry in the same hash table bucket
+    size_t next_in_bucket;
+} directory_cache_entry;
+
+static size_t capacity_ = 0;
+static size_t used_entries_ = 0;
+static directory_cache_entry* entries_ = NULL;
+
+static size_t* buckets_ = NULL;
+static size_t bucket_mask_ = 0;
+
+static size_t newest_entry_ = NO_ENTRY;
+static size_t oldest_entry_ = NO_ENTRY;
+
+// Entries removed by directory_cache_forget_directory() are reused before
+// unused entries at the end of the array
+static size_t first_free_entry_ = NO_ENTRY;
+
+static directory_cache_statistics statistics_;
+
+static size_t find_entry(storage_region directory, const char* name,
+                         size_t name_length, uint32_t name_hash,
+                         entry_type type);
+static size_t take_free_entry();
+static void remove_entry(size_t entry);
+static void remove_from_bucket(size_t entry);
+static void unlink_entry(size_t entry);
+static void link_as_newest(size_t entry);
+static size_t bucket_of(storage_region directory, uint32_t name_hash);
+static uint32_t hash_name(const char* name, size_t name_length);
+
+int directory_cache_initialize(size_t capacity)
+{
+    directory_cache_finalize();
+
+    if (capacity == 0)
+    {
+        return 0;
+    }
+
+    // The hash table has at least twice as many buckets as there are entries
+    // to keep the chains short
+    size_t bucket_count = 1;
+
+    while (bucket_count < capacity * 2)
+    {
+        bucket_count *= 2;
+    }
+
+    entries_ = malloc(capacity * sizeof(directory_cache_entry));
+    buckets_ = malloc(bucket_count * sizeof(size_t));
+
+    if (entries_ == NULL || buckets_ == NULL)
+    {
+        directory_cache_finalize();
+
+        return -1;
+    }
+
+    capacity_ = capacity;
+    bucket_mask_ = bucket_count - 1;
+
+    directory_cache_clear();
+
+    return 0;
+}
+
+void directory_cache_finalize()
+{
+    free(entries_);
+    free(buckets_);
+
+    entries_ = NULL;
+    buckets_ = NULL;
+
+    capacity_ = 0;
+    used_entries_ = 0;
+    newest_entry_ = NO_ENTRY;
+    oldest_entry_ = NO_ENTRY;
+    first_free_entry_ = NO_ENTRY;
+
+    memset(&statistics_, 0, sizeof(statistics_));
+}
+
+bool directory_cache_enabled()
+{
+    return capacity_ > 0;
+}
+
+directory_cache_result directory_cache_find(storage_region directory,
+                                            const char* name,
+                                            entry_type type,
+                                            directory_entry* entry)
+{
+    if (!directory_cache_enabled())
+    {
+        return DIRECTORY_CACHE_MISS;
+    }
+
+    size_t name_length = strlen(name);
+    size_t cached_entry = find_entry(directory, name, name_length,
+                                     hash_name(name, name_length), type);
+
+    if (cached_entry == NO_ENTRY)
+    {
+        statistics_.misses++;
+
+        return DIRECTORY_CACHE_MISS;
+    }
+
+    unlink_entry(cached_entry);
+    link_as_newest(cached_entry);
+
+    if (entries_[cached_entry].negative)
+    {
+        statistics_.negative_hits++;
+
+        return DIRECTORY_CACHE_NEGATIVE_HIT;
+    }
+
+    statistics_.hits++;
+
+    *entry = (directory_entry) { type, entries_[cached_entry].metadata_region,
+                                 entries_[cached_entry].content_region };
+
+    return DIRECTORY_CACHE_HIT;
+}
+
+void directory_cache_store(storage_region directory, const char* name,
+                           entry_type type, const directory_entry* entry)
+{
+    size_t name_length = strlen(name);
+
+    // Names that are too long to be stored in a directory are not cached
+    if (!directory_cache_enabled() || name_length > UCHAR_MAX)
+    {
+        return;
+    }
+
+    uint32_t name_hash = hash_name(name, name_length);
+    size_t cached_entry =
+        find_entry(directory, name, name_length, name_hash, type);
+
+    if (cached_entry != NO_ENTRY)
+    {
+        unlink_entry(cached_entry);
+    }
+    else
+    {
+        cached_entry = take_free_entry();
+
+        entries_[cached_entry].directory = directory;
+        entries_[cached_entry].type = type;
+        entries_[cached_entry].name_hash = name_hash;
+        entries_[cached_entry].name_length = name_length;
+        memcpy(entries_[cached_entry].name, name, name_length);
+
+        size_t bucket = bucket_of(directory, name_hash);
+        entries_[cached_entry].next_in_bucket = buckets_[bucket];
+        buckets_[bucket] = cached_entry;
+    }
+
+    entries_[cached_entry].negative = entry == NULL;
+
+    if (entry != NULL)
+    {
+        entries_[cached_entry].metadata_region = entry->metadata_region;
+        entries_[cached_entry].content_region = entry->content_region;
+    }
+
+    link_as_newest(cached_entry);
+}
+
+void directory_cache_forget_directory(storage_region directory)
+{
+    if (!directory_cache_enabled())
+    {
+        return;
+    }
+
+    // The entries of a directory are spread over the hash table by their
+    // names, so the whole list of entries has to be gone through
+    size_t entry = newest_entry_;
+
+    while (entry != NO_ENTRY)
+    {
+        size_t older_entry = entries_[entry].older_entry;
+
+        if (entries_[entry].directory == directory)
+        {
+            remove_entry(entry);
+        }
+
+        entry = older_entry;
+    }
+}
+
+void directory_cache_clear()
+{
+    for (size_t i = 0; i <= bucket_mask_ && buckets_ != NULL; i++)
+    {
+        buckets_[i] = NO_ENTRY;
+    }
+
+    used_entries_ = 0;
+    newest_entry_ = NO_ENTRY;
+    oldest_entry_ = NO_ENTRY;
+    first_free_entry_ = NO_ENTRY;
+}
+
+directory_cache_statistics directory_cache_get_statistics()
+{
+    return statistics_;
+}
+
+static size_t find_entry(storage_region directory, const char* name,
+                         size_t name_length, uint32_t name_hash,
+                         entry_type type)
+{
+    size_t entry = buckets_[bucket_of(directory, name_hash)];
+
+    while (entry != NO_ENTRY
+           && (entries_[entry].directory != directory
+               || entries_[entry].type != (char)type
+               || entries_[entry].name_hash != name_hash
+               || entries_[entry].name_length != name_length
+               || memcmp(entries_[entry].name, name, name_length) != 0))
+    {
+        entry = entries_[entry].next_in_bucket;
+    }
+
+    return entry;
+}
+
+static size_t take_free_entry()
+{
+    if (first_free_entry_ != NO_ENTRY)
+    {
+        size_t entry = first_free_entry_;
+        first_free_entry_ = entries_[entry].next_in_bucket;
+
+        return entry;
+    }
+
+    if (used_entries_ < capacity_)
+    {
+        return used_entries_++;
+    }
+
+    // The cache is full: evict the least recently used entry
+    size_t entry = oldest_entry_;
+
+    statistics_.evictions++;
+
+    remove_from_bucket(entry);
+    unlink_entry(entry);
+
+    return entry;
+}
+
+static void remove_entry(size_t entry)
+{
+    // Removed entries are kept in a list of free entries linked through
+    // their bucket links
+    remove_from_bucket(entry);
+    unlink_entry(entry);
+
+    entries_[entry].next_in_bucket = first_free_entry_;
+    first_free_entry_ = entry;
+}
+
+static void remove_from_bucket(size_t entry)
+{
+    size_t* link =
+        &buckets_[bucket_of(entries_[entry].directory, entries_[entry].name_hash)];
+
+    while (*link != entry)
+    {
+        link = &entries_[*link].next_in_bucket;
+    }
+
+    *link = entries_[entry].next_in_bucket;
+}
+
+static void unlink_entry(size_t entry)
+{
+    size_t newer_entry = entries_[entry].newer_entry;
+    size_t older_entry = entries_[entry].older_entry;
+
+    if (newer_entry != NO_ENTRY)
+    {
+        entries_[newer_entry].older_entry = older_entry;
+    }
+    else
+    {
+        newest_entry_ = older_entry;
+    }
+
+    if (older_entry != NO_ENTRY)
+    {
+        entries_[older_entry].newer_entry = newer_entry;
+    }
+    else
+    {
+        oldest_entry_ = newer_entry;
+    }
+}
+
+static void link_as_newest(size_t entry)
+{
+    entries_[entry].newer_entry = NO_ENTRY;
+    entries_[entry].older_entry = newest_entry_;
+
+    if (newest_entry_ != NO_ENTRY)
+    {
+        entries_[newest_entry_].newer_entry = entry;
+    }
+
+    newest_entry_ = entry;
+
+    if (oldest_entry_ == NO_ENTRY)
+    {
+        oldest_entry_ = entry;
+    }
+}
+
+static size_t bucket_of(storage_region directory, uint32_t name_hash)
+{
+    // Multiplicative hashing mixes the directory into the name hash
+    return (name_hash ^ (directory * 2654435761u)) & bucket_mask_;
+}
+
+static uint32_t hash_name(const char* name, size_t name_length)
+{
+    // 32-bit FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < name_length; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+
+    return hash;
+}
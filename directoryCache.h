@@ -0,0 +1,41 @@
+#ifndef DIRECTORYCACHE_H
+#define DIRECTORYCACHE_H
+
+// This module implements a fixed-size cache of directory entries for the
+// virtualDirectory module. Entries are looked up by the content region of
+// the directory they are in, their name and their type. The cache also keeps
+// negative entries for names that were looked up but did not exist, so that
+// looking them up again doesn't read the directory either. Entries are
+// evicted in least recently used order. The cache has no lock of its own:
+// the virtualDirectory module serializes all calls to it.
+
+#include "virtualDirectory.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum { DIRECTORY_CACHE_MISS, DIRECTORY_CACHE_HIT,
+               DIRECTORY_CACHE_NEGATIVE_HIT } directory_cache_result;
+
+int directory_cache_initialize(size_t capacity);
+void directory_cache_finalize();
+bool directory_cache_enabled();
+
+directory_cache_result directory_cache_find(storage_region directory,
+                                            const char* name,
+                                            entry_type type,
+                                            directory_entry* entry);
+
+// Stores an entry for the name, or a negative entry if the entry is NULL,
+// replacing the cached entry for the same name and type if there is one
+void directory_cache_store(storage_region directory, const char* name,
+                           entry_type type, const directory_entry* entry);
+
+// Removes all entries of a directory, used when its content region starts
+// holding a new directory
+void directory_cache_forget_directory(storage_region directory);
+void directory_cache_clear();
+
+directory_cache_statistics directory_cache_get_statistics();
+
+#endif // DIRECTORYCACHE_H
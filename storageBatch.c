@@ -0,0 +1,519 @@
+// A batch keeps its reads in an array, and the parts of all reads back to
+// back in another, so adding a read doesn't allocate once the arrays have
+// grown to the size of a typical batch. Reads refer to their parts by index,
+// as the array of parts may move while it grows. Held locks are kept in a
+// third array, which is searched from the start, as a batch holds the locks
+// of only a few files.
+
+// The ring is set up with the io_uring system calls directly rather than
+// through liburing, so that the module has no dependencies. Each batch has a
+// ring of its own, which is only used by the thread issuing the batch. Reads
+// are submitted up to a ring's worth at a time, and every read that fails or
+// comes up short in the ring is made again with the read function. If the
+// ring stops working after some reads of a batch have been submitted, the
+// reads that haven't completed are made with the read function and the ring
+// is given up, so later batches are read without it.
+
+#include "storageBatch.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define BATCH_RING_AVAILABLE
+#endif
+#endif
+
+#define BATCH_RING_SIZE 64
+#define MIN_BATCH_CAPACITY 16
+
+typedef struct batch_read
+{
+    off_t position;
+    size_t n_bytes;
+    size_t first_part;
+    int part_count;
+
+    // Set if the read fails, or NULL
+    bool* failed;
+} batch_read;
+
+#ifdef BATCH_RING_AVAILABLE
+typedef struct batch_ring
+{
+    int file;
+
+    void* submission_map;
+    size_t submission_map_size;
+    void* completion_map;
+    size_t completion_map_size;
+    struct io_uring_sqe* entries;
+    size_t entries_size;
+
+    unsigned* submission_tail;
+    unsigned submission_mask;
+    unsigned* submission_array;
+
+    unsigned* completion_head;
+    unsigned* completion_tail;
+    unsigned completion_mask;
+    struct io_uring_cqe* completions;
+} batch_ring;
+#endif
+
+struct storage_batch
+{
+    batch_read_function read_function;
+
+    batch_read* reads;
+    size_t read_count;
+    size_t read_capacity;
+
+    struct iovec* parts;
+    size_t part_count;
+    size_t part_capacity;
+
+    virtual_lock** locks;
+    size_t lock_count;
+    size_t lock_capacity;
+
+    // Flag that reads added next set if they fail
+    bool* failed;
+
+#ifdef BATCH_RING_AVAILABLE
+    // NULL if the ring could not be set up
+    batch_ring* ring;
+#endif
+};
+
+static int reserve_room(storage_batch* batch, int part_count);
+static void make_reads(storage_batch* batch, size_t first_read,
+                       size_t read_count);
+
+#ifdef BATCH_RING_AVAILABLE
+static batch_ring* create_ring();
+static void destroy_ring(batch_ring* ring);
+static size_t submit_to_ring(storage_batch* batch, int file,
+                             size_t first_read);
+#endif
+
+storage_batch* batch_create(batch_read_function read_function)
+{
+    storage_batch* batch = calloc(1, sizeof(storage_batch));
+
+    if (batch == NULL)
+    {
+        return NULL;
+    }
+
+    batch->read_function = read_function;
+
+#ifdef BATCH_RING_AVAILABLE
+    batch->ring = create_ring();
+#endif
+
+    return batch;
+}
+
+void batch_destroy(storage_batch* batch)
+{
+    if (batch == NULL)
+    {
+        return;
+    }
+
+#ifdef BATCH_RING_AVAILABLE
+    destroy_ring(batch->ring);
+#endif
+
+    free(batch->reads);
+    free(batch->parts);
+    free(batch->locks);
+    free(batch);
+}
+
+void batch_add_read(storage_batch* batch, off_t position,
+                    const struct iovec* parts, int part_count)
+{
+    if (reserve_room(batch, part_count) == -1)
+    {
+        if (batch->read_function(position, parts, part_count) == -1
+            && batch->failed != NULL)
+        {
+            *batch->failed = true;
+        }
+
+        return;
+    }
+
+    batch_read* read = &batch->reads[batch->read_count++];
+
+    read->position = position;
+    read->n_bytes = 0;
+    read->first_part = batch->part_count;
+    read->part_count = part_count;
+    read->failed = batch->failed;
+
+    for (int i = 0; i < part_count; i++)
+    {
+        batch->parts[batch->part_count++] = parts[i];
+        read->n_bytes += parts[i].iov_len;
+    }
+}
+
+void batch_report_failures(storage_batch* batch, bool* failed)
+{
+    batch->failed = failed;
+}
+
+int batch_hold_lock(storage_batch* batch, virtual_lock* lock)
+{
+    if (batch->lock_count == batch->lock_capacity)
+    {
+        size_t capacity = batch->lock_capacity > 0
+            ? batch->lock_capacity * 2 : MIN_BATCH_CAPACITY;
+        virtual_lock** locks = realloc(batch->locks,
+                                       capacity * sizeof(virtual_lock*));
+
+        if (locks == NULL)
+        {
+            return -1;
+        }
+
+        batch->locks = locks;
+        batch->lock_capacity = capacity;
+    }
+
+    batch->locks[batch->lock_count++] = lock;
+
+    return 0;
+}
+
+bool batch_holds_lock(const storage_batch* batch, const virtual_lock* lock)
+{
+    for (size_t i = 0; i < batch->lock_count; i++)
+    {
+        if (batch->locks[i] == lock)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void batch_issue(storage_batch* batch, int file)
+{
+    size_t issued_reads = 0;
+
+#ifdef BATCH_RING_AVAILABLE
+    while (batch->ring != NULL && issued_reads < batch->read_count)
+    {
+        size_t submitted_reads = submit_to_ring(batch, file, issued_reads);
+
+        if (submitted_reads == 0)
+        {
+            // The kernel refused the ring: the rest are read without it
+            break;
+        }
+
+        issued_reads += submitted_reads;
+    }
+#endif
+
+    make_reads(batch, issued_reads, batch->read_count - issued_reads);
+
+    batch->read_count = 0;
+    batch->part_count = 0;
+
+    for (size_t i = 0; i < batch->lock_count; i++)
+    {
+        unlock_for_reading(batch->locks[i]);
+    }
+
+    batch->lock_count = 0;
+}
+
+static int reserve_room(storage_batch* batch, int part_count)
+{
+    if (batch->read_count == batch->read_capacity)
+    {
+        size_t capacity = batch->read_capacity > 0
+            ? batch->read_capacity * 2 : MIN_BATCH_CAPACITY;
+        batch_read* reads = realloc(batch->reads,
+                                    capacity * sizeof(batch_read));
+
+        if (reads == NULL)
+        {
+            return -1;
+        }
+
+        batch->reads = reads;
+        batch->read_capacity = capacity;
+    }
+
+    if (batch->part_count + part_count > batch->part_capacity)
+    {
+        size_t capacity = batch->part_capacity > 0
+            ? batch->part_capacity : MIN_BATCH_CAPACITY;
+
+        while (capacity < batch->part_count + part_count)
+        {
+            capacity *= 2;
+        }
+
+        struct iovec* parts = realloc(batch->parts,
+                                      capacity * sizeof(struct iovec));
+
+        if (parts == NULL)
+        {
+            return -1;
+        }
+
+        batch->parts = parts;
+        batch->part_capacity = capacity;
+    }
+
+    return 0;
+}
+
+static void make_reads(storage_batch* batch, size_t first_read,
+                       size_t read_count)
+{
+    for (size_t i = first_read; i < first_read + read_count; i++)
+    {
+        batch_read* read = &batch->reads[i];
+
+        if (batch->read_function(read->position,
+                                 &batch->parts[read->first_part],
+                                 read->part_count) == -1
+            && read->failed != NULL)
+        {
+            *read->failed = true;
+        }
+    }
+}
+
+#ifdef BATCH_RING_AVAILABLE
+static batch_ring* create_ring()
+{
+    batch_ring* ring = calloc(1, sizeof(batch_ring));
+
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    struct io_uring_params parameters;
+    memset(&parameters, 0, sizeof(parameters));
+
+    ring->file = (int)syscall(__NR_io_uring_setup, BATCH_RING_SIZE,
+                              &parameters);
+
+    if (ring->file == -1)
+    {
+        free(ring);
+
+        return NULL;
+    }
+
+    ring->submission_map_size = parameters.sq_off.array
+        + parameters.sq_entries * sizeof(unsigned);
+    ring->completion_map_size = parameters.cq_off.cqes
+        + parameters.cq_entries * sizeof(struct io_uring_cqe);
+    ring->entries_size = parameters.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both rings with a single mapping
+    bool single_map = parameters.features & IORING_FEAT_SINGLE_MMAP;
+
+    if (single_map
+        && ring->completion_map_size > ring->submission_map_size)
+    {
+        ring->submission_map_size = ring->completion_map_size;
+    }
+
+    ring->submission_map = mmap(NULL, ring->submission_map_size,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, ring->file,
+                                IORING_OFF_SQ_RING);
+    ring->completion_map = single_map ? ring->submission_map
+        : mmap(NULL, ring->completion_map_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring->file, IORING_OFF_CQ_RING);
+    ring->entries = mmap(NULL, ring->entries_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->file,
+                         IORING_OFF_SQES);
+
+    if (ring->submission_map == MAP_FAILED
+        || ring->completion_map == MAP_FAILED
+        || ring->entries == MAP_FAILED)
+    {
+        destroy_ring(ring);
+
+        return NULL;
+    }
+
+    char* submission = ring->submission_map;
+    char* completion = ring->completion_map;
+
+    ring->submission_tail = (unsigned*)(submission + parameters.sq_off.tail);
+    ring->submission_mask =
+        *(unsigned*)(submission + parameters.sq_off.ring_mask);
+    ring->submission_array =
+        (unsigned*)(submission + parameters.sq_off.array);
+
+    ring->completion_head = (unsigned*)(completion + parameters.cq_off.head);
+    ring->completion_tail = (unsigned*)(completion + parameters.cq_off.tail);
+    ring->completion_mask =
+        *(unsigned*)(completion + parameters.cq_off.ring_mask);
+    ring->completions =
+        (struct io_uring_cqe*)(completion + parameters.cq_off.cqes);
+
+    return ring;
+}
+
+static void destroy_ring(batch_ring* ring)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    if (ring->entries != NULL && ring->entries != MAP_FAILED)
+    {
+        munmap(ring->entries, ring->entries_size);
+    }
+
+    if (ring->completion_map != NULL && ring->completion_map != MAP_FAILED
+        && ring->completion_map != ring->submission_map)
+    {
+        munmap(ring->completion_map, ring->completion_map_size);
+    }
+
+    if (ring->submission_map != NULL && ring->submission_map != MAP_FAILED)
+    {
+        munmap(ring->submission_map, ring->submission_map_size);
+    }
+
+    close(ring->file);
+    free(ring);
+}
+
+static size_t submit_to_ring(storage_batch* batch, int file,
+                             size_t first_read)
+{
+    // Fill the submission queue with as many reads as fit in the ring. Only
+    // this thread submits to the ring, so its tail can be read plainly
+    batch_ring* ring = batch->ring;
+    size_t read_count = batch->read_count - first_read;
+
+    if (read_count > BATCH_RING_SIZE)
+    {
+        read_count = BATCH_RING_SIZE;
+    }
+
+    unsigned tail = *ring->submission_tail;
+
+    for (size_t i = 0; i < read_count; i++)
+    {
+        batch_read* read = &batch->reads[first_read + i];
+        unsigned index = (tail + i) & ring->submission_mask;
+        struct io_uring_sqe* entry = &ring->entries[index];
+
+        memset(entry, 0, sizeof(*entry));
+        entry->opcode = IORING_OP_READV;
+        entry->fd = file;
+        entry->addr = (uint64_t)(uintptr_t)&batch->parts[read->first_part];
+        entry->len = read->part_count;
+        entry->off = read->position;
+        entry->user_data = first_read + i;
+
+        ring->submission_array[index] = index;
+    }
+
+    // The kernel must see the entries before the new tail
+    __atomic_store_n(ring->submission_tail, tail + (unsigned)read_count,
+                     __ATOMIC_RELEASE);
+
+    // Submit the reads and wait for all of them to complete
+    bool completed[BATCH_RING_SIZE] = { false };
+    size_t completed_reads = 0;
+    size_t submitted_reads = 0;
+
+    while (completed_reads < read_count)
+    {
+        int result = (int)syscall(__NR_io_uring_enter, ring->file,
+                                  (unsigned)(read_count - submitted_reads),
+                                  (unsigned)(read_count - completed_reads),
+                                  IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if (result == -1 && errno != EINTR)
+        {
+            if (submitted_reads == 0)
+            {
+                // Nothing was submitted: take the entries back from the
+                // queue and leave the reads to the caller
+                *ring->submission_tail = tail;
+
+                return 0;
+            }
+
+            // Retrying could fail the same way forever
+            break;
+        }
+
+        if (result > 0)
+        {
+            submitted_reads += result;
+        }
+
+        unsigned head = *ring->completion_head;
+        unsigned completion_tail =
+            __atomic_load_n(ring->completion_tail, __ATOMIC_ACQUIRE);
+
+        while (head != completion_tail)
+        {
+            struct io_uring_cqe* completion =
+                &ring->completions[head & ring->completion_mask];
+            batch_read* read = &batch->reads[completion->user_data];
+
+            if (completion->res < 0
+                || (size_t)completion->res != read->n_bytes)
+            {
+                make_reads(batch, completion->user_data, 1);
+            }
+
+            completed[completion->user_data - first_read] = true;
+            head++;
+            completed_reads++;
+        }
+
+        __atomic_store_n(ring->completion_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (completed_reads < read_count)
+    {
+        // The reads left in the ring are made again once it's closed
+        destroy_ring(ring);
+        batch->ring = NULL;
+
+        for (size_t i = 0; i < read_count; i++)
+        {
+            if (!completed[i])
+            {
+                make_reads(batch, first_read + i, 1);
+            }
+        }
+    }
+
+    return read_count;
+}
+#endif
@@ -0,0 +1,47 @@
+#ifndef STORAGEBATCH_H
+#define STORAGEBATCH_H
+
+// This module collects reads of the storage file for the virtualStorage
+// module so that they can be issued together. On Linux the reads of a batch
+// are submitted to an io_uring, so the kernel works on all of them at once and
+// the thread waits for them with a single system call. Where io_uring is not
+// available, or the kernel doesn't allow it, the reads are made one after
+// another with the read function the batch was created with.
+
+#include "virtualLock.h"
+#include "virtualStorage.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Function used to make reads that don't go through the ring. Returns -1 if
+// the read failed or came up short
+typedef int (*batch_read_function)(off_t position, const struct iovec* parts,
+                                   int part_count);
+
+storage_batch* batch_create(batch_read_function read_function);
+void batch_destroy(storage_batch* batch);
+
+// Adds a read of the parts from the file position to the batch. The parts
+// are copied, but the buffers they point to must stay valid until the batch
+// is issued. A read that can't be added is made right away
+void batch_add_read(storage_batch* batch, off_t position,
+                    const struct iovec* parts, int part_count);
+
+// Reads added after this set the flag if they fail, which may only be known
+// once the batch has been issued. The flag stays in use until it's replaced,
+// and a NULL flag stops reporting failures
+void batch_report_failures(storage_batch* batch, bool* failed);
+
+// Keeps a lock that the calling thread holds for reading until the batch is
+// issued, and releases it then. Returns -1 if the lock could not be kept, in
+// which case the caller still holds it
+int batch_hold_lock(storage_batch* batch, virtual_lock* lock);
+bool batch_holds_lock(const storage_batch* batch, const virtual_lock* lock);
+
+// Makes all reads added since the batch was last issued from the file, and
+// returns when they are done. The held locks are released after that
+void batch_issue(storage_batch* batch, int file);
+
+#endif // STORAGEBATCH_H
@@ -0,0 +1,529 @@
+// The cache keeps whole blocks, header included when the storage file has its
+// headers in front of the blocks, so that a block whose header is written and
+// whose payload is then written to only needs to be loaded once. Cached
+// blocks are found through a hash table of block indices, and a doubly linked
+// list ordered by last use decides which block is evicted next. Both link
+// entries by their indices in a single array of entries that is allocated
+// once, along with the memory for the cached blocks.
+
+// Every read and write of the cache rearranges the list, so all access to the
+// cached blocks is serialized by a single lock.
+
+#include "storageCache.h"
+#include "virtualLock.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_ENTRY ((size_t)-1)
+#define MAX_WRITE_BACK_BYTES (1024 * 1024)
+
+typedef struct cache_entry
+{
+    size_t block;
+    bool dirty;
+
+    // Neighbours in the list ordered by last use
+    size_t newer_entry;
+    size_t older_entry;
+
+    // Next entry in the same hash table bucket
+    size_t next_in_bucket;
+} cache_entry;
+
+static size_t capacity_ = 0;
+static size_t used_entries_ = 0;
+static cache_entry* entries_ = NULL;
+static char* entry_data_ = NULL;
+
+static size_t* buckets_ = NULL;
+static size_t bucket_mask_ = 0;
+
+static size_t newest_entry_ = NO_ENTRY;
+static size_t oldest_entry_ = NO_ENTRY;
+
+static off_t first_block_position_ = 0;
+static size_t block_stride_ = 0;
+static cache_read_function read_function_ = NULL;
+static cache_write_function write_function_ = NULL;
+
+static storage_cache_statistics statistics_;
+
+static virtual_lock cache_lock_ = VIRTUAL_LOCK_INITIALIZER;
+
+static size_t get_entry(size_t block, bool load);
+static size_t find_entry(size_t block);
+static size_t take_free_entry();
+static void remove_from_bucket(size_t entry);
+static void remove_entry(size_t entry);
+static void unlink_entry(size_t entry);
+static void link_as_newest(size_t entry);
+static size_t bucket_of(size_t block);
+static char* entry_data(size_t entry);
+static off_t cached_block_position(size_t block);
+static int compare_entry_blocks(const void* first, const void* second);
+
+int cache_initialize(size_t capacity, off_t first_block_position,
+                     size_t block_stride, cache_read_function read_function,
+                     cache_write_function write_function)
+{
+    cache_finalize();
+
+    if (capacity == 0)
+    {
+        return 0;
+    }
+
+    // The hash table has at least twice as many buckets as there are entries
+    // to keep the chains short
+    size_t bucket_count = 1;
+
+    while (bucket_count < capacity * 2)
+    {
+        bucket_count *= 2;
+    }
+
+    entries_ = malloc(capacity * sizeof(cache_entry));
+    entry_data_ = malloc(capacity * block_stride);
+    buckets_ = malloc(bucket_count * sizeof(size_t));
+
+    if (entries_ == NULL || entry_data_ == NULL || buckets_ == NULL)
+    {
+        cache_finalize();
+
+        return -1;
+    }
+
+    for (size_t i = 0; i < bucket_count; i++)
+    {
+        buckets_[i] = NO_ENTRY;
+    }
+
+    capacity_ = capacity;
+    bucket_mask_ = bucket_count - 1;
+    first_block_position_ = first_block_position;
+    block_stride_ = block_stride;
+    read_function_ = read_function;
+    write_function_ = write_function;
+
+    return 0;
+}
+
+void cache_finalize()
+{
+    // Dirty blocks are not written back here: cache_flush() needs to be called
+    // first if they should be kept
+    free(entries_);
+    free(entry_data_);
+    free(buckets_);
+
+    entries_ = NULL;
+    entry_data_ = NULL;
+    buckets_ = NULL;
+
+    capacity_ = 0;
+    used_entries_ = 0;
+    newest_entry_ = NO_ENTRY;
+    oldest_entry_ = NO_ENTRY;
+
+    memset(&statistics_, 0, sizeof(statistics_));
+}
+
+bool cache_enabled()
+{
+    return capacity_ > 0;
+}
+
+void cache_read(off_t position, void* buffer, size_t n_bytes)
+{
+    size_t read_bytes = 0;
+
+    lock_for_writing(&cache_lock_);
+
+    // Split the read at block boundaries and read each part from the cache
+    while (read_bytes < n_bytes)
+    {
+        off_t block_area_position =
+            position + read_bytes - first_block_position_;
+        size_t block = block_area_position / block_stride_;
+        size_t position_in_block = block_area_position % block_stride_;
+
+        size_t bytes_to_read = block_stride_ - position_in_block;
+
+        if (bytes_to_read > n_bytes - read_bytes)
+        {
+            bytes_to_read = n_bytes - read_bytes;
+        }
+
+        size_t entry = get_entry(block, true);
+        memcpy((char*)buffer + read_bytes,
+               entry_data(entry) + position_in_block, bytes_to_read);
+
+        read_bytes += bytes_to_read;
+    }
+
+    unlock_for_writing(&cache_lock_);
+}
+
+void cache_write(off_t position, const void* buffer, size_t n_bytes)
+{
+    size_t written_bytes = 0;
+
+    lock_for_writing(&cache_lock_);
+
+    while (written_bytes < n_bytes)
+    {
+        off_t block_area_position =
+            position + written_bytes - first_block_position_;
+        size_t block = block_area_position / block_stride_;
+        size_t position_in_block = block_area_position % block_stride_;
+
+        size_t bytes_to_write = block_stride_ - position_in_block;
+
+        if (bytes_to_write > n_bytes - written_bytes)
+        {
+            bytes_to_write = n_bytes - written_bytes;
+        }
+
+        // A block that is overwritten completely doesn't need to be loaded
+        bool whole_block = bytes_to_write == block_stride_;
+
+        size_t entry = get_entry(block, !whole_block);
+        memcpy(entry_data(entry) + position_in_block,
+               (const char*)buffer + written_bytes, bytes_to_write);
+        entries_[entry].dirty = true;
+
+        written_bytes += bytes_to_write;
+    }
+
+    unlock_for_writing(&cache_lock_);
+}
+
+void cache_flush()
+{
+    if (!cache_enabled())
+    {
+        return;
+    }
+
+    lock_for_writing(&cache_lock_);
+
+    // Write the dirty blocks back in block order so that runs of adjacent
+    // blocks can be combined into a single write
+    size_t run_capacity = MAX_WRITE_BACK_BYTES / block_stride_;
+
+    if (run_capacity == 0)
+    {
+        run_capacity = 1;
+    }
+
+    size_t* dirty_entries = malloc(used_entries_ * sizeof(size_t));
+    char* run_data = malloc(run_capacity * block_stride_);
+
+    if (dirty_entries == NULL || run_data == NULL)
+    {
+        // Without memory for sorting and combining them, the dirty blocks
+        // are written back one at a time like evicted blocks are
+        for (size_t entry = 0; entry < used_entries_; entry++)
+        {
+            if (entries_[entry].dirty)
+            {
+                write_function_(cached_block_position(entries_[entry].block),
+                                entry_data(entry), block_stride_);
+                entries_[entry].dirty = false;
+
+                statistics_.write_backs++;
+            }
+        }
+
+        free(run_data);
+        free(dirty_entries);
+
+        unlock_for_writing(&cache_lock_);
+
+        return;
+    }
+
+    size_t dirty_count = 0;
+
+    for (size_t i = 0; i < used_entries_; i++)
+    {
+        if (entries_[i].dirty)
+        {
+            dirty_entries[dirty_count++] = i;
+        }
+    }
+
+    qsort(dirty_entries, dirty_count, sizeof(size_t), compare_entry_blocks);
+
+    size_t i = 0;
+
+    while (i < dirty_count)
+    {
+        size_t first_block = entries_[dirty_entries[i]].block;
+        size_t run_length = 0;
+
+        while (i + run_length < dirty_count && run_length < run_capacity
+               && entries_[dirty_entries[i + run_length]].block
+                  == first_block + run_length)
+        {
+            size_t entry = dirty_entries[i + run_length];
+
+            memcpy(run_data + run_length * block_stride_, entry_data(entry),
+                   block_stride_);
+            entries_[entry].dirty = false;
+
+            run_length++;
+        }
+
+        write_function_(cached_block_position(first_block), run_data,
+                        run_length * block_stride_);
+
+        statistics_.write_backs += run_length;
+        i += run_length;
+    }
+
+    free(run_data);
+    free(dirty_entries);
+
+    unlock_for_writing(&cache_lock_);
+}
+
+void cache_discard(off_t position, size_t n_bytes)
+{
+    if (!cache_enabled())
+    {
+        return;
+    }
+
+    off_t block_area_position = position - first_block_position_;
+    size_t first_block =
+        (block_area_position + block_stride_ - 1) / block_stride_;
+    size_t end_block = (block_area_position + n_bytes) / block_stride_;
+
+    lock_for_writing(&cache_lock_);
+
+    // Going through the entries from the end lets removed entries be
+    // replaced by entries that have already been looked at
+    for (size_t i = used_entries_; i > 0; i--)
+    {
+        size_t block = entries_[i - 1].block;
+
+        if (block >= first_block && block < end_block)
+        {
+            remove_entry(i - 1);
+        }
+    }
+
+    unlock_for_writing(&cache_lock_);
+}
+
+storage_cache_statistics cache_statistics()
+{
+    lock_for_reading(&cache_lock_);
+    storage_cache_statistics statistics = statistics_;
+    unlock_for_reading(&cache_lock_);
+
+    return statistics;
+}
+
+static size_t get_entry(size_t block, bool load)
+{
+    size_t entry = find_entry(block);
+
+    if (entry != NO_ENTRY)
+    {
+        statistics_.hits++;
+
+        unlink_entry(entry);
+        link_as_newest(entry);
+
+        return entry;
+    }
+
+    statistics_.misses++;
+
+    entry = take_free_entry();
+
+    entries_[entry].block = block;
+    entries_[entry].dirty = false;
+
+    size_t bucket = bucket_of(block);
+    entries_[entry].next_in_bucket = buckets_[bucket];
+    buckets_[bucket] = entry;
+
+    link_as_newest(entry);
+
+    if (load)
+    {
+        read_function_(cached_block_position(block), entry_data(entry),
+                       block_stride_);
+    }
+
+    return entry;
+}
+
+static size_t find_entry(size_t block)
+{
+    size_t entry = buckets_[bucket_of(block)];
+
+    while (entry != NO_ENTRY && entries_[entry].block != block)
+    {
+        entry = entries_[entry].next_in_bucket;
+    }
+
+    return entry;
+}
+
+static size_t take_free_entry()
+{
+    if (used_entries_ < capacity_)
+    {
+        return used_entries_++;
+    }
+
+    // The cache is full: evict the least recently used block, writing it back
+    // first if it was changed
+    size_t entry = oldest_entry_;
+
+    if (entries_[entry].dirty)
+    {
+        write_function_(cached_block_position(entries_[entry].block),
+                        entry_data(entry), block_stride_);
+
+        statistics_.write_backs++;
+    }
+
+    statistics_.evictions++;
+
+    remove_from_bucket(entry);
+    unlink_entry(entry);
+
+    return entry;
+}
+
+static void remove_from_bucket(size_t entry)
+{
+    size_t* link = &buckets_[bucket_of(entries_[entry].block)];
+
+    while (*link != entry)
+    {
+        link = &entries_[*link].next_in_bucket;
+    }
+
+    *link = entries_[entry].next_in_bucket;
+}
+
+static void remove_entry(size_t entry)
+{
+    // Entries are allocated from the start of the array, so the last entry in
+    // use is moved into the place of the removed one
+    remove_from_bucket(entry);
+    unlink_entry(entry);
+
+    size_t last_entry = --used_entries_;
+
+    if (entry == last_entry)
+    {
+        return;
+    }
+
+    size_t* link = &buckets_[bucket_of(entries_[last_entry].block)];
+
+    while (*link != last_entry)
+    {
+        link = &entries_[*link].next_in_bucket;
+    }
+
+    *link = entry;
+
+    entries_[entry] = entries_[last_entry];
+    memcpy(entry_data(entry), entry_data(last_entry), block_stride_);
+
+    size_t newer_entry = entries_[entry].newer_entry;
+    size_t older_entry = entries_[entry].older_entry;
+
+    if (newer_entry != NO_ENTRY)
+    {
+        entries_[newer_entry].older_entry = entry;
+    }
+    else
+    {
+        newest_entry_ = entry;
+    }
+
+    if (older_entry != NO_ENTRY)
+    {
+        entries_[older_entry].newer_entry = entry;
+    }
+    else
+    {
+        oldest_entry_ = entry;
+    }
+}
+
+static void unlink_entry(size_t entry)
+{
+    size_t newer_entry = entries_[entry].newer_entry;
+    size_t older_entry = entries_[entry].older_entry;
+
+    if (newer_entry != NO_ENTRY)
+    {
+        entries_[newer_entry].older_entry = older_entry;
+    }
+    else
+    {
+        newest_entry_ = older_entry;
+    }
+
+    if (older_entry != NO_ENTRY)
+    {
+        entries_[older_entry].newer_entry = newer_entry;
+    }
+    else
+    {
+        oldest_entry_ = newer_entry;
+    }
+}
+
+static void link_as_newest(size_t entry)
+{
+    entries_[entry].newer_entry = NO_ENTRY;
+    entries_[entry].older_entry = newest_entry_;
+
+    if (newest_entry_ != NO_ENTRY)
+    {
+        entries_[newest_entry_].newer_entry = entry;
+    }
+
+    newest_entry_ = entry;
+
+    if (oldest_entry_ == NO_ENTRY)
+    {
+        oldest_entry_ = entry;
+    }
+}
+
+static size_t bucket_of(size_t block)
+{
+    // Multiplicative hashing spreads adjacent block indices over the buckets
+    return (block * 2654435761u) & bucket_mask_;
+}
+
+static char* entry_data(size_t entry)
+{
+    return entry_data_ + entry * block_stride_;
+}
+
+static off_t cached_block_position(size_t block)
+{
+    return first_block_position_ + (off_t)block_stride_ * block;
+}
+
+static int compare_entry_blocks(const void* first, const void* second)
+{
+    size_t first_block = entries_[*(const size_t*)first].block;
+    size_t second_block = entries_[*(const size_t*)second].block;
+
+    return (first_block > second_block) - (first_block < second_block);
+}
@@ -0,0 +1,43 @@
+#ifndef STORAGECACHE_H
+#define STORAGECACHE_H
+
+// This module implements a fixed-size cache of storage file blocks for the
+// virtualStorage module. Each cached block holds the block exactly as it is
+// laid out in the block area of the storage file: the block's header and
+// payload, or only the payload when the headers are kept in a separate table
+// outside the block area. Blocks are evicted
+// in least recently used order, and changes to cached blocks are only written
+// to the storage file when the block is evicted or the cache is flushed.
+
+#include "virtualStorage.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Functions the cache uses to access the storage file when a block has to be
+// loaded or written back
+typedef void (*cache_read_function)(off_t position, void* buffer,
+                                    size_t n_bytes);
+typedef void (*cache_write_function)(off_t position, const void* buffer,
+                                     size_t n_bytes);
+
+int cache_initialize(size_t capacity, off_t first_block_position,
+                     size_t block_stride, cache_read_function read_function,
+                     cache_write_function write_function);
+void cache_finalize();
+bool cache_enabled();
+
+// Reads and writes take positions in the storage file like the storage file
+// functions they replace, but the positions must be inside the block area
+void cache_read(off_t position, void* buffer, size_t n_bytes);
+void cache_write(off_t position, const void* buffer, size_t n_bytes);
+void cache_flush();
+
+// Drops the blocks that lie completely inside the range from the cache
+// without writing them back, for blocks whose contents no longer matter
+void cache_discard(off_t position, size_t n_bytes);
+
+storage_cache_statistics cache_statistics();
+
+#endif // STORAGECACHE_H
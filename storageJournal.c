@@ -0,0 +1,781 @@
+// Staged writes are kept in pages of JOURNAL_PAGE_SIZE bytes of the storage
+// file, found through a hash table of page positions. Each page has a bitmap
+// of the bytes that have been written to it, so reads only take the staged
+// bytes from a page and the commit only journals those bytes. The pages are
+// guarded by the journal lock, which reads hold for reading while they read
+// the storage file and copy the staged bytes over what they read, so a commit
+// can't make the writes in place and drop the pages in between.
+
+// The journal file holds a single batch at its start: a header followed by
+// records, each of which is a position in the storage file, a byte count and
+// the bytes to write there. The header has a checksum of the records, so a
+// batch that a crash cut short is ignored. Once the writes of a batch are on
+// the disk in place, the header is overwritten with zeros and synced, so a
+// batch is never written again over newer contents of the storage file.
+
+#include "storageJournal.h"
+#include "virtualLock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Windows compatibility
+#ifdef _MSC_VER
+#include <io.h>
+#include <intrin.h>
+#include <sys/stat.h>
+#define S_IRUSR S_IREAD
+#define S_IWUSR S_IWRITE
+#define lseek _lseeki64
+#define sync_file _commit
+
+static int count_trailing_zeros(uint64_t word)
+{
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (int)index;
+}
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#define O_BINARY 0
+#define count_trailing_zeros(word) __builtin_ctzll(word)
+
+// fdatasync() skips syncing file metadata that reads don't need, but not
+// every platform has it
+#ifdef __linux__
+#define sync_file fdatasync
+#else
+#define sync_file fsync
+#endif
+#endif
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_MAGIC 0x4C4E524A
+#define JOURNAL_PAGE_SIZE 4096
+#define BITMAP_WORD_BITS 64
+#define JOURNAL_PAGE_WORDS (JOURNAL_PAGE_SIZE / BITMAP_WORD_BITS)
+#define JOURNAL_BUCKET_COUNT 1024
+#define RECORD_HEADER_SIZE (sizeof(uint64_t) + sizeof(uint32_t))
+#define MIN_RECORD_CAPACITY 4096
+
+typedef struct journal_page
+{
+    off_t position;
+    struct journal_page* next_in_bucket;
+    struct journal_page* next_staged;
+
+    // One bit per byte, set if the byte has been written
+    uint64_t written[JOURNAL_PAGE_WORDS];
+    char bytes[JOURNAL_PAGE_SIZE];
+} journal_page;
+
+typedef struct batch_header
+{
+    uint32_t magic;
+    uint32_t record_count;
+    uint64_t records_size;
+    uint64_t checksum;
+} batch_header;
+
+// Records back to back, in the format of the journal file
+typedef struct record_buffer
+{
+    char* bytes;
+    size_t size;
+    size_t capacity;
+    uint32_t record_count;
+} record_buffer;
+
+static int journal_file_ = -1;
+static char* journal_path_ = NULL;
+static journal_write_function write_function_ = NULL;
+static journal_sync_function sync_function_ = NULL;
+
+static journal_page* buckets_[JOURNAL_BUCKET_COUNT] = { NULL };
+static journal_page* staged_pages_ = NULL;
+
+// Read without the lock, so reads and updates can skip the lock while
+// nothing is staged
+static atomic_word staged_page_count_ = 0;
+
+static record_buffer added_ = { NULL, 0, 0, 0 };
+static record_buffer batch_ = { NULL, 0, 0, 0 };
+
+static virtual_lock journal_lock_ = VIRTUAL_LOCK_INITIALIZER;
+
+static int replay_batch();
+static void invalidate_batch();
+static int read_journal_file(void* buffer, size_t n_bytes, off_t position);
+static int write_journal_file(const void* buffer, size_t n_bytes,
+                              off_t position);
+static int stage_bytes(off_t position, const char* bytes, size_t n_bytes);
+static void copy_staged_bytes(off_t position, const struct iovec* parts,
+                              int part_count, bool into_parts);
+static bool pages_overlap(off_t position, size_t n_bytes);
+static journal_page* find_page(off_t position);
+static journal_page* add_page(off_t position);
+static journal_page** bucket_of(off_t position);
+static void drop_pages();
+static void mark_written(uint64_t* words, size_t start, size_t end);
+static size_t find_bit(const uint64_t* words, size_t start, size_t end,
+                       bool written);
+static int journal_staged_pages(record_buffer* buffer);
+static void make_staged_writes();
+static int append_record(record_buffer* buffer, off_t position,
+                         const void* bytes, size_t n_bytes);
+static int reserve_record_room(record_buffer* buffer, size_t n_bytes);
+static void make_records(const char* records, size_t size);
+static uint64_t checksum(const char* bytes, size_t n_bytes);
+
+int journal_open(const char* storage_path, bool keep_open, bool new_file,
+                 journal_write_function write_function,
+                 journal_sync_function sync_function)
+{
+    journal_close();
+
+    write_function_ = write_function;
+    sync_function_ = sync_function;
+
+    journal_path_ = malloc(strlen(storage_path) + sizeof(JOURNAL_SUFFIX));
+
+    if (journal_path_ == NULL)
+    {
+        return -1;
+    }
+
+    strcpy(journal_path_, storage_path);
+    strcat(journal_path_, JOURNAL_SUFFIX);
+
+    journal_file_ = open(journal_path_,
+                         O_RDWR | O_BINARY | (keep_open ? O_CREAT : 0),
+                         S_IRUSR | S_IWUSR);
+
+    if (journal_file_ == -1)
+    {
+        // Without a journal file there is nothing to write again
+        bool missing = !keep_open && errno == ENOENT;
+
+        free(journal_path_);
+        journal_path_ = NULL;
+
+        return missing ? 0 : -1;
+    }
+
+    if (!new_file && replay_batch() == -1)
+    {
+        close(journal_file_);
+        journal_file_ = -1;
+        free(journal_path_);
+        journal_path_ = NULL;
+
+        return -1;
+    }
+
+    invalidate_batch();
+
+    if (!keep_open)
+    {
+        journal_close();
+    }
+
+    return 0;
+}
+
+void journal_close()
+{
+    lock_for_writing(&journal_lock_);
+    drop_pages();
+    unlock_for_writing(&journal_lock_);
+
+    free(added_.bytes);
+    free(batch_.bytes);
+    added_ = (record_buffer) { NULL, 0, 0, 0 };
+    batch_ = (record_buffer) { NULL, 0, 0, 0 };
+
+    if (journal_file_ != -1)
+    {
+        close(journal_file_);
+        journal_file_ = -1;
+        remove(journal_path_);
+    }
+
+    free(journal_path_);
+    journal_path_ = NULL;
+}
+
+int journal_write(off_t position, const struct iovec* parts, int part_count)
+{
+    int result = 0;
+
+    lock_for_writing(&journal_lock_);
+
+    for (int i = 0; i < part_count && result == 0; i++)
+    {
+        result = stage_bytes(position, parts[i].iov_base, parts[i].iov_len);
+        position += parts[i].iov_len;
+    }
+
+    unlock_for_writing(&journal_lock_);
+
+    return result;
+}
+
+void journal_update(off_t position, const struct iovec* parts,
+                    int part_count)
+{
+    if (atomic_word_load(&staged_page_count_) == 0)
+    {
+        return;
+    }
+
+    lock_for_writing(&journal_lock_);
+    copy_staged_bytes(position, parts, part_count, false);
+    unlock_for_writing(&journal_lock_);
+}
+
+bool journal_read(off_t position, const struct iovec* parts, int part_count,
+                  journal_read_function read_function)
+{
+    if (atomic_word_load(&staged_page_count_) == 0)
+    {
+        return false;
+    }
+
+    size_t n_bytes = 0;
+
+    for (int i = 0; i < part_count; i++)
+    {
+        n_bytes += parts[i].iov_len;
+    }
+
+    lock_for_reading(&journal_lock_);
+
+    bool overlaps = pages_overlap(position, n_bytes);
+
+    if (overlaps)
+    {
+        read_function(position, parts, part_count);
+        copy_staged_bytes(position, parts, part_count, true);
+    }
+
+    unlock_for_reading(&journal_lock_);
+
+    return overlaps;
+}
+
+int journal_add(off_t position, const void* buffer, size_t n_bytes)
+{
+    return append_record(&added_, position, buffer, n_bytes);
+}
+
+int journal_commit(bool sync_storage_first)
+{
+    if (staged_pages_ == NULL && added_.record_count == 0)
+    {
+        return 0;
+    }
+
+    // The batch is built in memory behind room for its header, and written
+    // to the journal file with a single write
+    batch_.size = 0;
+    batch_.record_count = 0;
+
+    int result = reserve_record_room(&batch_, sizeof(batch_header));
+
+    if (result == 0)
+    {
+        batch_.size = sizeof(batch_header);
+        result = journal_staged_pages(&batch_);
+    }
+
+    if (result == 0)
+    {
+        result = reserve_record_room(&batch_, added_.size);
+    }
+
+    if (result == 0 && journal_file_ != -1)
+    {
+        if (added_.size > 0)
+        {
+            memcpy(batch_.bytes + batch_.size, added_.bytes, added_.size);
+            batch_.size += added_.size;
+            batch_.record_count += added_.record_count;
+        }
+
+        batch_header header = {
+            JOURNAL_MAGIC, batch_.record_count,
+            batch_.size - sizeof(batch_header),
+            checksum(batch_.bytes + sizeof(batch_header),
+                     batch_.size - sizeof(batch_header))
+        };
+        memcpy(batch_.bytes, &header, sizeof(batch_header));
+
+        if (sync_storage_first)
+        {
+            sync_function_();
+        }
+
+        result = write_journal_file(batch_.bytes, batch_.size, 0) == 0
+            && sync_file(journal_file_) == 0 ? 0 : -1;
+    }
+    else
+    {
+        result = -1;
+    }
+
+    // The writes are made in place even if the batch didn't make it to the
+    // journal, as reads expect to find them there once the pages are gone
+    lock_for_writing(&journal_lock_);
+    make_staged_writes();
+    drop_pages();
+    unlock_for_writing(&journal_lock_);
+
+    make_records(added_.bytes, added_.size);
+    added_.size = 0;
+    added_.record_count = 0;
+
+    sync_function_();
+    invalidate_batch();
+
+    return result;
+}
+
+static int replay_batch()
+{
+    // A journal file that is too short for a batch, or whose batch has been
+    // completed, has nothing to write
+    batch_header header;
+    off_t file_size = lseek(journal_file_, 0, SEEK_END);
+
+    if (file_size < (off_t)sizeof(batch_header)
+        || read_journal_file(&header, sizeof(batch_header), 0) == -1
+        || header.magic != JOURNAL_MAGIC || header.records_size == 0
+        || header.records_size > (uint64_t)file_size - sizeof(batch_header))
+    {
+        return 0;
+    }
+
+    char* records = malloc(header.records_size);
+
+    if (records == NULL)
+    {
+        return -1;
+    }
+
+    // A batch whose records don't match the checksum was never committed
+    if (read_journal_file(records, header.records_size,
+                          sizeof(batch_header)) == 0
+        && checksum(records, header.records_size) == header.checksum)
+    {
+        make_records(records, header.records_size);
+        sync_function_();
+    }
+
+    free(records);
+
+    return 0;
+}
+
+static void invalidate_batch()
+{
+    batch_header header;
+    memset(&header, 0, sizeof(batch_header));
+
+    if (write_journal_file(&header, sizeof(batch_header), 0) == 0)
+    {
+        sync_file(journal_file_);
+    }
+}
+
+static int read_journal_file(void* buffer, size_t n_bytes, off_t position)
+{
+    // Only one thread uses the journal file at a time, so its offset can be
+    // used
+    char* bytes = buffer;
+
+    if (lseek(journal_file_, position, SEEK_SET) == -1)
+    {
+        return -1;
+    }
+
+    while (n_bytes > 0)
+    {
+        int read_bytes = read(journal_file_, bytes, (unsigned int)n_bytes);
+
+        if (read_bytes <= 0)
+        {
+            return -1;
+        }
+
+        bytes += read_bytes;
+        n_bytes -= read_bytes;
+    }
+
+    return 0;
+}
+
+static int write_journal_file(const void* buffer, size_t n_bytes,
+                              off_t position)
+{
+    const char* bytes = buffer;
+
+    if (journal_file_ == -1 || lseek(journal_file_, position, SEEK_SET) == -1)
+    {
+        return -1;
+    }
+
+    while (n_bytes > 0)
+    {
+        int written_bytes = write(journal_file_, bytes, (unsigned int)n_bytes);
+
+        if (written_bytes <= 0)
+        {
+            return -1;
+        }
+
+        bytes += written_bytes;
+        n_bytes -= written_bytes;
+    }
+
+    return 0;
+}
+
+static int stage_bytes(off_t position, const char* bytes, size_t n_bytes)
+{
+    while (n_bytes > 0)
+    {
+        off_t page_position =
+            position / JOURNAL_PAGE_SIZE * JOURNAL_PAGE_SIZE;
+        size_t offset = position - page_position;
+        size_t count = JOURNAL_PAGE_SIZE - offset;
+
+        if (count > n_bytes)
+        {
+            count = n_bytes;
+        }
+
+        journal_page* page = find_page(page_position);
+
+        if (page == NULL && (page = add_page(page_position)) == NULL)
+        {
+            return -1;
+        }
+
+        memcpy(page->bytes + offset, bytes, count);
+        mark_written(page->written, offset, offset + count);
+
+        position += count;
+        bytes += count;
+        n_bytes -= count;
+    }
+
+    return 0;
+}
+
+static void copy_staged_bytes(off_t position, const struct iovec* parts,
+                              int part_count, bool into_parts)
+{
+    // Copy the written bytes of the pages that the parts overlap into the
+    // parts, or the bytes of the parts over the written bytes of the pages
+    for (int i = 0; i < part_count; i++)
+    {
+        char* bytes = parts[i].iov_base;
+        size_t n_bytes = parts[i].iov_len;
+
+        while (n_bytes > 0)
+        {
+            off_t page_position =
+                position / JOURNAL_PAGE_SIZE * JOURNAL_PAGE_SIZE;
+            size_t offset = position - page_position;
+            size_t end = offset + n_bytes < JOURNAL_PAGE_SIZE
+                ? offset + n_bytes : JOURNAL_PAGE_SIZE;
+            journal_page* page = find_page(page_position);
+            size_t start = page != NULL
+                ? find_bit(page->written, offset, end, true) : end;
+
+            while (start < end)
+            {
+                size_t run_end = find_bit(page->written, start, end, false);
+
+                if (into_parts)
+                {
+                    memcpy(bytes + (start - offset), page->bytes + start,
+                           run_end - start);
+                }
+                else
+                {
+                    memcpy(page->bytes + start, bytes + (start - offset),
+                           run_end - start);
+                }
+
+                start = find_bit(page->written, run_end, end, true);
+            }
+
+            position += end - offset;
+            bytes += end - offset;
+            n_bytes -= end - offset;
+        }
+    }
+}
+
+static bool pages_overlap(off_t position, size_t n_bytes)
+{
+    off_t page_position = position / JOURNAL_PAGE_SIZE * JOURNAL_PAGE_SIZE;
+
+    for (; page_position < position + (off_t)n_bytes;
+         page_position += JOURNAL_PAGE_SIZE)
+    {
+        if (find_page(page_position) != NULL)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static journal_page* find_page(off_t position)
+{
+    journal_page* page = *bucket_of(position);
+
+    while (page != NULL && page->position != position)
+    {
+        page = page->next_in_bucket;
+    }
+
+    return page;
+}
+
+static journal_page* add_page(off_t position)
+{
+    journal_page* page = calloc(1, sizeof(journal_page));
+
+    if (page == NULL)
+    {
+        return NULL;
+    }
+
+    journal_page** bucket = bucket_of(position);
+
+    page->position = position;
+    page->next_in_bucket = *bucket;
+    page->next_staged = staged_pages_;
+    *bucket = page;
+    staged_pages_ = page;
+
+    atomic_word_store(&staged_page_count_,
+                      atomic_word_load(&staged_page_count_) + 1);
+
+    return page;
+}
+
+static journal_page** bucket_of(off_t position)
+{
+    uint64_t hash =
+        (uint64_t)(position / JOURNAL_PAGE_SIZE) * 0x9E3779B97F4A7C15u;
+
+    return &buckets_[(hash >> 32) & (JOURNAL_BUCKET_COUNT - 1)];
+}
+
+static void drop_pages()
+{
+    while (staged_pages_ != NULL)
+    {
+        journal_page* page = staged_pages_;
+
+        staged_pages_ = page->next_staged;
+        free(page);
+    }
+
+    memset(buckets_, 0, sizeof(buckets_));
+    atomic_word_store(&staged_page_count_, 0);
+}
+
+static void mark_written(uint64_t* words, size_t start, size_t end)
+{
+    while (start < end)
+    {
+        if (start % BITMAP_WORD_BITS == 0 && end - start >= BITMAP_WORD_BITS)
+        {
+            words[start / BITMAP_WORD_BITS] = ~(uint64_t)0;
+            start += BITMAP_WORD_BITS;
+
+            continue;
+        }
+
+        words[start / BITMAP_WORD_BITS] |=
+            (uint64_t)1 << (start % BITMAP_WORD_BITS);
+        start++;
+    }
+}
+
+static size_t find_bit(const uint64_t* words, size_t start, size_t end,
+                       bool written)
+{
+    // Returns the first byte from the start that has been written, or hasn't
+    // been, or the end if there is none before it
+    while (start < end)
+    {
+        uint64_t word = words[start / BITMAP_WORD_BITS];
+
+        if (!written)
+        {
+            word = ~word;
+        }
+
+        word &= ~(uint64_t)0 << (start % BITMAP_WORD_BITS);
+
+        if (word != 0)
+        {
+            size_t found = start / BITMAP_WORD_BITS * BITMAP_WORD_BITS
+                + count_trailing_zeros(word);
+
+            return found < end ? found : end;
+        }
+
+        start = (start / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS;
+    }
+
+    return end;
+}
+
+static int journal_staged_pages(record_buffer* buffer)
+{
+    // Each run of written bytes in a page becomes a record. Updates may
+    // change the bytes meanwhile, so the pages are locked
+    int result = 0;
+
+    lock_for_reading(&journal_lock_);
+
+    for (journal_page* page = staged_pages_; page != NULL && result == 0;
+         page = page->next_staged)
+    {
+        size_t start = find_bit(page->written, 0, JOURNAL_PAGE_SIZE, true);
+
+        while (start < JOURNAL_PAGE_SIZE && result == 0)
+        {
+            size_t end = find_bit(page->written, start, JOURNAL_PAGE_SIZE,
+                                  false);
+
+            result = append_record(buffer, page->position + start,
+                                   page->bytes + start, end - start);
+            start = find_bit(page->written, end, JOURNAL_PAGE_SIZE, true);
+        }
+    }
+
+    unlock_for_reading(&journal_lock_);
+
+    return result;
+}
+
+static void make_staged_writes()
+{
+    for (journal_page* page = staged_pages_; page != NULL;
+         page = page->next_staged)
+    {
+        size_t start = find_bit(page->written, 0, JOURNAL_PAGE_SIZE, true);
+
+        while (start < JOURNAL_PAGE_SIZE)
+        {
+            size_t end = find_bit(page->written, start, JOURNAL_PAGE_SIZE,
+                                  false);
+
+            write_function_(page->position + start, page->bytes + start,
+                            end - start);
+            start = find_bit(page->written, end, JOURNAL_PAGE_SIZE, true);
+        }
+    }
+}
+
+static int append_record(record_buffer* buffer, off_t position,
+                         const void* bytes, size_t n_bytes)
+{
+    if (reserve_record_room(buffer, RECORD_HEADER_SIZE + n_bytes) == -1)
+    {
+        return -1;
+    }
+
+    uint64_t record_position = position;
+    uint32_t record_bytes = n_bytes;
+    char* record = buffer->bytes + buffer->size;
+
+    memcpy(record, &record_position, sizeof(uint64_t));
+    memcpy(record + sizeof(uint64_t), &record_bytes, sizeof(uint32_t));
+    memcpy(record + RECORD_HEADER_SIZE, bytes, n_bytes);
+
+    buffer->size += RECORD_HEADER_SIZE + n_bytes;
+    buffer->record_count++;
+
+    return 0;
+}
+
+static int reserve_record_room(record_buffer* buffer, size_t n_bytes)
+{
+    if (buffer->size + n_bytes <= buffer->capacity)
+    {
+        return 0;
+    }
+
+    size_t capacity = buffer->capacity > 0
+        ? buffer->capacity : MIN_RECORD_CAPACITY;
+
+    while (capacity < buffer->size + n_bytes)
+    {
+        capacity *= 2;
+    }
+
+    char* bytes = realloc(buffer->bytes, capacity);
+
+    if (bytes == NULL)
+    {
+        return -1;
+    }
+
+    buffer->bytes = bytes;
+    buffer->capacity = capacity;
+
+    return 0;
+}
+
+static void make_records(const char* records, size_t size)
+{
+    size_t offset = 0;
+
+    while (size - offset >= RECORD_HEADER_SIZE)
+    {
+        uint64_t position;
+        uint32_t n_bytes;
+
+        memcpy(&position, records + offset, sizeof(uint64_t));
+        memcpy(&n_bytes, records + offset + sizeof(uint64_t),
+               sizeof(uint32_t));
+        offset += RECORD_HEADER_SIZE;
+
+        if (n_bytes > size - offset)
+        {
+            break;
+        }
+
+        write_function_((off_t)position, records + offset, n_bytes);
+        offset += n_bytes;
+    }
+}
+
+static uint64_t checksum(const char* bytes, size_t n_bytes)
+{
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037u;
+
+    for (size_t i = 0; i < n_bytes; i++)
+    {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
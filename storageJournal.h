@@ -0,0 +1,71 @@
+#ifndef STORAGEJOURNAL_H
+#define STORAGEJOURNAL_H
+
+// This module keeps the redo journal of the virtualStorage module. Writes to
+// the storage file that have to take effect together are staged in memory,
+// where reads of the storage file still see them, and written to the storage
+// file only after they have been committed: the whole batch of them is first
+// written to a journal file next to the storage file and synced to the disk
+// with a single sync, and then written in place. A batch that was committed
+// but not completely written in place before a crash is written again when
+// the journal is opened, so either all of a batch's writes reach the storage
+// file or none do.
+
+#include "virtualStorage.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Functions the journal uses to access the storage file. The sync function
+// returns once everything written to the storage file is on the disk
+typedef void (*journal_read_function)(off_t position,
+                                      const struct iovec* parts,
+                                      int part_count);
+typedef void (*journal_write_function)(off_t position, const void* buffer,
+                                       size_t n_bytes);
+typedef void (*journal_sync_function)();
+
+// Opens the journal of the storage file at the path and writes a batch that
+// was committed to it again. A journal that isn't kept open is closed and
+// removed once that is done, and the journal of a new storage file is
+// emptied instead, as its batches belong to an earlier file
+int journal_open(const char* storage_path, bool keep_open, bool new_file,
+                 journal_write_function write_function,
+                 journal_sync_function sync_function);
+
+// Removes the journal file. Staged writes that haven't been committed are
+// dropped
+void journal_close();
+
+// Stages writes of the parts from the position. Returns -1 if the writes
+// could not be staged, in which case the caller has to make them right away
+int journal_write(off_t position, const struct iovec* parts, int part_count);
+
+// Updates the staged bytes that the parts overlap, for writes that are made
+// right away but must not be undone by the staged ones when those are
+// committed
+void journal_update(off_t position, const struct iovec* parts,
+                    int part_count);
+
+// If staged writes overlap the read, makes the read with the read function
+// and copies the staged bytes over it. Returns false without reading
+// otherwise, and the caller reads as usual
+bool journal_read(off_t position, const struct iovec* parts, int part_count,
+                  journal_read_function read_function);
+
+// Adds a write to the next commit without staging it, for writes that are
+// never read back before they are committed. Added writes are made after the
+// staged ones, so they win where they overlap. Returns -1 if the write could
+// not be added
+int journal_add(off_t position, const void* buffer, size_t n_bytes);
+
+// Commits the staged and added writes and makes them in place. With the
+// storage file synced first, writes made to the storage file earlier reach
+// the disk before any of the batch does. The writes are made even if the
+// batch could not be written to the journal, which returns -1. Staging,
+// adding and committing must not overlap each other, while reads and updates
+// may happen at any time
+int journal_commit(bool sync_storage_first);
+
+#endif // STORAGEJOURNAL_H
@@ -0,0 +1,2060 @@
+// Flat directories are the original directory format of the file system: a
+// list of entries that ends with a null entry, where each entry is the entry
+// type followed by the metadata and content region IDs. Removed entries are
+// marked unused and reused by later additions. Tagged directories are the
+// same list after a short header entry, with the length and hash of the
+// entry name stored in each entry: entries are read in batches and only
+// entries whose tag matches have their name read from their metadata.
+
+// Hashed directories start with a header entry that is followed by a table of
+// slots. Entries are placed in the table with open addressing and linear
+// probing starting from the slot given by the hash of the entry name. Each
+// slot holds the entry type, the name hash and the region IDs, so slots of
+// other names can be skipped without reading their metadata. Removed entries
+// are marked unused so that probing continues past them, and the table is
+// rebuilt in place, with more slots if needed, when too few slots are empty.
+
+// B-tree directories divide their content region into nodes of equal size,
+// the first of which holds the header. Leaf nodes hold the entries with their
+// names, sorted by name and type, and are linked in order so that listing can
+// continue from one leaf to the next. Internal nodes hold the first key of
+// each child after the first one. Full nodes are split in half and the split
+// propagates up to the root, but nodes are not merged when entries are
+// removed: an emptied leaf stays in the tree and is filled again by later
+// additions in its range of names.
+
+// The module keeps two storage cursors of its own for each thread: one stays
+// in the directory being accessed and the other one reads entry names from
+// metadata regions. Each directory is guarded by a reader-writer lock, so
+// lookups and listings of a directory run in parallel while changes to it
+// run alone. The locks are striped: directories share a fixed number of
+// locks by the hash of their content region, which keeps the locks from
+// having to be created and freed with directories.
+
+// Entries are looked up in the directory cache before the directory itself,
+// and every change to a directory is applied to the cache as well: added
+// entries replace negative entries and removed ones become negative entries.
+// The entries of a directory are dropped from the cache when its content
+// region is initialized as a new directory. The cache is shared by all
+// threads behind a lock of its own, which is taken while holding the lock of
+// the directory so that the cache and the directory change together.
+
+#include "virtualDirectory.h"
+#include "directoryCache.h"
+#include "virtualLock.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIRECTORY_HEADER_MAX_SIZE 18
+#define HASHED_HEADER_SIZE 14
+#define HASHED_INITIAL_SLOT_COUNT 16
+#define ENTRY_MAX_SIZE 16
+#define TAGGED_HEADER_SIZE 2
+#define LIST_BATCH_SIZE 4096
+#define NO_POSITION ((size_t)-1)
+#define DIRECTORY_LOCK_COUNT 64
+
+// A node is one block, or as many blocks as it takes to fit three records
+// with the longest possible names so that splitting a full node in half
+// always gives two nodes that fit their records
+#define BTREE_HEADER_SIZE 18
+#define BTREE_MIN_NODE_SIZE 1024
+#define BTREE_NODE_HEADER_SIZE 9
+#define BTREE_RECORD_MAX_SIZE (2 + UCHAR_MAX + ENTRY_MAX_SIZE)
+#define BTREE_MAX_HEIGHT 64
+#define BTREE_LEAF_NODE 1
+#define BTREE_INTERNAL_NODE 2
+#define BTREE_NO_NODE 0
+
+// The header of a directory decoded into memory. Flat directories have no
+// header on disk, tagged directories have no fields in their header, and only
+// the fields of the directory's own format are used
+typedef struct directory_header
+{
+    directory_format format;
+    uint32_t entry_count;
+
+    // Hashed directories
+    uint32_t slot_count;
+    uint32_t unused_count;
+
+    // B-tree directories
+    uint32_t root_node;
+    uint32_t node_count;
+    uint32_t node_size;
+} directory_header;
+
+// An entry of a flat or tagged directory. The name length and hash are only
+// stored in tagged directories
+typedef struct list_entry
+{
+    char type;
+    unsigned char name_length;
+    uint32_t name_hash;
+    storage_region metadata_region;
+    storage_region content_region;
+} list_entry;
+
+typedef struct hashed_slot
+{
+    char type;
+    uint32_t name_hash;
+    storage_region metadata_region;
+    storage_region content_region;
+} hashed_slot;
+
+// Entries in B-tree nodes are ordered by name and then by type, as a file and
+// a directory in the same directory may have the same name
+typedef struct btree_key
+{
+    char type;
+    size_t name_length;
+    const char* name;
+} btree_key;
+
+static directory_format default_format_ = DIRECTORY_FORMAT_HASHED;
+
+// The cursors of a thread are not freed when it exits, which only matters
+// for programs that start many short-lived threads
+static THREAD_LOCAL storage_cursor* directory_cursor_ = NULL;
+static THREAD_LOCAL storage_cursor* name_cursor_ = NULL;
+
+static virtual_lock directory_locks_[DIRECTORY_LOCK_COUNT];
+static virtual_once directory_locks_once_ = VIRTUAL_ONCE_INITIALIZER;
+
+// The cache is set up when a directory is first accessed unless its capacity
+// was set before that. The storage open count it was last used with tells
+// when it has to be emptied
+static virtual_lock cache_lock_ = VIRTUAL_LOCK_INITIALIZER;
+static bool cache_initialized_ = false;
+static size_t cache_open_count_ = 0;
+
+static void prepare_cache();
+static directory_cache_result find_in_cache(storage_region directory,
+                                            const char* name,
+                                            entry_type type,
+                                            directory_entry* entry);
+static void store_in_cache(storage_region directory, const char* name,
+                           entry_type type, const directory_entry* entry);
+static void forget_in_cache(storage_region directory);
+static virtual_lock* directory_lock(storage_region directory);
+static void initialize_directory_locks();
+static int initialize_directory(storage_region directory);
+static int find_entry(storage_region directory, const char* name,
+                      entry_type type, directory_entry* entry);
+static int add_entry(storage_region directory, const char* name,
+                     const directory_entry* entry);
+static int remove_entry(storage_region directory, const char* name,
+                        entry_type type);
+static int replace_entry(storage_region directory, const char* name,
+                         const directory_entry* entry,
+                         directory_entry* old_entry);
+static int open_directory(storage_region directory, directory_header* header);
+static int write_directory_header(const directory_header* header);
+static size_t read_entry_name(const directory_entry* entry, char* name);
+static bool entry_has_name(const directory_entry* entry, const char* name,
+                           size_t name_length);
+static void seek_directory_to(size_t position);
+
+static bool is_list_format(directory_format format);
+static size_t find_list_entry(const directory_header* header,
+                              const char* name, entry_type type,
+                              directory_entry* entry);
+static size_t find_free_list_entry(const directory_header* header,
+                                   bool* at_end);
+static int add_list_entry(const directory_header* header, const char* name,
+                          const directory_entry* entry);
+static bool list_is_empty(const directory_header* header);
+static size_t read_list_batch(const directory_header* header, size_t position,
+                              char* batch);
+static void encode_list_entry(const directory_header* header, char* bytes,
+                              const list_entry* entry);
+static void decode_list_entry(const directory_header* header,
+                              const char* bytes, list_entry* entry);
+static size_t list_entry_size(const directory_header* header);
+static size_t list_start(const directory_header* header);
+
+static size_t find_hashed_entry(const directory_header* header,
+                                const char* name, entry_type type,
+                                directory_entry* entry);
+static int add_hashed_entry(directory_header* header, const char* name,
+                            const directory_entry* entry);
+static int rebuild_hashed_table(directory_header* header, uint32_t slot_count);
+static int write_hashed_table(const hashed_slot* slots, size_t slot_count,
+                              uint32_t table_slot_count,
+                              directory_header* header);
+static void read_hashed_slot(size_t index, hashed_slot* slot);
+static int write_hashed_slot(size_t index, const hashed_slot* slot);
+static void encode_hashed_slot(char* bytes, const hashed_slot* slot);
+static void decode_hashed_slot(const char* bytes, hashed_slot* slot);
+static size_t hashed_slot_size();
+static uint32_t hash_name(const char* name);
+
+static int list_unsorted_entries(const directory_header* header,
+                                 const btree_key* after,
+                                 directory_listing_entry* entries,
+                                 size_t max_entries);
+static int compare_listing_entries(const void* first, const void* second);
+
+static int initialize_btree(directory_header* header);
+static int find_btree_entry(const directory_header* header,
+                            const btree_key* key, directory_entry* entry);
+static int add_btree_entry(directory_header* header, const btree_key* key,
+                           const directory_entry* entry);
+static int remove_btree_entry(directory_header* header, const btree_key* key);
+static int replace_btree_entry(const directory_header* header,
+                               const btree_key* key,
+                               const directory_entry* entry,
+                               directory_entry* old_entry);
+static int list_btree_entries(const directory_header* header,
+                              const btree_key* after,
+                              directory_listing_entry* entries,
+                              size_t max_entries);
+static uint32_t find_btree_leaf(const directory_header* header,
+                                const btree_key* key, char* node,
+                                uint32_t* path, size_t* depth);
+static void split_btree_node(char* node, char* sibling, char* separator,
+                             uint32_t sibling_index);
+static size_t find_btree_record(const char* node, const btree_key* key,
+                                bool* found, size_t* previous_offset);
+static void insert_btree_record(char* node, size_t offset, const char* record,
+                                size_t record_size);
+static size_t encode_btree_record(char* record, const btree_key* key,
+                                  const directory_entry* entry,
+                                  uint32_t child);
+static void decode_btree_record(const char* node, size_t offset,
+                                btree_key* key, directory_entry* entry);
+static uint32_t btree_record_child(const char* node, size_t offset);
+static size_t btree_record_size(const char* node, size_t offset);
+static size_t btree_node_end(const char* node);
+static uint32_t btree_node_record_count(const char* node);
+static uint32_t btree_node_link(const char* node);
+static void initialize_btree_node(char* node, char kind, uint32_t link);
+static void set_btree_node_record_count(char* node, uint32_t record_count);
+static void set_btree_node_link(char* node, uint32_t link);
+static int read_btree_node(const directory_header* header, uint32_t index,
+                           char* node);
+static int write_btree_node(const directory_header* header, uint32_t index,
+                            char* node);
+static int compare_btree_keys(const btree_key* first, const btree_key* second);
+
+void directory_set_default_format(directory_format format)
+{
+    default_format_ = format;
+}
+
+int directory_set_cache_capacity(size_t capacity)
+{
+    lock_for_writing(&cache_lock_);
+
+    cache_initialized_ = true;
+    cache_open_count_ = storage_open_count();
+
+    int result = directory_cache_initialize(capacity);
+
+    unlock_for_writing(&cache_lock_);
+
+    return result;
+}
+
+directory_cache_statistics directory_get_cache_statistics()
+{
+    lock_for_reading(&cache_lock_);
+
+    directory_cache_statistics statistics = directory_cache_get_statistics();
+
+    unlock_for_reading(&cache_lock_);
+
+    return statistics;
+}
+
+int directory_initialize(storage_region directory)
+{
+    virtual_lock* lock = directory_lock(directory);
+    lock_for_writing(lock);
+
+    int result = initialize_directory(directory);
+
+    unlock_for_writing(lock);
+
+    return result;
+}
+
+int directory_find_entry(storage_region directory, const char* name,
+                         entry_type type, directory_entry* entry)
+{
+    switch (find_in_cache(directory, name, type, entry))
+    {
+    case DIRECTORY_CACHE_HIT:
+        return 0;
+
+    case DIRECTORY_CACHE_NEGATIVE_HIT:
+        return -1;
+
+    default:
+        break;
+    }
+
+    virtual_lock* lock = directory_lock(directory);
+    lock_for_reading(lock);
+
+    int result = find_entry(directory, name, type, entry);
+    store_in_cache(directory, name, type, result == 0 ? entry : NULL);
+
+    unlock_for_reading(lock);
+
+    return result;
+}
+
+int directory_add_entry(storage_region directory, const char* name,
+                        const directory_entry* entry)
+{
+    virtual_lock* lock = directory_lock(directory);
+    lock_for_writing(lock);
+
+    int result = add_entry(directory, name, entry);
+
+    if (result == -1)
+    {
+        // The directory may have been partly changed, so none of its cached
+        // entries can be trusted
+        forget_in_cache(directory);
+    }
+    else
+    {
+        store_in_cache(directory, name, entry->type, entry);
+    }
+
+    unlock_for_writing(lock);
+
+    return result;
+}
+
+int directory_remove_entry(storage_region directory, const char* name,
+                           entry_type type)
+{
+    virtual_lock* lock = directory_lock(directory);
+    lock_for_writing(lock);
+
+    int result = remove_entry(directory, name, type);
+
+    if (result == -1)
+    {
+        forget_in_cache(directory);
+    }
+    else
+    {
+        store_in_cache(directory, name, type, NULL);
+    }
+
+    unlock_for_writing(lock);
+
+    return result;
+}
+
+int directory_replace_entry(storage_region directory, const char* name,
+                            const directory_entry* entry)
+{
+    virtual_lock* lock = directory_lock(directory);
+    lock_for_writing(lock);
+
+    directory_entry old_entry;
+    int result = replace_entry(directory, name, entry, &old_entry);
+
+    if (result == -1)
+    {
+        forget_in_cache(directory);
+    }
+    else
+    {
+        store_in_cache(directory, name, entry->type, entry);
+
+        // Entries of a moved directory are cached under its old region, and
+        // its new region may have belonged to a directory removed earlier
+        if (entry->type == DIRECTORY_ENTRY
+            && old_entry.content_region != entry->content_region)
+        {
+            forget_in_cache(old_entry.content_region);
+            forget_in_cache(entry->content_region);
+        }
+    }
+
+    unlock_for_writing(lock);
+
+    return result;
+}
+
+bool directory_is_empty(storage_region directory)
+{
+    directory_header header;
+    bool is_empty = false;
+
+    virtual_lock* lock = directory_lock(directory);
+    lock_for_reading(lock);
+
+    if (open_directory(directory, &header) == 0)
+    {
+        is_empty = is_list_format(header.format) ? list_is_empty(&header)
+                                                 : header.entry_count == 0;
+    }
+
+    unlock_for_reading(lock);
+
+    return is_empty;
+}
+
+void directory_forget_cached_entries(storage_region directory)
+{
+    forget_in_cache(directory);
+}
+
+int directory_list_entries(storage_region directory, const char* after_name,
+                           entry_type after_type,
+                           directory_listing_entry* entries,
+                           size_t max_entries)
+{
+    directory_header header;
+    btree_key after = { after_type, 0, after_name };
+
+    if (after_name != NULL)
+    {
+        after.name_length = strlen(after_name);
+    }
+
+    virtual_lock* lock = directory_lock(directory);
+    lock_for_reading(lock);
+
+    int result = -1;
+
+    if (open_directory(directory, &header) == 0)
+    {
+        result = header.format == DIRECTORY_FORMAT_BTREE
+            ? list_btree_entries(&header, after_name != NULL ? &after : NULL,
+                                 entries, max_entries)
+            : list_unsorted_entries(&header,
+                                    after_name != NULL ? &after : NULL,
+                                    entries, max_entries);
+    }
+
+    unlock_for_reading(lock);
+
+    return result;
+}
+
+static int initialize_directory(storage_region directory)
+{
+    if (open_directory(directory, NULL) == -1)
+    {
+        return -1;
+    }
+
+    // The region may have held another directory before, so its entries in
+    // the cache are no longer valid
+    forget_in_cache(directory);
+
+    directory_header header;
+
+    if (default_format_ == DIRECTORY_FORMAT_HASHED)
+    {
+        return write_hashed_table(NULL, 0, HASHED_INITIAL_SLOT_COUNT, &header);
+    }
+
+    if (default_format_ == DIRECTORY_FORMAT_BTREE)
+    {
+        return initialize_btree(&header);
+    }
+
+    // The storage does not clear blocks when they are freed, so the end of
+    // the list has to be marked explicitly
+    char bytes[TAGGED_HEADER_SIZE + 1] =
+        { HEADER_ENTRY, DIRECTORY_FORMAT_TAGGED, NULL_ENTRY };
+    size_t start = default_format_ == DIRECTORY_FORMAT_TAGGED
+        ? 0 : TAGGED_HEADER_SIZE;
+    size_t size = sizeof(bytes) - start;
+
+    return storage_cursor_write(directory_cursor_, bytes + start, size)
+        == size ? 0 : -1;
+}
+
+static void prepare_cache()
+{
+    // Called with the cache lock held
+    if (!cache_initialized_)
+    {
+        cache_initialized_ = true;
+        cache_open_count_ = storage_open_count();
+        directory_cache_initialize(DIRECTORY_DEFAULT_CACHE_CAPACITY);
+    }
+    else if (cache_open_count_ != storage_open_count())
+    {
+        directory_cache_clear();
+        cache_open_count_ = storage_open_count();
+    }
+}
+
+static directory_cache_result find_in_cache(storage_region directory,
+                                            const char* name,
+                                            entry_type type,
+                                            directory_entry* entry)
+{
+    // Finding an entry moves it in the order of use, so even lookups change
+    // the cache
+    lock_for_writing(&cache_lock_);
+    prepare_cache();
+
+    directory_cache_result result =
+        directory_cache_find(directory, name, type, entry);
+
+    unlock_for_writing(&cache_lock_);
+
+    return result;
+}
+
+static void store_in_cache(storage_region directory, const char* name,
+                           entry_type type, const directory_entry* entry)
+{
+    lock_for_writing(&cache_lock_);
+    prepare_cache();
+    directory_cache_store(directory, name, type, entry);
+    unlock_for_writing(&cache_lock_);
+}
+
+static void forget_in_cache(storage_region directory)
+{
+    lock_for_writing(&cache_lock_);
+    prepare_cache();
+    directory_cache_forget_directory(directory);
+    unlock_for_writing(&cache_lock_);
+}
+
+static virtual_lock* directory_lock(storage_region directory)
+{
+    run_once(&directory_locks_once_, initialize_directory_locks);
+
+    // Multiplicative hashing spreads directories in consecutive regions
+    // over the locks
+    return &directory_locks_[((directory * 2654435761u) >> 16)
+                             % DIRECTORY_LOCK_COUNT];
+}
+
+static void initialize_directory_locks()
+{
+    for (size_t i = 0; i < DIRECTORY_LOCK_COUNT; i++)
+    {
+        lock_initialize(&directory_locks_[i]);
+    }
+}
+
+static int find_entry(storage_region directory, const char* name,
+                      entry_type type, directory_entry* entry)
+{
+    directory_header header;
+
+    if (open_directory(directory, &header) == -1)
+    {
+        return -1;
+    }
+
+    if (header.format == DIRECTORY_FORMAT_BTREE)
+    {
+        btree_key key = { type, strlen(name), name };
+
+        return find_btree_entry(&header, &key, entry);
+    }
+
+    size_t position = header.format == DIRECTORY_FORMAT_HASHED
+        ? find_hashed_entry(&header, name, type, entry)
+        : find_list_entry(&header, name, type, entry);
+
+    return position == NO_POSITION ? -1 : 0;
+}
+
+static int add_entry(storage_region directory, const char* name,
+                     const directory_entry* entry)
+{
+    directory_header header;
+
+    if (open_directory(directory, &header) == -1)
+    {
+        return -1;
+    }
+
+    if (header.format == DIRECTORY_FORMAT_FLAT
+        && default_format_ != DIRECTORY_FORMAT_FLAT)
+    {
+        // A directory without a header that has never had any entries, such
+        // as the root directory of a new storage file, is converted to the
+        // default format first
+        char first_entry_type = NULL_ENTRY;
+        storage_cursor_read(directory_cursor_, &first_entry_type, sizeof(char));
+
+        if (first_entry_type == NULL_ENTRY
+            && (initialize_directory(directory) == -1
+                || open_directory(directory, &header) == -1))
+        {
+            return -1;
+        }
+
+        seek_directory_to(0);
+    }
+
+    if (header.format == DIRECTORY_FORMAT_BTREE)
+    {
+        btree_key key = { entry->type, strlen(name), name };
+
+        return add_btree_entry(&header, &key, entry);
+    }
+
+    if (header.format == DIRECTORY_FORMAT_HASHED)
+    {
+        return add_hashed_entry(&header, name, entry);
+    }
+
+    return add_list_entry(&header, name, entry);
+}
+
+static int remove_entry(storage_region directory, const char* name,
+                        entry_type type)
+{
+    directory_header header;
+    directory_entry entry;
+
+    if (open_directory(directory, &header) == -1)
+    {
+        return -1;
+    }
+
+    if (header.format == DIRECTORY_FORMAT_BTREE)
+    {
+        btree_key key = { type, strlen(name), name };
+
+        return remove_btree_entry(&header, &key);
+    }
+
+    char unused_entry = UNUSED_ENTRY;
+
+    if (header.format == DIRECTORY_FORMAT_HASHED)
+    {
+        size_t index = find_hashed_entry(&header, name, type, &entry);
+
+        if (index == NO_POSITION)
+        {
+            return -1;
+        }
+
+        // The slot can't be emptied completely because other entries may
+        // have been placed after it while probing past it
+        seek_directory_to(HASHED_HEADER_SIZE + index * hashed_slot_size());
+        storage_cursor_write(directory_cursor_, &unused_entry, sizeof(char));
+
+        header.entry_count--;
+        header.unused_count++;
+
+        return write_directory_header(&header);
+    }
+
+    size_t position = find_list_entry(&header, name, type, &entry);
+
+    if (position == NO_POSITION)
+    {
+        return -1;
+    }
+
+    seek_directory_to(position);
+    storage_cursor_write(directory_cursor_, &unused_entry, sizeof(char));
+
+    return 0;
+}
+
+static int replace_entry(storage_region directory, const char* name,
+                         const directory_entry* entry,
+                         directory_entry* old_entry)
+{
+    directory_header header;
+
+    if (open_directory(directory, &header) == -1)
+    {
+        return -1;
+    }
+
+    if (header.format == DIRECTORY_FORMAT_BTREE)
+    {
+        btree_key key = { entry->type, strlen(name), name };
+
+        return replace_btree_entry(&header, &key, entry, old_entry);
+    }
+
+    // The slot or list entry keeps its place and its name tag, only the
+    // regions change
+    if (header.format == DIRECTORY_FORMAT_HASHED)
+    {
+        size_t index = find_hashed_entry(&header, name, entry->type,
+                                         old_entry);
+
+        if (index == NO_POSITION)
+        {
+            return -1;
+        }
+
+        hashed_slot slot = { entry->type, hash_name(name),
+                             entry->metadata_region, entry->content_region };
+
+        return write_hashed_slot(index, &slot);
+    }
+
+    size_t position = find_list_entry(&header, name, entry->type, old_entry);
+
+    if (position == NO_POSITION)
+    {
+        return -1;
+    }
+
+    char bytes[ENTRY_MAX_SIZE];
+    size_t entry_size = list_entry_size(&header);
+
+    list_entry listed = { entry->type, strlen(name), hash_name(name),
+                          entry->metadata_region, entry->content_region };
+    encode_list_entry(&header, bytes, &listed);
+
+    seek_directory_to(position);
+
+    return storage_cursor_write(directory_cursor_, bytes, entry_size)
+        == entry_size ? 0 : -1;
+}
+
+static int open_directory(storage_region directory, directory_header* header)
+{
+    // Jump to the start of the directory and read its header if it has one.
+    // The cursors are created when a directory is first used
+    if (directory_cursor_ == NULL)
+    {
+        directory_cursor_ = storage_create_cursor();
+        name_cursor_ = storage_create_cursor();
+    }
+
+    if (directory_cursor_ == NULL || name_cursor_ == NULL
+        || storage_cursor_jump_to_region(directory_cursor_, directory) == -1)
+    {
+        return -1;
+    }
+
+    if (header == NULL)
+    {
+        return 0;
+    }
+
+    char bytes[DIRECTORY_HEADER_MAX_SIZE] = { NULL_ENTRY };
+    storage_cursor_read(directory_cursor_, bytes, DIRECTORY_HEADER_MAX_SIZE);
+    seek_directory_to(0);
+
+    if (bytes[0] != HEADER_ENTRY)
+    {
+        // Directories without a header start directly with their first entry
+        header->format = DIRECTORY_FORMAT_FLAT;
+
+        return 0;
+    }
+
+    header->format = bytes[1];
+
+    if (header->format == DIRECTORY_FORMAT_HASHED)
+    {
+        memcpy(&header->slot_count, bytes + 2, sizeof(uint32_t));
+        memcpy(&header->entry_count, bytes + 6, sizeof(uint32_t));
+        memcpy(&header->unused_count, bytes + 10, sizeof(uint32_t));
+
+        return 0;
+    }
+
+    if (header->format == DIRECTORY_FORMAT_BTREE)
+    {
+        memcpy(&header->root_node, bytes + 2, sizeof(uint32_t));
+        memcpy(&header->node_count, bytes + 6, sizeof(uint32_t));
+        memcpy(&header->entry_count, bytes + 10, sizeof(uint32_t));
+        memcpy(&header->node_size, bytes + 14, sizeof(uint32_t));
+
+        return 0;
+    }
+
+    return header->format == DIRECTORY_FORMAT_TAGGED ? 0 : -1;
+}
+
+static int write_directory_header(const directory_header* header)
+{
+    char bytes[DIRECTORY_HEADER_MAX_SIZE];
+    size_t header_size;
+
+    bytes[0] = HEADER_ENTRY;
+    bytes[1] = header->format;
+
+    if (header->format == DIRECTORY_FORMAT_HASHED)
+    {
+        memcpy(bytes + 2, &header->slot_count, sizeof(uint32_t));
+        memcpy(bytes + 6, &header->entry_count, sizeof(uint32_t));
+        memcpy(bytes + 10, &header->unused_count, sizeof(uint32_t));
+
+        header_size = HASHED_HEADER_SIZE;
+    }
+    else
+    {
+        memcpy(bytes + 2, &header->root_node, sizeof(uint32_t));
+        memcpy(bytes + 6, &header->node_count, sizeof(uint32_t));
+        memcpy(bytes + 10, &header->entry_count, sizeof(uint32_t));
+        memcpy(bytes + 14, &header->node_size, sizeof(uint32_t));
+
+        header_size = BTREE_HEADER_SIZE;
+    }
+
+    seek_directory_to(0);
+
+    return storage_cursor_write(directory_cursor_, bytes, header_size)
+        == header_size ? 0 : -1;
+}
+
+static size_t read_entry_name(const directory_entry* entry, char* name)
+{
+    storage_cursor_jump_to_region(name_cursor_, entry->metadata_region);
+
+    // File metadata starts with the length of the file, and directory metadata
+    // starts directly with the name
+    if (entry->type == FILE_ENTRY)
+    {
+        storage_cursor_seek(name_cursor_, sizeof(size_t));
+    }
+
+    unsigned char name_length = 0;
+    storage_cursor_read(name_cursor_, &name_length, sizeof(char));
+
+    if (name != NULL)
+    {
+        storage_cursor_read(name_cursor_, name, name_length);
+    }
+
+    return name_length;
+}
+
+static bool entry_has_name(const directory_entry* entry, const char* name,
+                           size_t name_length)
+{
+    // The name itself is only read if its length matches
+    if (read_entry_name(entry, NULL) != name_length)
+    {
+        return false;
+    }
+
+    char entry_name[UCHAR_MAX];
+    storage_cursor_read(name_cursor_, entry_name, name_length);
+
+    return memcmp(entry_name, name, name_length) == 0;
+}
+
+static void seek_directory_to(size_t position)
+{
+    size_t current_position = storage_cursor_seek(directory_cursor_, 0);
+    storage_cursor_seek(directory_cursor_,
+                        (off_t)position - (off_t)current_position);
+}
+
+static bool is_list_format(directory_format format)
+{
+    return format == DIRECTORY_FORMAT_FLAT || format == DIRECTORY_FORMAT_TAGGED;
+}
+
+static size_t find_list_entry(const directory_header* header,
+                              const char* name, entry_type type,
+                              directory_entry* entry)
+{
+    bool tagged = header->format == DIRECTORY_FORMAT_TAGGED;
+    size_t name_length = strlen(name);
+    uint32_t name_hash = hash_name(name);
+    size_t entry_size = list_entry_size(header);
+    size_t position = list_start(header);
+    char batch[LIST_BATCH_SIZE];
+
+    while (true)
+    {
+        size_t batch_entries = read_list_batch(header, position, batch);
+
+        for (size_t i = 0; i < batch_entries; i++, position += entry_size)
+        {
+            list_entry listed;
+            decode_list_entry(header, batch + i * entry_size, &listed);
+
+            // Null entry means end of directory
+            if (listed.type == NULL_ENTRY)
+            {
+                return NO_POSITION;
+            }
+
+            // Skip past other entry types, and in tagged directories also
+            // past entries whose name can't match
+            if (listed.type != (char)type
+                || (tagged && (listed.name_length != name_length
+                               || listed.name_hash != name_hash)))
+            {
+                continue;
+            }
+
+            directory_entry candidate =
+                { type, listed.metadata_region, listed.content_region };
+
+            if (entry_has_name(&candidate, name, name_length))
+            {
+                *entry = candidate;
+
+                return position;
+            }
+        }
+    }
+}
+
+static size_t find_free_list_entry(const directory_header* header,
+                                   bool* at_end)
+{
+    // Find the first unused entry or the null entry at the end of the list
+    size_t entry_size = list_entry_size(header);
+    size_t position = list_start(header);
+    char batch[LIST_BATCH_SIZE];
+
+    while (true)
+    {
+        size_t batch_entries = read_list_batch(header, position, batch);
+
+        for (size_t i = 0; i < batch_entries; i++, position += entry_size)
+        {
+            char entry_type = batch[i * entry_size];
+
+            if (entry_type == NULL_ENTRY || entry_type == UNUSED_ENTRY)
+            {
+                *at_end = entry_type == NULL_ENTRY;
+
+                return position;
+            }
+        }
+    }
+}
+
+static int add_list_entry(const directory_header* header, const char* name,
+                          const directory_entry* entry)
+{
+    bool at_end = false;
+    size_t position = find_free_list_entry(header, &at_end);
+
+    // When the null entry is replaced, a new one is written after the new
+    // entry to keep the end of the list marked
+    size_t entry_size = list_entry_size(header);
+    char bytes[ENTRY_MAX_SIZE + 1];
+
+    list_entry listed = { entry->type, strlen(name), hash_name(name),
+                          entry->metadata_region, entry->content_region };
+    encode_list_entry(header, bytes, &listed);
+    bytes[entry_size] = NULL_ENTRY;
+
+    if (at_end)
+    {
+        entry_size += sizeof(char);
+    }
+
+    seek_directory_to(position);
+
+    return storage_cursor_write(directory_cursor_, bytes, entry_size)
+        == entry_size ? 0 : -1;
+}
+
+static bool list_is_empty(const directory_header* header)
+{
+    size_t entry_size = list_entry_size(header);
+    size_t position = list_start(header);
+    char batch[LIST_BATCH_SIZE];
+
+    while (true)
+    {
+        size_t batch_entries = read_list_batch(header, position, batch);
+
+        for (size_t i = 0; i < batch_entries; i++)
+        {
+            char entry_type = batch[i * entry_size];
+
+            if (entry_type == NULL_ENTRY)
+            {
+                return true;
+            }
+
+            if (entry_type != UNUSED_ENTRY)
+            {
+                return false;
+            }
+        }
+
+        position += batch_entries * entry_size;
+    }
+}
+
+static size_t read_list_batch(const directory_header* header, size_t position,
+                              char* batch)
+{
+    // Reads as many whole entries from the position as fit in a batch. Bytes
+    // past the end of the region read as null entries
+    size_t batch_entries = LIST_BATCH_SIZE / list_entry_size(header);
+    size_t batch_size = batch_entries * list_entry_size(header);
+
+    memset(batch, NULL_ENTRY, batch_size);
+    seek_directory_to(position);
+    storage_cursor_read(directory_cursor_, batch, batch_size);
+
+    return batch_entries;
+}
+
+static void encode_list_entry(const directory_header* header, char* bytes,
+                              const list_entry* entry)
+{
+    size_t region_size = storage_region_size();
+
+    bytes[0] = entry->type;
+    bytes++;
+
+    if (header->format == DIRECTORY_FORMAT_TAGGED)
+    {
+        bytes[0] = entry->name_length;
+        memcpy(bytes + 1, &entry->name_hash, sizeof(uint32_t));
+        bytes += 1 + sizeof(uint32_t);
+    }
+
+    storage_encode_region_id(bytes, entry->metadata_region);
+    storage_encode_region_id(bytes + region_size, entry->content_region);
+}
+
+static void decode_list_entry(const directory_header* header,
+                              const char* bytes, list_entry* entry)
+{
+    entry->type = bytes[0];
+    entry->name_length = 0;
+    entry->name_hash = 0;
+    bytes++;
+
+    if (header->format == DIRECTORY_FORMAT_TAGGED)
+    {
+        entry->name_length = bytes[0];
+        memcpy(&entry->name_hash, bytes + 1, sizeof(uint32_t));
+        bytes += 1 + sizeof(uint32_t);
+    }
+
+    entry->metadata_region = storage_decode_region_id(bytes);
+    entry->content_region =
+        storage_decode_region_id(bytes + storage_region_size());
+}
+
+static size_t list_entry_size(const directory_header* header)
+{
+    size_t tag_size = header->format == DIRECTORY_FORMAT_TAGGED
+        ? sizeof(char) + sizeof(uint32_t) : 0;
+
+    return sizeof(char) + tag_size + storage_region_size() * 2;
+}
+
+static size_t list_start(const directory_header* header)
+{
+    return header->format == DIRECTORY_FORMAT_TAGGED ? TAGGED_HEADER_SIZE : 0;
+}
+
+static size_t find_hashed_entry(const directory_header* header,
+                                const char* name, entry_type type,
+                                directory_entry* entry)
+{
+    uint32_t name_hash = hash_name(name);
+    size_t name_length = strlen(name);
+    size_t slot_mask = header->slot_count - 1;
+
+    // Go through the slots from the one given by the hash until an empty
+    // slot is found. Only slots with the same hash need their name compared
+    for (size_t probe = 0; probe < header->slot_count; probe++)
+    {
+        size_t index = (name_hash + probe) & slot_mask;
+
+        hashed_slot slot;
+        read_hashed_slot(index, &slot);
+
+        if (slot.type == NULL_ENTRY)
+        {
+            break;
+        }
+
+        if (slot.type != (char)type || slot.name_hash != name_hash)
+        {
+            continue;
+        }
+
+        directory_entry candidate =
+            { type, slot.metadata_region, slot.content_region };
+
+        if (entry_has_name(&candidate, name, name_length))
+        {
+            *entry = candidate;
+
+            return index;
+        }
+    }
+
+    return NO_POSITION;
+}
+
+static int add_hashed_entry(directory_header* header, const char* name,
+                            const directory_entry* entry)
+{
+    // At least a quarter of the slots is kept empty so that probing stays
+    // short and always ends at an empty slot. The table only grows if the
+    // entries take more than half of the slots, otherwise rebuilding it just
+    // clears the unused slots
+    if ((header->entry_count + header->unused_count + 1) * 4
+        > header->slot_count * 3)
+    {
+        uint32_t slot_count = header->slot_count;
+
+        while ((header->entry_count + 1) * 2 > slot_count)
+        {
+            slot_count *= 2;
+        }
+
+        if (rebuild_hashed_table(header, slot_count) == -1)
+        {
+            return -1;
+        }
+    }
+
+    uint32_t name_hash = hash_name(name);
+    size_t slot_mask = header->slot_count - 1;
+    size_t index = name_hash & slot_mask;
+
+    hashed_slot slot;
+    read_hashed_slot(index, &slot);
+
+    while (slot.type != NULL_ENTRY && slot.type != UNUSED_ENTRY)
+    {
+        index = (index + 1) & slot_mask;
+        read_hashed_slot(index, &slot);
+    }
+
+    if (slot.type == UNUSED_ENTRY)
+    {
+        header->unused_count--;
+    }
+
+    header->entry_count++;
+
+    slot = (hashed_slot)
+        { entry->type, name_hash, entry->metadata_region, entry->content_region };
+
+    if (write_hashed_slot(index, &slot) == -1)
+    {
+        return -1;
+    }
+
+    return write_directory_header(header);
+}
+
+static int rebuild_hashed_table(directory_header* header, uint32_t slot_count)
+{
+    // Read the whole table at once and write the entries into a new table
+    // that replaces it at the start of the directory
+    size_t slot_size = hashed_slot_size();
+    char* table = malloc(header->slot_count * slot_size);
+    hashed_slot* entries = malloc(header->entry_count * sizeof(hashed_slot)
+                                  + sizeof(hashed_slot));
+
+    if (table == NULL || entries == NULL)
+    {
+        free(table);
+        free(entries);
+
+        return -1;
+    }
+
+    seek_directory_to(HASHED_HEADER_SIZE);
+    storage_cursor_read(directory_cursor_, table,
+                        header->slot_count * slot_size);
+
+    size_t entry_count = 0;
+
+    for (size_t i = 0; i < header->slot_count; i++)
+    {
+        hashed_slot slot;
+        decode_hashed_slot(table + i * slot_size, &slot);
+
+        if (slot.type != NULL_ENTRY && slot.type != UNUSED_ENTRY
+            && entry_count < header->entry_count)
+        {
+            entries[entry_count++] = slot;
+        }
+    }
+
+    int result = write_hashed_table(entries, entry_count, slot_count, header);
+
+    free(table);
+    free(entries);
+
+    return result;
+}
+
+static int write_hashed_table(const hashed_slot* slots, size_t slot_count,
+                              uint32_t table_slot_count,
+                              directory_header* header)
+{
+    size_t slot_size = hashed_slot_size();
+    size_t table_size = table_slot_count * slot_size;
+    char* table = calloc(table_size, 1);
+
+    if (table == NULL)
+    {
+        return -1;
+    }
+
+    size_t slot_mask = table_slot_count - 1;
+
+    for (size_t i = 0; i < slot_count; i++)
+    {
+        size_t index = slots[i].name_hash & slot_mask;
+
+        while (table[index * slot_size] != NULL_ENTRY)
+        {
+            index = (index + 1) & slot_mask;
+        }
+
+        encode_hashed_slot(table + index * slot_size, &slots[i]);
+    }
+
+    // The slots are written before the header so that the header never
+    // refers to more slots than the directory has
+    seek_directory_to(HASHED_HEADER_SIZE);
+    size_t written_bytes =
+        storage_cursor_write(directory_cursor_, table, table_size);
+
+    free(table);
+
+    if (written_bytes != table_size)
+    {
+        return -1;
+    }
+
+    header->format = DIRECTORY_FORMAT_HASHED;
+    header->slot_count = table_slot_count;
+    header->entry_count = slot_count;
+    header->unused_count = 0;
+
+    return write_directory_header(header);
+}
+
+static void read_hashed_slot(size_t index, hashed_slot* slot)
+{
+    char bytes[ENTRY_MAX_SIZE] = { NULL_ENTRY };
+
+    seek_directory_to(HASHED_HEADER_SIZE + index * hashed_slot_size());
+    storage_cursor_read(directory_cursor_, bytes, hashed_slot_size());
+
+    decode_hashed_slot(bytes, slot);
+}
+
+static int write_hashed_slot(size_t index, const hashed_slot* slot)
+{
+    char bytes[ENTRY_MAX_SIZE];
+    encode_hashed_slot(bytes, slot);
+
+    seek_directory_to(HASHED_HEADER_SIZE + index * hashed_slot_size());
+
+    return storage_cursor_write(directory_cursor_, bytes, hashed_slot_size())
+        == hashed_slot_size() ? 0 : -1;
+}
+
+static void encode_hashed_slot(char* bytes, const hashed_slot* slot)
+{
+    bytes[0] = slot->type;
+    memcpy(bytes + 1, &slot->name_hash, sizeof(uint32_t));
+    storage_encode_region_id(bytes + 1 + sizeof(uint32_t),
+                             slot->metadata_region);
+    storage_encode_region_id(bytes + 1 + sizeof(uint32_t)
+                             + storage_region_size(), slot->content_region);
+}
+
+static void decode_hashed_slot(const char* bytes, hashed_slot* slot)
+{
+    slot->type = bytes[0];
+    memcpy(&slot->name_hash, bytes + 1, sizeof(uint32_t));
+    slot->metadata_region =
+        storage_decode_region_id(bytes + 1 + sizeof(uint32_t));
+    slot->content_region = storage_decode_region_id(
+        bytes + 1 + sizeof(uint32_t) + storage_region_size());
+}
+
+static size_t hashed_slot_size()
+{
+    return sizeof(char) + sizeof(uint32_t) + storage_region_size() * 2;
+}
+
+static uint32_t hash_name(const char* name)
+{
+    // 32-bit FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (; *name != '\0'; name++)
+    {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+
+    return hash;
+}
+
+static int list_unsorted_entries(const directory_header* header,
+                                 const btree_key* after,
+                                 directory_listing_entry* entries,
+                                 size_t max_entries)
+{
+    // Collect every entry after the given one along with its name, sort them
+    // and keep the first ones
+    size_t capacity = 16;
+    size_t entry_count = 0;
+    directory_listing_entry* listing =
+        malloc(capacity * sizeof(directory_listing_entry));
+
+    if (listing == NULL)
+    {
+        return -1;
+    }
+
+    bool hashed = header->format == DIRECTORY_FORMAT_HASHED;
+    size_t entry_size = hashed ? hashed_slot_size() : list_entry_size(header);
+    size_t position = hashed ? HASHED_HEADER_SIZE : list_start(header);
+    size_t end_position = hashed
+        ? position + header->slot_count * entry_size : NO_POSITION;
+
+    for (; position < end_position; position += entry_size)
+    {
+        char bytes[ENTRY_MAX_SIZE] = { NULL_ENTRY };
+
+        seek_directory_to(position);
+        storage_cursor_read(directory_cursor_, bytes, entry_size);
+
+        directory_entry entry = { bytes[0], INVALID_REGION, INVALID_REGION };
+
+        if (hashed)
+        {
+            hashed_slot slot;
+            decode_hashed_slot(bytes, &slot);
+
+            entry.metadata_region = slot.metadata_region;
+            entry.content_region = slot.content_region;
+        }
+        else if (entry.type == NULL_ENTRY)
+        {
+            // Null entry means end of a flat or tagged directory
+            break;
+        }
+        else
+        {
+            list_entry listed;
+            decode_list_entry(header, bytes, &listed);
+
+            entry.metadata_region = listed.metadata_region;
+            entry.content_region = listed.content_region;
+        }
+
+        if (entry.type != FILE_ENTRY && entry.type != DIRECTORY_ENTRY)
+        {
+            continue;
+        }
+
+        if (entry_count == capacity)
+        {
+            capacity *= 2;
+            directory_listing_entry* grown_listing =
+                realloc(listing, capacity * sizeof(directory_listing_entry));
+
+            if (grown_listing == NULL)
+            {
+                free(listing);
+
+                return -1;
+            }
+
+            listing = grown_listing;
+        }
+
+        directory_listing_entry* listed = &listing[entry_count];
+        size_t name_length = read_entry_name(&entry, listed->name);
+        listed->name[name_length] = '\0';
+        listed->entry = entry;
+
+        btree_key key = { entry.type, name_length, listed->name };
+
+        if (after == NULL || compare_btree_keys(&key, after) > 0)
+        {
+            entry_count++;
+        }
+    }
+
+    qsort(listing, entry_count, sizeof(directory_listing_entry),
+          compare_listing_entries);
+
+    if (entry_count > max_entries)
+    {
+        entry_count = max_entries;
+    }
+
+    memcpy(entries, listing, entry_count * sizeof(directory_listing_entry));
+    free(listing);
+
+    return entry_count;
+}
+
+static int compare_listing_entries(const void* first, const void* second)
+{
+    const directory_listing_entry* first_entry = first;
+    const directory_listing_entry* second_entry = second;
+
+    btree_key first_key = { first_entry->entry.type,
+                            strlen(first_entry->name), first_entry->name };
+    btree_key second_key = { second_entry->entry.type,
+                             strlen(second_entry->name), second_entry->name };
+
+    return compare_btree_keys(&first_key, &second_key);
+}
+
+static int initialize_btree(directory_header* header)
+{
+    // The first node holds the header and the second one is the root, which
+    // starts out as an empty leaf
+    size_t block_size = storage_block_size();
+    size_t node_size = block_size;
+
+    while (node_size < BTREE_MIN_NODE_SIZE)
+    {
+        node_size += block_size;
+    }
+
+    *header = (directory_header)
+        { DIRECTORY_FORMAT_BTREE, 0, 0, 0, 1, 2, node_size };
+
+    char* nodes = calloc(node_size * 2, 1);
+
+    if (nodes == NULL)
+    {
+        return -1;
+    }
+
+    initialize_btree_node(nodes + node_size, BTREE_LEAF_NODE, BTREE_NO_NODE);
+
+    seek_directory_to(0);
+    size_t written_bytes =
+        storage_cursor_write(directory_cursor_, nodes, node_size * 2);
+
+    free(nodes);
+
+    if (written_bytes != node_size * 2)
+    {
+        return -1;
+    }
+
+    return write_directory_header(header);
+}
+
+static int find_btree_entry(const directory_header* header,
+                            const btree_key* key, directory_entry* entry)
+{
+    char* node = malloc(header->node_size);
+
+    if (node == NULL
+        || find_btree_leaf(header, key, node, NULL, NULL) == BTREE_NO_NODE)
+    {
+        free(node);
+
+        return -1;
+    }
+
+    bool found;
+    size_t offset = find_btree_record(node, key, &found, NULL);
+
+    if (found)
+    {
+        decode_btree_record(node, offset, NULL, entry);
+    }
+
+    free(node);
+
+    return found ? 0 : -1;
+}
+
+static int add_btree_entry(directory_header* header, const btree_key* key,
+                           const directory_entry* entry)
+{
+    // The node buffer has room for one record more than fits in a node, so a
+    // record can be inserted before the node is split
+    char* node = malloc(header->node_size + BTREE_RECORD_MAX_SIZE);
+    char* sibling = calloc(header->node_size, 1);
+    uint32_t path[BTREE_MAX_HEIGHT];
+    size_t depth = 0;
+
+    uint32_t index = BTREE_NO_NODE;
+
+    if (node != NULL && sibling != NULL)
+    {
+        index = find_btree_leaf(header, key, node, path, &depth);
+    }
+
+    bool found = false;
+    size_t offset = 0;
+
+    if (index != BTREE_NO_NODE)
+    {
+        offset = find_btree_record(node, key, &found, NULL);
+    }
+
+    if (index == BTREE_NO_NODE || found)
+    {
+        // Entries with the same name and type are not allowed
+        free(node);
+        free(sibling);
+
+        return -1;
+    }
+
+    char record[BTREE_RECORD_MAX_SIZE];
+    size_t record_size = encode_btree_record(record, key, entry, 0);
+    int result = 0;
+
+    // Insert the record, and as long as the node it went into is too full,
+    // split the node and insert the first key of the new node into the
+    // parent node
+    while (true)
+    {
+        insert_btree_record(node, offset, record, record_size);
+
+        if (btree_node_end(node) <= header->node_size)
+        {
+            result = write_btree_node(header, index, node);
+
+            break;
+        }
+
+        uint32_t sibling_index = header->node_count++;
+        split_btree_node(node, sibling, record, sibling_index);
+
+        btree_key separator;
+        decode_btree_record(record, 0, &separator, NULL);
+        record_size = 2 + separator.name_length + sizeof(uint32_t);
+
+        if (write_btree_node(header, index, node) == -1
+            || write_btree_node(header, sibling_index, sibling) == -1)
+        {
+            result = -1;
+
+            break;
+        }
+
+        if (depth == 0)
+        {
+            // The root was split: the tree grows by one level with a new root
+            // above the two halves
+            header->root_node = header->node_count++;
+
+            initialize_btree_node(node, BTREE_INTERNAL_NODE, index);
+            insert_btree_record(node, BTREE_NODE_HEADER_SIZE, record,
+                                record_size);
+
+            result = write_btree_node(header, header->root_node, node);
+
+            break;
+        }
+
+        index = path[--depth];
+
+        if (read_btree_node(header, index, node) == -1)
+        {
+            result = -1;
+
+            break;
+        }
+
+        offset = find_btree_record(node, &separator, &found, NULL);
+    }
+
+    free(node);
+    free(sibling);
+
+    if (result == -1)
+    {
+        return -1;
+    }
+
+    header->entry_count++;
+
+    return write_directory_header(header);
+}
+
+static int remove_btree_entry(directory_header* header, const btree_key* key)
+{
+    char* node = malloc(header->node_size);
+    uint32_t index = BTREE_NO_NODE;
+
+    if (node != NULL)
+    {
+        index = find_btree_leaf(header, key, node, NULL, NULL);
+    }
+
+    bool found = false;
+    size_t offset = 0;
+
+    if (index != BTREE_NO_NODE)
+    {
+        offset = find_btree_record(node, key, &found, NULL);
+    }
+
+    if (!found)
+    {
+        free(node);
+
+        return -1;
+    }
+
+    size_t record_size = btree_record_size(node, offset);
+    size_t node_end = btree_node_end(node);
+
+    memmove(node + offset, node + offset + record_size,
+            node_end - offset - record_size);
+    set_btree_node_record_count(node, btree_node_record_count(node) - 1);
+
+    int result = write_btree_node(header, index, node);
+    free(node);
+
+    if (result == -1)
+    {
+        return -1;
+    }
+
+    header->entry_count--;
+
+    return write_directory_header(header);
+}
+
+static int replace_btree_entry(const directory_header* header,
+                               const btree_key* key,
+                               const directory_entry* entry,
+                               directory_entry* old_entry)
+{
+    // Region IDs have a fixed size, so the new record takes the place of the
+    // old one without moving the records after it
+    char* node = malloc(header->node_size);
+    uint32_t index = BTREE_NO_NODE;
+
+    if (node != NULL)
+    {
+        index = find_btree_leaf(header, key, node, NULL, NULL);
+    }
+
+    bool found = false;
+    size_t offset = 0;
+
+    if (index != BTREE_NO_NODE)
+    {
+        offset = find_btree_record(node, key, &found, NULL);
+    }
+
+    if (!found)
+    {
+        free(node);
+
+        return -1;
+    }
+
+    decode_btree_record(node, offset, NULL, old_entry);
+    encode_btree_record(node + offset, key, entry, 0);
+
+    int result = write_btree_node(header, index, node);
+    free(node);
+
+    return result;
+}
+
+static int list_btree_entries(const directory_header* header,
+                              const btree_key* after,
+                              directory_listing_entry* entries,
+                              size_t max_entries)
+{
+    char* node = malloc(header->node_size);
+
+    if (node == NULL)
+    {
+        return -1;
+    }
+
+    // Start from the leaf where the given entry is or would be, and continue
+    // through the following leaves until enough entries have been listed.
+    // Without a given entry, the empty key that comes before all names finds
+    // the first leaf
+    btree_key first_key = { NULL_ENTRY, 0, "" };
+    uint32_t index = find_btree_leaf(header, after != NULL ? after : &first_key,
+                                     node, NULL, NULL);
+    size_t offset = BTREE_NODE_HEADER_SIZE;
+
+    if (index != BTREE_NO_NODE && after != NULL)
+    {
+        bool found;
+        offset = find_btree_record(node, after, &found, NULL);
+
+        if (found)
+        {
+            offset += btree_record_size(node, offset);
+        }
+    }
+
+    size_t node_end = index != BTREE_NO_NODE ? btree_node_end(node) : 0;
+    size_t entry_count = 0;
+
+    while (index != BTREE_NO_NODE && entry_count < max_entries)
+    {
+        if (offset >= node_end)
+        {
+            index = btree_node_link(node);
+
+            if (index != BTREE_NO_NODE
+                && read_btree_node(header, index, node) == -1)
+            {
+                free(node);
+
+                return -1;
+            }
+
+            offset = BTREE_NODE_HEADER_SIZE;
+            node_end = btree_node_end(node);
+
+            continue;
+        }
+
+        btree_key key;
+        decode_btree_record(node, offset, &key, &entries[entry_count].entry);
+
+        memcpy(entries[entry_count].name, key.name, key.name_length);
+        entries[entry_count].name[key.name_length] = '\0';
+
+        entry_count++;
+        offset += btree_record_size(node, offset);
+    }
+
+    free(node);
+
+    return entry_count;
+}
+
+static uint32_t find_btree_leaf(const directory_header* header,
+                                const btree_key* key, char* node,
+                                uint32_t* path, size_t* depth)
+{
+    // Go down from the root to the leaf that the key belongs to, following
+    // the child of the last key in each internal node that is not greater
+    // than the key. The internal nodes that were passed are stored in the path
+    uint32_t index = header->root_node;
+
+    if (read_btree_node(header, index, node) == -1)
+    {
+        return BTREE_NO_NODE;
+    }
+
+    while (node[0] == BTREE_INTERNAL_NODE)
+    {
+        if (path != NULL)
+        {
+            if (*depth == BTREE_MAX_HEIGHT)
+            {
+                return BTREE_NO_NODE;
+            }
+
+            path[(*depth)++] = index;
+        }
+
+        bool found;
+        size_t previous_offset;
+        size_t offset = find_btree_record(node, key, &found, &previous_offset);
+
+        if (found)
+        {
+            index = btree_record_child(node, offset);
+        }
+        else if (previous_offset != NO_POSITION)
+        {
+            index = btree_record_child(node, previous_offset);
+        }
+        else
+        {
+            index = btree_node_link(node);
+        }
+
+        if (read_btree_node(header, index, node) == -1)
+        {
+            return BTREE_NO_NODE;
+        }
+    }
+
+    return index;
+}
+
+static void split_btree_node(char* node, char* sibling, char* separator,
+                             uint32_t sibling_index)
+{
+    // Find the record that crosses the middle of the node's records. A leaf is
+    // split before it, or after it if it's the first record, and the first
+    // key of the new node is copied to the parent. An internal node gives the
+    // record's child to the new node as its first child and moves the key up
+    // to the parent
+    size_t node_end = btree_node_end(node);
+    size_t middle = BTREE_NODE_HEADER_SIZE
+        + (node_end - BTREE_NODE_HEADER_SIZE) / 2;
+    size_t offset = BTREE_NODE_HEADER_SIZE;
+    uint32_t record_index = 0;
+
+    while (offset + btree_record_size(node, offset) <= middle)
+    {
+        offset += btree_record_size(node, offset);
+        record_index++;
+    }
+
+    uint32_t record_count = btree_node_record_count(node);
+    btree_key key;
+    size_t sibling_start = offset;
+
+    if (node[0] == BTREE_LEAF_NODE)
+    {
+        if (record_index == 0)
+        {
+            sibling_start += btree_record_size(node, offset);
+            record_index++;
+        }
+
+        decode_btree_record(node, sibling_start, &key, NULL);
+        initialize_btree_node(sibling, BTREE_LEAF_NODE, btree_node_link(node));
+        set_btree_node_link(node, sibling_index);
+        set_btree_node_record_count(sibling, record_count - record_index);
+    }
+    else
+    {
+        decode_btree_record(node, offset, &key, NULL);
+        initialize_btree_node(sibling, BTREE_INTERNAL_NODE,
+                              btree_record_child(node, offset));
+        sibling_start += btree_record_size(node, offset);
+        set_btree_node_record_count(sibling, record_count - record_index - 1);
+    }
+
+    encode_btree_record(separator, &key, NULL, sibling_index);
+
+    memcpy(sibling + BTREE_NODE_HEADER_SIZE, node + sibling_start,
+           node_end - sibling_start);
+    set_btree_node_record_count(node, record_index);
+}
+
+static size_t find_btree_record(const char* node, const btree_key* key,
+                                bool* found, size_t* previous_offset)
+{
+    // Returns the offset of the first record whose key is not less than the
+    // given key, and the offset of the record before it if there is one
+    size_t offset = BTREE_NODE_HEADER_SIZE;
+    uint32_t record_count = btree_node_record_count(node);
+
+    *found = false;
+
+    if (previous_offset != NULL)
+    {
+        *previous_offset = NO_POSITION;
+    }
+
+    for (uint32_t i = 0; i < record_count; i++)
+    {
+        btree_key record_key;
+        decode_btree_record(node, offset, &record_key, NULL);
+
+        int comparison = compare_btree_keys(&record_key, key);
+
+        if (comparison >= 0)
+        {
+            *found = comparison == 0;
+
+            break;
+        }
+
+        if (previous_offset != NULL)
+        {
+            *previous_offset = offset;
+        }
+
+        offset += btree_record_size(node, offset);
+    }
+
+    return offset;
+}
+
+static void insert_btree_record(char* node, size_t offset, const char* record,
+                                size_t record_size)
+{
+    size_t node_end = btree_node_end(node);
+
+    memmove(node + offset + record_size, node + offset, node_end - offset);
+    memcpy(node + offset, record, record_size);
+
+    set_btree_node_record_count(node, btree_node_record_count(node) + 1);
+}
+
+static size_t encode_btree_record(char* record, const btree_key* key,
+                                  const directory_entry* entry,
+                                  uint32_t child)
+{
+    // Leaf records end with the region IDs of the entry and internal records
+    // with the index of a child node
+    record[0] = key->type;
+    record[1] = key->name_length;
+    memmove(record + 2, key->name, key->name_length);
+
+    size_t record_size = 2 + key->name_length;
+
+    if (entry != NULL)
+    {
+        storage_encode_region_id(record + record_size, entry->metadata_region);
+        record_size += storage_region_size();
+        storage_encode_region_id(record + record_size, entry->content_region);
+        record_size += storage_region_size();
+    }
+    else
+    {
+        memcpy(record + record_size, &child, sizeof(uint32_t));
+        record_size += sizeof(uint32_t);
+    }
+
+    return record_size;
+}
+
+static void decode_btree_record(const char* node, size_t offset,
+                                btree_key* key, directory_entry* entry)
+{
+    const char* record = node + offset;
+
+    if (key != NULL)
+    {
+        key->type = record[0];
+        key->name_length = (unsigned char)record[1];
+        key->name = record + 2;
+    }
+
+    if (entry != NULL)
+    {
+        size_t name_end = 2 + (unsigned char)record[1];
+
+        entry->type = record[0];
+        entry->metadata_region = storage_decode_region_id(record + name_end);
+        entry->content_region = storage_decode_region_id(
+            record + name_end + storage_region_size());
+    }
+}
+
+static uint32_t btree_record_child(const char* node, size_t offset)
+{
+    uint32_t child;
+    memcpy(&child, node + offset + 2 + (unsigned char)node[offset + 1],
+           sizeof(uint32_t));
+
+    return child;
+}
+
+static size_t btree_record_size(const char* node, size_t offset)
+{
+    size_t key_size = 2 + (unsigned char)node[offset + 1];
+
+    return key_size + (node[0] == BTREE_LEAF_NODE
+        ? storage_region_size() * 2 : sizeof(uint32_t));
+}
+
+static size_t btree_node_end(const char* node)
+{
+    size_t offset = BTREE_NODE_HEADER_SIZE;
+    uint32_t record_count = btree_node_record_count(node);
+
+    for (uint32_t i = 0; i < record_count; i++)
+    {
+        offset += btree_record_size(node, offset);
+    }
+
+    return offset;
+}
+
+static uint32_t btree_node_record_count(const char* node)
+{
+    uint32_t record_count;
+    memcpy(&record_count, node + 1, sizeof(uint32_t));
+
+    return record_count;
+}
+
+static uint32_t btree_node_link(const char* node)
+{
+    // The next leaf of a leaf node, or the first child of an internal node
+    uint32_t link;
+    memcpy(&link, node + 5, sizeof(uint32_t));
+
+    return link;
+}
+
+static void initialize_btree_node(char* node, char kind, uint32_t link)
+{
+    node[0] = kind;
+    set_btree_node_record_count(node, 0);
+    set_btree_node_link(node, link);
+}
+
+static void set_btree_node_record_count(char* node, uint32_t record_count)
+{
+    memcpy(node + 1, &record_count, sizeof(uint32_t));
+}
+
+static void set_btree_node_link(char* node, uint32_t link)
+{
+    memcpy(node + 5, &link, sizeof(uint32_t));
+}
+
+static int read_btree_node(const directory_header* header, uint32_t index,
+                           char* node)
+{
+    if (index == BTREE_NO_NODE || index >= header->node_count)
+    {
+        return -1;
+    }
+
+    seek_directory_to((size_t)index * header->node_size);
+
+    return storage_cursor_read(directory_cursor_, node, header->node_size)
+        == header->node_size ? 0 : -1;
+}
+
+static int write_btree_node(const directory_header* header, uint32_t index,
+                            char* node)
+{
+    // Nodes are always written whole, so a new node at the end of the region
+    // extends the region by exactly one node
+    seek_directory_to((size_t)index * header->node_size);
+
+    return storage_cursor_write(directory_cursor_, node, header->node_size)
+        == header->node_size ? 0 : -1;
+}
+
+static int compare_btree_keys(const btree_key* first, const btree_key* second)
+{
+    size_t common_length = first->name_length < second->name_length
+        ? first->name_length : second->name_length;
+    int comparison = memcmp(first->name, second->name, common_length);
+
+    if (comparison != 0)
+    {
+        return comparison;
+    }
+
+    if (first->name_length != second->name_length)
+    {
+        return first->name_length < second->name_length ? -1 : 1;
+    }
+
+    return (first->type > second->type) - (first->type < second->type);
+}
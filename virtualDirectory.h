@@ -0,0 +1,105 @@
+#ifndef VIRTUALDIRECTORY_H
+#define VIRTUALDIRECTORY_H
+
+// This module implements the directories of the virtual file system. A
+// directory is stored in its content region as a collection of entries that
+// each point to the metadata and content regions of a file or another
+// directory. The module finds, adds and removes entries by name, reading the
+// names of entries from their metadata regions when needed.
+
+#include "virtualStorage.h"
+
+#include <limits.h>
+#include <stdbool.h>
+
+#define DIRECTORY_DEFAULT_CACHE_CAPACITY 1024
+
+// More entry types could be added for e.g. shortcuts/symbolic links. The
+// header entry is only used at the start of directories that have a header
+typedef enum { NULL_ENTRY = 0, UNUSED_ENTRY = 1, FILE_ENTRY = 2,
+               DIRECTORY_ENTRY = 3, HEADER_ENTRY = 4 } entry_type;
+
+// Flat directories are a list of entries that is searched from the start.
+// Tagged directories are also a list, but each entry holds the length and hash
+// of its name, so entries with other names are passed over without reading
+// their metadata. Hashed directories are a hash table of entries keyed by a
+// hash of the entry name, so finding an entry only reads a few entries
+// regardless of the size of the directory. B-tree directories keep their
+// entries sorted by name in a B+ tree, so entries are found in logarithmic time
+// and can be listed in order a page at a time
+typedef enum { DIRECTORY_FORMAT_FLAT = 0, DIRECTORY_FORMAT_HASHED = 1,
+               DIRECTORY_FORMAT_BTREE = 2,
+               DIRECTORY_FORMAT_TAGGED = 3 } directory_format;
+
+typedef struct directory_entry
+{
+    entry_type type;
+    storage_region metadata_region;
+    storage_region content_region;
+} directory_entry;
+
+// Counters of the directory entry cache since its capacity was last set
+typedef struct directory_cache_statistics
+{
+    size_t hits;
+    size_t negative_hits;
+    size_t misses;
+    size_t evictions;
+} directory_cache_statistics;
+
+typedef struct directory_listing_entry
+{
+    directory_entry entry;
+    char name[UCHAR_MAX + 1];
+} directory_listing_entry;
+
+// The default format is used for new directories, and empty directories
+// without a header are converted to it when an entry is added to them
+void directory_set_default_format(directory_format format);
+
+// Recently found entries, and names that were looked up but not found, are
+// kept in a cache of directory entries so that finding them again doesn't
+// read the storage. The cache holds DIRECTORY_DEFAULT_CACHE_CAPACITY entries
+// by default, and a capacity of zero disables it. The cache is emptied when
+// the storage is opened again
+int directory_set_cache_capacity(size_t capacity);
+directory_cache_statistics directory_get_cache_statistics();
+
+// Writes an empty directory in the default format to a newly allocated
+// content region
+int directory_initialize(storage_region directory);
+
+// The name of an entry is stored in its metadata region, which has to be
+// written before the entry is added
+int directory_find_entry(storage_region directory, const char* name,
+                         entry_type type, directory_entry* entry);
+int directory_add_entry(storage_region directory, const char* name,
+                        const directory_entry* entry);
+int directory_remove_entry(storage_region directory, const char* name,
+                           entry_type type);
+bool directory_is_empty(storage_region directory);
+
+// Drops the cached entries of a directory whose content region is being
+// freed, so that a directory that later gets the same region ID doesn't
+// find them
+void directory_forget_cached_entries(storage_region directory);
+
+// Points an existing entry to the regions of the given entry, which has the
+// same type, for when the regions of a file or directory have been moved.
+// The entry is found by the name in its old metadata region, so that region
+// must not be freed before the entry has been replaced
+int directory_replace_entry(storage_region directory, const char* name,
+                            const directory_entry* entry);
+
+// Lists up to max_entries entries ordered by name and then by type, starting
+// after the entry with the given name and type, or from the first entry if
+// the name is NULL. Passing the last listed entry continues the listing where
+// it ended. B-tree directories are read from the position of the given entry
+// onwards, while other formats are read and sorted whole on every call.
+// Returns the number of listed entries
+int directory_list_entries(storage_region directory, const char* after_name,
+                           entry_type after_type,
+                           directory_listing_entry* entries,
+                           size_t max_entries);
+
+#endif // VIRTUALDIRECTORY_H
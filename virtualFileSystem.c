@@ -1,19 +1,95 @@
+// Descriptors of the same file share one open file, which holds the regions
+// and the length of the file. Each open file has a reader-writer lock that
+// reads of the file hold for reading and writes hold for writing, so reads of
+// the same file run in parallel and reads of different files never wait for
+// each other. Descriptors themselves are not locked: like storage cursors,
+// each one is used by one thread at a time. Operations that change
+// directories hold the namespace lock for writing, and opening a file holds
+// it for reading, so a file can't be created twice or deleted while its
+// descriptor is being set up. Locks are always taken in the order namespace,
+// open file table, open file, storage transaction and metadata.
+//
+// Operations that change the metadata of the file system, like creating and
+// deleting files and directories and writing file lengths, run as storage
+// transactions, so with the storage journal enabled a crash never leaves them
+// half done.
+//
+// Descriptors are kept in chunks of DESCRIPTOR_CHUNK_SIZE that are allocated
+// as more files are opened and never freed, so opening a file doesn't
+// allocate a descriptor and its cursor is reused by the next file that gets
+// the same descriptor. Free descriptors are linked into a lock-free stack,
+// which opening pops from and closing pushes to. The head of the stack holds
+// a tag that changes on every push and pop, so a thread can't replace the head
+// based on a stale view of the stack. Open files are found by their metadata
+// region in a hash table, so neither opening nor closing goes through all
+// open descriptors.
+//
+// Compaction moves the blocks of files and directories while holding the
+// namespace lock for writing, one batch of directory entries at a time, and
+// the lock of an open file while the file's own blocks move. Descriptors
+// notice that the blocks under their cursor may have moved by the relocation
+// count of their open file, and move the cursor back to their position in the
+// content region before using it.
+
 #include "virtualFileSystem.h"
+#include "virtualDirectory.h"
+#include "virtualLock.h"
 #include "virtualStorage.h"
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <time.h>
 
-#define MAX_DESCRIPTORS 256
+#define DESCRIPTOR_CHUNK_SIZE 1024
+#define MAX_DESCRIPTOR_CHUNKS 1024
+#define MIN_OPEN_FILE_BUCKETS 64
+#define COMPACTION_PAGE_SIZE 32
 
-typedef struct virtual_file
+// The free descriptor stack packs the tag in the upper half of a word and the
+// descriptor on top of the stack, plus one, in the lower half
+#define NO_FREE_DESCRIPTOR 0
+#define FREE_STACK_TOP(head) ((uint32_t)(head))
+#define FREE_STACK_HEAD(head, top) \
+    ((((head) >> 32) + 1) << 32 | (uint32_t)(top))
+
+typedef struct open_file
 {
     storage_region content_region;
     storage_region metadata_region;
     size_t length;
+
+    // Set when the length has changed since it was written to the metadata,
+    // and the time it was last written
+    bool length_dirty;
+    time_t length_flush_time;
+
+    // Increased whenever blocks of the content region are moved or freed
+    // under descriptors that may have their cursor in them
+    size_t relocation_count;
+
+    // Guarded by the open file table lock
+    size_t descriptor_count;
+    struct open_file* next_in_bucket;
+
+    virtual_lock lock;
+} open_file;
+
+typedef struct virtual_file
+{
+    // NULL while the descriptor is free or being opened
+    open_file* file;
     size_t reader_position;
+
+    // Position of the file in its content region, and the relocation count
+    // of the file when the cursor was last moved to the position
+    storage_cursor* cursor;
+    size_t relocation_count;
+
+    // Descriptor below this one in the free descriptor stack, plus one
+    atomic_word next_free;
 } virtual_file;
 
 typedef struct directory_navigation_result
@@ -22,452 +98,447 @@ typedef struct directory_navigation_result
     storage_region directory_region;
 } directory_navigation_result;
 
-// More entry types could be added for e.g. shortcuts/symbolic links
-typedef enum { NULL_ENTRY = 0, UNUSED_ENTRY = 1,
-               FILE_ENTRY = 2, DIRECTORY_ENTRY = 3 } entry_type;
+// Progress of compact_virtual(). Directories are compacted in the order they
+// are found, and the paths of those still to do are kept in a queue
+typedef struct compaction_state
+{
+    virtual_compaction_options options;
+    virtual_compaction_report report;
 
-virtual_file* descriptors_[MAX_DESCRIPTORS] = { NULL };
-const storage_region root_directory_region_ = 0;
+    char** paths;
+    size_t first_path;
+    size_t path_count;
+    size_t path_capacity;
+
+    // Set when the block limit is reached with entries still to go
+    bool stopped;
+} compaction_state;
+
+virtual_file* descriptor_chunks_[MAX_DESCRIPTOR_CHUNKS] = { NULL };
+atomic_word descriptor_chunk_count_ = 0;
+atomic_word free_descriptors_ = NO_FREE_DESCRIPTOR;
 
-file_descriptor last_used_descriptor_ = -1;
+open_file** open_file_buckets_ = NULL;
+size_t open_file_bucket_count_ = 0;
+size_t open_file_count_ = 0;
 
-virtual_file find_virtual_file(const char* file_path);
-virtual_file create_virtual_file(const char* file_path);
-directory_navigation_result navigate_to_virtual_directory();
+const storage_region root_directory_region_ = 0;
+int length_flush_interval_ = -1;
+
+virtual_lock namespace_lock_ = VIRTUAL_LOCK_INITIALIZER;
+virtual_lock descriptor_chunks_lock_ = VIRTUAL_LOCK_INITIALIZER;
+virtual_lock open_files_lock_ = VIRTUAL_LOCK_INITIALIZER;
+virtual_lock initialization_lock_ = VIRTUAL_LOCK_INITIALIZER;
+
+// Metadata is read and written through a cursor of its own
+virtual_lock metadata_lock_ = VIRTUAL_LOCK_INITIALIZER;
+storage_cursor* metadata_cursor_ = NULL;
+
+void initialize_storage_if_needed();
+virtual_file* take_descriptor(file_descriptor* file_descriptor);
+void give_back_descriptor(file_descriptor file_descriptor);
+void push_free_descriptors(file_descriptor first, file_descriptor last);
+int add_descriptor_chunk();
+virtual_file* descriptor_at(file_descriptor file_descriptor);
+open_file* open_shared_file(const char* path, int flags,
+                            virtual_file* descriptor);
+open_file* attach_open_file(const open_file* found, virtual_file* descriptor);
+virtual_file* find_descriptor(file_descriptor file_descriptor);
+open_file* find_open_file(storage_region metadata_region);
+int insert_open_file(open_file* file);
+void remove_open_file(open_file* file);
+open_file** open_file_bucket(storage_region metadata_region);
+int create_virtual_directory(const char* directory_path);
+int delete_virtual_directory(const char* directory_path);
+int delete_virtual_file(const char* file_path);
+int list_virtual_directory(const char* directory_path,
+                           const virtual_directory_entry* after,
+                           virtual_directory_entry* entries, int max_entries);
+open_file find_virtual_file(const char* file_path);
+open_file create_virtual_file(const char* file_path);
+open_file found_file(storage_region content_region,
+                     storage_region metadata_region, size_t length);
+directory_navigation_result navigate_to_virtual_directory(const char* path);
+int read_virtual_metadata(storage_region metadata_region, void* bytes,
+                          size_t n_bytes);
+int write_virtual_metadata(storage_region metadata_region, void* bytes,
+                           size_t n_bytes);
 void update_virtual_file_metadata(
     storage_region metadata_region, size_t file_size);
-void invalidate_last_descriptor();
-void jump_to_file_if_needed(file_descriptor file_descriptor);
+void flush_virtual_file_length(open_file* file);
+void grow_virtual_file(open_file* file, size_t end_position);
+void follow_relocation(virtual_file* descriptor);
+int compact_virtual_directory(compaction_state* state, const char* path);
+void compact_virtual_entry(compaction_state* state,
+                           storage_region directory_region,
+                           const directory_listing_entry* listed);
+int queue_compaction_path(compaction_state* state, const char* path,
+                          const char* name);
+bool compaction_budget_left(const compaction_state* state);
 
 file_descriptor open_virtual(const char* path, int flags)
 {
-    if (!storage_initialized())
-    {
-        storage_initialize();
-    }
-
-    // Find an available descriptor to associate with this virtual file
-    file_descriptor first_available_descriptor = -1;
+    initialize_storage_if_needed();
 
-    for (file_descriptor i = 0; i < MAX_DESCRIPTORS; i++)
-    {
-        if (descriptors_[i] == NULL)
-        {
-            first_available_descriptor = i;
-            break;
-        }
-    }
+    // Take a free descriptor to associate with this virtual file
+    file_descriptor file_descriptor;
+    virtual_file* descriptor = take_descriptor(&file_descriptor);
 
-    if (first_available_descriptor == -1)
+    if (descriptor == NULL)
     {
         // No descriptors available
         return -1;
     }
 
-    invalidate_last_descriptor();
-
-    // Open or create the virtual file
-    virtual_file file = find_virtual_file(path);
-
-    // If virtual file failed to open
-    if (file.content_region == INVALID_REGION)
+    // Descriptors that have been used before still have their cursor
+    if (descriptor->cursor == NULL)
     {
-        if (!(flags & O_CREAT))
-        {
-            // New virtual file creation not allowed
-            return -1;
-        }
-
-        file = create_virtual_file(path);
+        descriptor->cursor = storage_create_cursor();
 
-        // If virtual file failed to be created
-        if (file.content_region == INVALID_REGION)
+        if (descriptor->cursor == NULL)
         {
+            give_back_descriptor(file_descriptor);
+
             return -1;
         }
     }
-    else if (flags & O_EXCL)
-    {
-        // Virtual file exists, but O_EXCL requires it to not exist beforehand
-        return -1;
-    }
 
-    descriptors_[first_available_descriptor] = malloc(sizeof(virtual_file));
-    *descriptors_[first_available_descriptor] = file;
+    descriptor->reader_position = 0;
 
-    if (flags & O_TRUNC)
+    // Open or create the virtual file
+    if (open_shared_file(path, flags, descriptor) == NULL)
     {
-        // Delete the existing contents of the virtual file
-        storage_free_region(file.content_region);
-        file.content_region = storage_allocate_region();
-
-        file.length = 0;
-    }
+        give_back_descriptor(file_descriptor);
 
-    if (flags & O_APPEND)
-    {
-        file.reader_position = file.length;
+        return -1;
     }
 
-    return first_available_descriptor;
+    return file_descriptor;
 }
 
 void close_virtual(file_descriptor file_descriptor)
 {
-    if (file_descriptor < 0 || file_descriptor >= MAX_DESCRIPTORS
-        || descriptors_[file_descriptor] == NULL)
+    virtual_file* descriptor = find_descriptor(file_descriptor);
+
+    if (descriptor == NULL)
     {
         return;
     }
 
-    free(descriptors_[file_descriptor]);
-    descriptors_[file_descriptor] = NULL;
-}
+    open_file* file = descriptor->file;
 
-int mkdir_virtual(const char* directory_path)
-{
-    invalidate_last_descriptor();
+    lock_for_writing(&file->lock);
+    flush_virtual_file_length(file);
+    unlock_for_writing(&file->lock);
 
-    directory_navigation_result navigation_result
-        = navigate_to_virtual_directory(directory_path);
+    // The open file is freed with its last descriptor. Until then, opening
+    // the same file finds it in the open file table and shares it. Deleting
+    // the file has already removed it from the table
+    lock_for_writing(&open_files_lock_);
 
-    if (navigation_result.directory_region == INVALID_REGION)
-    {
-        // Could not navigate to the directory where the new directory was to
-        // be created in
-        free(navigation_result.remainder_path);
+    bool last_descriptor = --file->descriptor_count == 0;
 
-        return -1;
+    if (last_descriptor && file->metadata_region != INVALID_REGION)
+    {
+        remove_open_file(file);
     }
 
-    // Allocate regions for the new virtual directory
-	storage_region content_region = storage_allocate_region();
-
-	if (content_region == INVALID_REGION)
-	{
-        free(navigation_result.remainder_path);
-
-		return -1;
-	}
-
-	storage_region metadata_region = storage_allocate_region();
-
-	if (metadata_region == INVALID_REGION)
-	{
-		storage_free_region(content_region);
-        free(navigation_result.remainder_path);
-
-		return -1;
-	}
+    unlock_for_writing(&open_files_lock_);
 
-    // Find the first available directory entry in the directory where the new
-    // directory was created in
-    storage_jump_to_region(navigation_result.directory_region);
-
-	while (true)
-	{
-		char entry_type;
-		storage_read_in_region(&entry_type, sizeof(char));
-
-		if (entry_type == NULL_ENTRY || entry_type == UNUSED_ENTRY)
-		{
-			break;
-		}
-
-		storage_seek_in_region(sizeof(storage_region) + sizeof(storage_region));
-	}
-
-	storage_seek_in_region(-sizeof(char));
-
-    // Write the data of the newly created directory to the directory entry
-	entry_type entry_type = DIRECTORY_ENTRY;
-
-	storage_write_in_region(&entry_type, sizeof(char));
-	storage_write_in_region(&metadata_region, sizeof(storage_region));
-	storage_write_in_region(&content_region, sizeof(storage_region));
-
-	storage_jump_to_region(metadata_region);
-
-    char remainder_path_length = strlen(navigation_result.remainder_path);
-    storage_write_in_region(&remainder_path_length, sizeof(char));
-    storage_write_in_region(navigation_result.remainder_path, remainder_path_length);
-
-    free(navigation_result.remainder_path);
+    if (last_descriptor)
+    {
+        lock_destroy(&file->lock);
+        free(file);
+    }
 
-	return 0;
+    give_back_descriptor(file_descriptor);
 }
 
-int rmdir_virtual(const char* directory_path)
+int fsync_virtual(file_descriptor file_descriptor)
 {
-    invalidate_last_descriptor();
-
-    directory_navigation_result navigation_result
-        = navigate_to_virtual_directory(directory_path);
+    virtual_file* descriptor = find_descriptor(file_descriptor);
 
-    if (navigation_result.directory_region == INVALID_REGION)
+    if (descriptor == NULL)
     {
-        // Could not navigate to the directory where the directory was to
-        // be deleted from
-        free(navigation_result.remainder_path);
-
         return -1;
     }
 
-    // Find the directory entry of the directory being deleted
-	while (true)
-	{
-		size_t entry_position = storage_seek_in_region(0);
-
-		entry_type entry_type = 0;
-		storage_read_in_region(&entry_type, sizeof(char));
-
-        // Null entry means end of directory
-		if (entry_type == NULL_ENTRY)
-		{
-			break;
-		}
+    lock_for_writing(&descriptor->file->lock);
+    flush_virtual_file_length(descriptor->file);
+    unlock_for_writing(&descriptor->file->lock);
 
-        // Skip past other entry types
-		if (entry_type != DIRECTORY_ENTRY)
-		{
-			storage_seek_in_region(sizeof(storage_region) * 2);
-
-			continue;
-		}
+    return storage_flush();
+}
 
-        // Read the entry data of a directory
-		storage_region metadata_region;
-		storage_read_in_region(&metadata_region, sizeof(storage_region));
+void set_length_flush_interval_virtual(int seconds)
+{
+    length_flush_interval_ = seconds;
+}
 
-		storage_region content_region;
-		storage_read_in_region(&content_region, sizeof(storage_region));
+int mkdir_virtual(const char* directory_path)
+{
+    lock_for_writing(&namespace_lock_);
 
-		size_t next_entry_position = storage_seek_in_region(0);
+    int result = create_virtual_directory(directory_path);
 
-		storage_jump_to_region(metadata_region);
+    unlock_for_writing(&namespace_lock_);
 
-		char directory_name_length;
-		storage_read_in_region(&directory_name_length, sizeof(char));
+    return result;
+}
 
-		char* directory_name = malloc(directory_name_length + 1);
-		storage_read_in_region(directory_name, directory_name_length);
-		directory_name[directory_name_length] = '\0';
+int rmdir_virtual(const char* directory_path)
+{
+    lock_for_writing(&namespace_lock_);
 
-        // Compare directory names to see if this is the directory we want to
-        // delete
-        if (strcmp(directory_name, navigation_result.remainder_path) == 0)
-		{
-			free(directory_name);
-            free(navigation_result.remainder_path);
+    int result = delete_virtual_directory(directory_path);
 
-			storage_jump_to_region(content_region);
+    unlock_for_writing(&namespace_lock_);
 
-            // Go through the directory entries of the directory being deleted
-			while (true)
-			{
-				entry_type = 0;
-				storage_read_in_region(&entry_type, sizeof(char));
+    return result;
+}
 
-				if (entry_type == NULL_ENTRY)
-				{
-					break;
-				}
+int unlink_virtual(const char* file_path)
+{
+    lock_for_writing(&namespace_lock_);
 
-				if (entry_type == UNUSED_ENTRY)
-				{
-					storage_seek_in_region(sizeof(storage_region) * 2);
+    int result = delete_virtual_file(file_path);
 
-					continue;
-				}
+    unlock_for_writing(&namespace_lock_);
 
-                // This directory contains files or other directories: it can't
-                // be deleted before deleting those first
-				return -1;
-			}
+    return result;
+}
 
-			entry_type = UNUSED_ENTRY;
+int readdir_virtual(const char* directory_path,
+                    const virtual_directory_entry* after,
+                    virtual_directory_entry* entries, int max_entries)
+{
+    lock_for_reading(&namespace_lock_);
 
-			// Mark the table of contents entry as unused
-            storage_jump_to_region(root_directory_region_);
-			storage_seek_in_region(entry_position);
-			storage_write_in_region(&entry_type, sizeof(char));
+    int result = list_virtual_directory(directory_path, after, entries,
+                                        max_entries);
 
-            // Delete the regions used by this directory
-			storage_free_region(content_region);
-			storage_free_region(metadata_region);
+    unlock_for_reading(&namespace_lock_);
 
-			return 0;
-		}
+    return result;
+}
 
-		free(directory_name);
+ssize_t read_virtual(file_descriptor file_descriptor, void* buffer, size_t n_bytes)
+{
+    struct iovec part = { buffer, n_bytes };
 
-        storage_jump_to_region(navigation_result.directory_region);
-		storage_seek_in_region(next_entry_position);
-	}
+    return readv_virtual(file_descriptor, &part, 1);
+}
 
-    // No directory entry found: directory to be deleted does not exist
-    free(navigation_result.remainder_path);
+ssize_t write_virtual(file_descriptor file_descriptor, void* buffer, size_t n_bytes)
+{
+    struct iovec part = { buffer, n_bytes };
 
-    return -1;
+    return writev_virtual(file_descriptor, &part, 1);
 }
 
-int unlink_virtual(const char* file_path)
+ssize_t readv_virtual(file_descriptor file_descriptor,
+                      const struct iovec* parts, int part_count)
 {
-    invalidate_last_descriptor();
-
-    directory_navigation_result navigation_result
-        = navigate_to_virtual_directory(file_path);
+    virtual_file* descriptor = part_count > 0
+        ? find_descriptor(file_descriptor) : NULL;
 
-    if (navigation_result.directory_region == INVALID_REGION)
+    if (descriptor == NULL)
     {
-        // Could not navigate to the directory where the file was to be deleted
-        // from
-        free(navigation_result.remainder_path);
-
-        return -1;
+        return 0;
     }
 
-    // Find the directory entry of the file being deleted
-    while (true)
+    open_file* file = descriptor->file;
+    lock_for_reading(&file->lock);
+    follow_relocation(descriptor);
+
+    size_t bytes_available = file->length - descriptor->reader_position;
+    size_t bytes_to_read = 0;
+    int parts_to_read = 0;
+
+    // If the virtual file is too small to contain all the bytes requested,
+    // only read the parts that fit, and the part where the file ends up to
+    // the end of the file
+    while (parts_to_read < part_count && bytes_to_read < bytes_available)
     {
-        size_t entry_position = storage_seek_in_region(0);
+        bytes_to_read += parts[parts_to_read].iov_len;
+        parts_to_read++;
+    }
 
-        entry_type entry_type = 0;
-        storage_read_in_region(&entry_type, sizeof(char));
+    ssize_t read_bytes = 0;
+
+    if (bytes_to_read > bytes_available)
+    {
+        struct iovec* clamped_parts =
+            malloc(parts_to_read * sizeof(struct iovec));
 
-        // Null entry means end of directory
-        if (entry_type == NULL_ENTRY)
+        if (clamped_parts == NULL)
         {
-            break;
+            read_bytes = -1;
         }
-
-        // Skip past other entry types
-        if (entry_type != FILE_ENTRY)
+        else
         {
-            storage_seek_in_region(sizeof(storage_region) * 2);
+            memcpy(clamped_parts, parts, parts_to_read * sizeof(struct iovec));
+            clamped_parts[parts_to_read - 1].iov_len -=
+                bytes_to_read - bytes_available;
 
-            continue;
+            read_bytes = storage_cursor_readv(descriptor->cursor,
+                                              clamped_parts, parts_to_read);
+
+            free(clamped_parts);
         }
+    }
+    else if (parts_to_read > 0)
+    {
+        read_bytes = storage_cursor_readv(descriptor->cursor, parts,
+                                          parts_to_read);
+    }
 
-        // Read the entry data of a file
-        storage_region metadata_region;
-        storage_read_in_region(&metadata_region, sizeof(storage_region));
+    unlock_for_reading(&file->lock);
 
-        storage_region content_region;
-        storage_read_in_region(&content_region, sizeof(storage_region));
+    if (read_bytes > 0)
+    {
+        descriptor->reader_position += read_bytes;
+    }
 
-        size_t next_entry_position = storage_seek_in_region(0);
+    return read_bytes;
+}
 
-        storage_jump_to_region(metadata_region);
+ssize_t writev_virtual(file_descriptor file_descriptor,
+                       const struct iovec* parts, int part_count)
+{
+    virtual_file* descriptor = part_count > 0
+        ? find_descriptor(file_descriptor) : NULL;
 
-        size_t file_length;
-        storage_read_in_region(&file_length, sizeof(size_t));
+    if (descriptor == NULL)
+    {
+        return 0;
+    }
 
-        char file_name_length;
-        storage_read_in_region(&file_name_length, sizeof(char));
+    open_file* file = descriptor->file;
+    lock_for_writing(&file->lock);
+    follow_relocation(descriptor);
 
-        char* file_name = malloc(file_name_length + 1);
-        storage_read_in_region(file_name, file_name_length);
-        file_name[file_name_length] = '\0';
+    // All parts are written with a single pass through the file's blocks
+    size_t written_bytes =
+        storage_cursor_writev(descriptor->cursor, parts, part_count);
 
-        // Compare file names to see if this is the file we want to delete
-        if (strcmp(file_name, navigation_result.remainder_path) == 0)
-        {
-            free(file_name);
-            free(navigation_result.remainder_path);
+    descriptor->reader_position += written_bytes;
 
-            // Mark the table of contents entry as unused
-			entry_type = UNUSED_ENTRY;
+    grow_virtual_file(file, descriptor->reader_position);
 
-            storage_jump_to_region(navigation_result.directory_region);
-            storage_seek_in_region(entry_position);
-            storage_write_in_region(&entry_type, sizeof(char));
+    unlock_for_writing(&file->lock);
 
-            // Delete the regions used by this file
-            storage_free_region(content_region);
-            storage_free_region(metadata_region);
+    return written_bytes;
+}
 
-            return 0;
-        }
+ssize_t pread_virtual(file_descriptor file_descriptor, void* buffer,
+                      size_t n_bytes, off_t offset)
+{
+    virtual_file* descriptor = offset >= 0
+        ? find_descriptor(file_descriptor) : NULL;
 
-        free(file_name);
-		
-        storage_jump_to_region(navigation_result.directory_region);
-        storage_seek_in_region(next_entry_position);
+    if (descriptor == NULL)
+    {
+        return -1;
     }
 
-    // No directory entry found: file to be deleted does not exist
-    free(navigation_result.remainder_path);
-
-    return -1;
-}
+    // Reads made during a storage batch are only made when the batch ends,
+    // so the batch keeps the file locked until then, and the file's blocks
+    // can't be freed or moved under them. A file whose lock the batch already
+    // keeps isn't locked again. Waiting for the lock while the batch keeps
+    // the locks of other files could deadlock with a writer of one of them,
+    // so if the lock isn't free the batch is issued first
+    open_file* file = descriptor->file;
+    bool kept_by_batch = storage_batch_holds_lock(&file->lock);
 
-ssize_t read_virtual(file_descriptor file_descriptor, void* buffer, size_t n_bytes)
-{
-    if (file_descriptor < 0 || file_descriptor >= MAX_DESCRIPTORS
-        || descriptors_[file_descriptor] == NULL)
+    if (!kept_by_batch && !try_lock_for_reading(&file->lock))
     {
-        return 0;
+        storage_issue_batch();
+        lock_for_reading(&file->lock);
     }
 
-    jump_to_file_if_needed(file_descriptor);
+    follow_relocation(descriptor);
 
-    size_t bytes_to_read = n_bytes;
+    size_t read_bytes = 0;
 
-    // If the virtual file is too small to contain all the bytes requested,
-    // clamp the byte count to the amount of bytes available
-    if (descriptors_[file_descriptor]->reader_position + bytes_to_read
-        > descriptors_[file_descriptor]->length)
+    if ((size_t)offset < file->length)
     {
-        bytes_to_read = descriptors_[file_descriptor]->length
-            - descriptors_[file_descriptor]->reader_position;
-    }
+        if (n_bytes > file->length - offset)
+        {
+            n_bytes = file->length - offset;
+        }
 
-    storage_read_in_region(buffer, bytes_to_read);
+        // The descriptor's cursor maps the file's blocks, so moving it to the
+        // offset and back takes constant time
+        storage_cursor_seek(descriptor->cursor,
+                            offset - (off_t)descriptor->reader_position);
+        read_bytes = storage_cursor_read(descriptor->cursor, buffer, n_bytes);
+        storage_cursor_seek(descriptor->cursor,
+                            (off_t)descriptor->reader_position
+                            - (offset + (off_t)read_bytes));
+    }
 
-    descriptors_[file_descriptor]->reader_position += bytes_to_read;
+    if (!kept_by_batch && !storage_batch_keep_lock(&file->lock))
+    {
+        unlock_for_reading(&file->lock);
+    }
 
-    return bytes_to_read;
+    return read_bytes;
 }
 
-ssize_t write_virtual(file_descriptor file_descriptor, void* buffer, size_t n_bytes)
+ssize_t pwrite_virtual(file_descriptor file_descriptor, void* buffer,
+                       size_t n_bytes, off_t offset)
 {
-    if (file_descriptor < 0 || file_descriptor >= MAX_DESCRIPTORS
-        || descriptors_[file_descriptor] == NULL)
+    virtual_file* descriptor = offset >= 0
+        ? find_descriptor(file_descriptor) : NULL;
+
+    if (descriptor == NULL)
     {
-        return 0;
+        return -1;
     }
 
-    jump_to_file_if_needed(file_descriptor);
-    storage_write_in_region(buffer, n_bytes);
+    open_file* file = descriptor->file;
+    lock_for_writing(&file->lock);
+    follow_relocation(descriptor);
 
-    descriptors_[file_descriptor]->reader_position += n_bytes;
+    ssize_t written_bytes = -1;
 
-    // Update file length if the write operation wrote past the file's
-    // previous length
-    if (descriptors_[file_descriptor]->reader_position >=
-        descriptors_[file_descriptor]->length)
+    // Writing past the end of the file would leave a gap in it
+    if ((size_t)offset <= file->length)
     {
-        descriptors_[file_descriptor]->length =
-                descriptors_[file_descriptor]->reader_position + 1;
-
-        update_virtual_file_metadata(
-            descriptors_[file_descriptor]->metadata_region,
-            descriptors_[file_descriptor]->length);
+        storage_cursor_seek(descriptor->cursor,
+                            offset - (off_t)descriptor->reader_position);
+        written_bytes =
+            storage_cursor_write(descriptor->cursor, buffer, n_bytes);
+        storage_cursor_seek(descriptor->cursor,
+                            (off_t)descriptor->reader_position
+                            - (offset + (off_t)written_bytes));
+
+        grow_virtual_file(file, offset + written_bytes);
     }
 
-    return n_bytes;
+    unlock_for_writing(&file->lock);
+
+    return written_bytes;
 }
 
 off_t seek_virtual(file_descriptor file_descriptor, off_t offset, int whence)
 {
-    if (file_descriptor < 0 || file_descriptor >= MAX_DESCRIPTORS
-        || descriptors_[file_descriptor] == NULL)
+    virtual_file* descriptor = find_descriptor(file_descriptor);
+
+    if (descriptor == NULL)
     {
         return -1;
     }
 
-    off_t new_position = descriptors_[file_descriptor]->reader_position;
+    // The cursor is moved under the lock, so that the blocks it moves through
+    // aren't relocated at the same time
+    open_file* file = descriptor->file;
+    lock_for_reading(&file->lock);
+    follow_relocation(descriptor);
+
+    off_t length = file->length;
+    off_t new_position = descriptor->reader_position;
 
     switch (whence)
     {
@@ -479,19 +550,19 @@ off_t seek_virtual(file_descriptor file_descriptor, off_t offset, int whence)
 
     case SEEK_CUR:
     {
-        new_position = descriptors_[file_descriptor]->reader_position + offset;
+        new_position = descriptor->reader_position + offset;
         break;
     }
 
     case SEEK_END:
     {
-        new_position = descriptors_[file_descriptor]->length + offset;
+        new_position = length + offset;
         break;
     }
 
     default:
     {
-        return descriptors_[file_descriptor]->reader_position;
+        break;
     }
     }
 
@@ -500,253 +571,849 @@ off_t seek_virtual(file_descriptor file_descriptor, off_t offset, int whence)
     {
         new_position = 0;
     }
-    else if (new_position > descriptors_[file_descriptor]->length)
+    else if (new_position > length)
     {
-        new_position = descriptors_[file_descriptor]->length;
+        new_position = length;
     }
 
-    descriptors_[file_descriptor]->reader_position = new_position;
+    storage_cursor_seek(descriptor->cursor,
+        new_position - (off_t)descriptor->reader_position);
+
+    descriptor->reader_position = new_position;
+
+    unlock_for_reading(&file->lock);
 
-    return descriptors_[file_descriptor]->reader_position;
+    return new_position;
 }
 
-virtual_file find_virtual_file(const char* file_path)
+int compact_virtual(const virtual_compaction_options* options,
+                    virtual_compaction_report* report)
 {
-    directory_navigation_result navigation_result
-        = navigate_to_virtual_directory(file_path);
+    initialize_storage_if_needed();
 
-    if (navigation_result.directory_region == INVALID_REGION)
-    {
-        // Could not navigate to the directory where the file was expected to
-        // be
-        free(navigation_result.remainder_path);
+    compaction_state state = { 0 };
 
-        return (virtual_file) { INVALID_REGION, INVALID_REGION, 0, 0 };
+    if (options != NULL)
+    {
+        state.options = *options;
     }
 
-    // Find the directory entry of the file
-    while (true)
-    {
-        entry_type entry_type = 0;
-        storage_read_in_region(&entry_type, sizeof(char));
+    state.report.fragmentation_before = storage_fragmentation();
 
-        // Null entry means end of directory
-        if (entry_type == NULL_ENTRY)
-        {
-            break;
-        }
+    int result = storage_initialized() ? 0 : -1;
 
-        // Skip past other entry types
-        if (entry_type != FILE_ENTRY)
-        {
-            storage_seek_in_region(sizeof(storage_region) * 2);
+    if (result == 0)
+    {
+        // The root directory is found by the ID of its content region, so
+        // only the blocks after its first one can move
+        size_t moved_blocks = 0;
 
-            continue;
-        }
+        lock_for_writing(&namespace_lock_);
+        storage_begin_transaction();
+        storage_relocate_region(root_directory_region_, true, &moved_blocks);
+        storage_end_transaction();
+        unlock_for_writing(&namespace_lock_);
+
+        state.report.moved_regions += moved_blocks > 0;
+        state.report.moved_blocks += moved_blocks;
 
-        // Read the entry data of a file
-        storage_region metadata_region;
-        storage_read_in_region(&metadata_region, sizeof(storage_region));
+        result = queue_compaction_path(&state, "", NULL);
+    }
 
-        storage_region content_region;
-        storage_read_in_region(&content_region, sizeof(storage_region));
+    while (result == 0 && state.first_path < state.path_count
+           && !state.stopped)
+    {
+        char* path = state.paths[state.first_path++];
 
-        size_t next_entry_position = storage_seek_in_region(0);
+        result = compact_virtual_directory(&state, path);
 
-        storage_jump_to_region(metadata_region);
+        free(path);
+    }
 
-        size_t file_length;
-        storage_read_in_region(&file_length, sizeof(size_t));
+    state.report.finished = result == 0
+        && state.first_path == state.path_count && !state.stopped;
+    state.report.fragmentation_after = storage_fragmentation();
 
-        char file_name_length;
-        storage_read_in_region(&file_name_length, sizeof(char));
+    while (state.first_path < state.path_count)
+    {
+        free(state.paths[state.first_path++]);
+    }
 
-        char* file_name = malloc(file_name_length + 1);
-        storage_read_in_region(file_name, file_name_length);
-        file_name[file_name_length] = '\0';
+    free(state.paths);
 
-        // Compare file names to see if this is the file we are looking for
-        if (strcmp(file_name, navigation_result.remainder_path) == 0)
-        {
-            free(file_name);
-            free(navigation_result.remainder_path);
+    if (report != NULL)
+    {
+        *report = state.report;
+    }
 
-            return (virtual_file)
-                { content_region, metadata_region, file_length, 0 };
-        }
+    return result;
+}
 
-        free(file_name);
+void initialize_storage_if_needed()
+{
+    lock_for_reading(&initialization_lock_);
+    bool initialized = storage_initialized();
+    unlock_for_reading(&initialization_lock_);
 
-        storage_jump_to_region(navigation_result.directory_region);
-        storage_seek_in_region(next_entry_position);
-    }
+    if (!initialized)
+    {
+        lock_for_writing(&initialization_lock_);
 
-    // No directory entry found: file does not exist
-    free(navigation_result.remainder_path);
+        if (!storage_initialized())
+        {
+            storage_initialize();
+        }
 
-    return (virtual_file) { INVALID_REGION, INVALID_REGION, 0, 0 };
+        unlock_for_writing(&initialization_lock_);
+    }
 }
 
-virtual_file create_virtual_file(const char* file_path)
+virtual_file* take_descriptor(file_descriptor* file_descriptor)
 {
-    directory_navigation_result navigation_result
-        = navigate_to_virtual_directory(file_path);
+    uint64_t head = atomic_word_load(&free_descriptors_);
 
-    if (navigation_result.directory_region == INVALID_REGION)
+    while (true)
     {
-        // Could not navigate to the directory where the file was going to be
-        // created in
-        free(navigation_result.remainder_path);
+        uint32_t top = FREE_STACK_TOP(head);
 
-        return (virtual_file) { INVALID_REGION, INVALID_REGION, 0, 0 };
-    }
+        if (top == NO_FREE_DESCRIPTOR)
+        {
+            // All descriptors are in use: add a chunk of free descriptors
+            if (add_descriptor_chunk() == -1)
+            {
+                return NULL;
+            }
 
-    // Allocate regions for the new virtual file
-	storage_region content_region = storage_allocate_region();
+            head = atomic_word_load(&free_descriptors_);
 
-	if (content_region == INVALID_REGION)
-	{
-        free(navigation_result.remainder_path);
+            continue;
+        }
+
+        // Descriptors are never freed, so the next link can be read even if
+        // another thread has popped the descriptor in the meantime, in which
+        // case the tag has changed and swapping the head fails
+        virtual_file* descriptor = descriptor_at(top - 1);
+        uint64_t next = atomic_word_load(&descriptor->next_free);
 
-		return (virtual_file) { INVALID_REGION, INVALID_REGION, 0, 0 };
-	}
+        if (atomic_word_compare_swap(&free_descriptors_, &head,
+                                     FREE_STACK_HEAD(head, next)))
+        {
+            *file_descriptor = top - 1;
 
-	storage_region metadata_region = storage_allocate_region();
+            return descriptor;
+        }
+    }
+}
 
-	if (metadata_region == INVALID_REGION)
-	{
-        free(navigation_result.remainder_path);
-		storage_free_region(content_region);
+void give_back_descriptor(file_descriptor file_descriptor)
+{
+    descriptor_at(file_descriptor)->file = NULL;
 
-		return (virtual_file) { INVALID_REGION, INVALID_REGION, 0, 0 };
-	}
+    push_free_descriptors(file_descriptor, file_descriptor);
+}
 
-    // Write a directory entry for the new file
-    storage_jump_to_region(navigation_result.directory_region);
+void push_free_descriptors(file_descriptor first, file_descriptor last)
+{
+    // The descriptors from first to last are already linked to each other,
+    // so the whole chain is pushed with one swap
+    virtual_file* last_descriptor = descriptor_at(last);
+    uint64_t head = atomic_word_load(&free_descriptors_);
 
-    // Find the first available directory entry in the directory where the new
-    // file was created in
-    while (true)
+    do
     {
-        char entry_type;
-        storage_read_in_region(&entry_type, sizeof(char));
+        atomic_word_store(&last_descriptor->next_free, FREE_STACK_TOP(head));
+    } while (!atomic_word_compare_swap(&free_descriptors_, &head,
+                                       FREE_STACK_HEAD(head, first + 1)));
+}
 
-        if (entry_type == NULL_ENTRY || entry_type == UNUSED_ENTRY)
-        {
-            break;
-        }
+int add_descriptor_chunk()
+{
+    lock_for_writing(&descriptor_chunks_lock_);
 
-        storage_seek_in_region(sizeof(storage_region) + sizeof(storage_region));
-    }
+    // Another thread may have added a chunk while this one waited for the
+    // lock, or closed a descriptor
+    uint64_t chunk_count = atomic_word_load(&descriptor_chunk_count_);
+    int result = 0;
+
+    if (FREE_STACK_TOP(atomic_word_load(&free_descriptors_))
+        == NO_FREE_DESCRIPTOR)
+    {
+        virtual_file* chunk = chunk_count < MAX_DESCRIPTOR_CHUNKS
+            ? calloc(DESCRIPTOR_CHUNK_SIZE, sizeof(virtual_file)) : NULL;
 
-    storage_seek_in_region(-sizeof(char));
+        if (chunk == NULL)
+        {
+            result = -1;
+        }
+        else
+        {
+            file_descriptor first = chunk_count * DESCRIPTOR_CHUNK_SIZE;
 
-    // Write the data of the newly created file to the directory entry
-	entry_type entry_type = FILE_ENTRY;
+            // Link the descriptors of the chunk so that the lowest one ends
+            // up on top of the stack
+            for (int i = 0; i < DESCRIPTOR_CHUNK_SIZE - 1; i++)
+            {
+                atomic_word_store(&chunk[i].next_free, first + i + 2);
+            }
 
-    storage_write_in_region(&entry_type, sizeof(char));
-    storage_write_in_region(&metadata_region, sizeof(storage_region));
-    storage_write_in_region(&content_region, sizeof(storage_region));
+            // The chunk is published before its descriptors can be popped
+            descriptor_chunks_[chunk_count] = chunk;
+            atomic_word_store(&descriptor_chunk_count_, chunk_count + 1);
 
-    storage_jump_to_region(metadata_region);
+            push_free_descriptors(first, first + DESCRIPTOR_CHUNK_SIZE - 1);
+        }
+    }
 
-    size_t file_length = 0;
-    char remainder_path_length = strlen(navigation_result.remainder_path);
-    storage_write_in_region(&file_length, sizeof(size_t));
-    storage_write_in_region(&remainder_path_length, sizeof(char));
-    storage_write_in_region(navigation_result.remainder_path, remainder_path_length);
+    unlock_for_writing(&descriptor_chunks_lock_);
 
-    free(navigation_result.remainder_path);
+    return result;
+}
 
-    return (virtual_file) { content_region, metadata_region, file_length, 0 };
+virtual_file* descriptor_at(file_descriptor file_descriptor)
+{
+    return &descriptor_chunks_[file_descriptor / DESCRIPTOR_CHUNK_SIZE]
+                              [file_descriptor % DESCRIPTOR_CHUNK_SIZE];
 }
 
-directory_navigation_result navigate_to_virtual_directory(char* path)
+open_file* open_shared_file(const char* path, int flags,
+                            virtual_file* descriptor)
 {
-    if (!storage_initialized())
+    // Creating a file changes its directory, so it can't be done while other
+    // threads are looking up files
+    bool may_create = flags & O_CREAT;
+
+    if (may_create)
     {
-        storage_initialize();
+        lock_for_writing(&namespace_lock_);
+    }
+    else
+    {
+        lock_for_reading(&namespace_lock_);
     }
 
-    storage_region directory_region = root_directory_region_;
-    int last_slash_position = -1;
+    open_file found = find_virtual_file(path);
+    open_file* file = NULL;
 
-    storage_jump_to_region(directory_region);
+    // If virtual file failed to open
+    if (found.content_region == INVALID_REGION)
+    {
+        // New virtual file creation may not be allowed
+        if (may_create)
+        {
+            found = create_virtual_file(path);
+        }
+    }
+    else if (flags & O_EXCL)
+    {
+        // Virtual file exists, but O_EXCL requires it to not exist beforehand
+        found.content_region = INVALID_REGION;
+    }
 
-    for (int i = 0; i < strlen(path); i++)
+    if (found.content_region != INVALID_REGION)
     {
-        // Split the path according to forward slashes and try to find each
-        // directory in the path starting from the root directory
-        if (path[i] == '/')
+        file = attach_open_file(&found, descriptor);
+    }
+
+    if (file != NULL)
+    {
+        lock_for_writing(&file->lock);
+
+        if (flags & O_TRUNC)
         {
-            // Get the name of the next directory that needs to be found
-            int directory_name_length = (i - 1) - last_slash_position;
-            char* directory_name = malloc(directory_name_length + 1);
-            memcpy(directory_name, path + last_slash_position + 1,
-                directory_name_length);
-            directory_name[directory_name_length] = '\0';
+            // Delete the existing contents of the virtual file. The content
+            // region keeps its ID, which the directory entry refers to, but
+            // other descriptors may have their cursor in the freed blocks
+            storage_begin_transaction();
+            storage_truncate_region(file->content_region);
+            storage_end_transaction();
+
+            file->length = 0;
+            file->length_dirty = true;
+            file->relocation_count++;
+        }
+
+        if (flags & O_APPEND)
+        {
+            descriptor->reader_position = file->length;
+        }
+
+        storage_cursor_jump_to_region(descriptor->cursor,
+                                      file->content_region);
+        storage_cursor_seek(descriptor->cursor, descriptor->reader_position);
+        descriptor->relocation_count = file->relocation_count;
+
+        unlock_for_writing(&file->lock);
+    }
+
+    if (may_create)
+    {
+        unlock_for_writing(&namespace_lock_);
+    }
+    else
+    {
+        unlock_for_reading(&namespace_lock_);
+    }
+
+    return file;
+}
+
+open_file* attach_open_file(const open_file* found, virtual_file* descriptor)
+{
+    lock_for_writing(&open_files_lock_);
+
+    // Another descriptor of the same file may have grown it without writing
+    // the length to the metadata yet, so its open file is shared
+    open_file* file = find_open_file(found->metadata_region);
+
+    if (file == NULL)
+    {
+        file = malloc(sizeof(open_file));
+
+        if (file != NULL)
+        {
+            *file = *found;
+            file->length_flush_time = time(NULL);
+            file->relocation_count = 0;
+            file->descriptor_count = 0;
+            lock_initialize(&file->lock);
 
-            // Go through the entries of the current directory
-            while (true)
+            if (insert_open_file(file) == -1)
             {
-                entry_type entry_type = 0;
-                storage_read_in_region(&entry_type, sizeof(char));
+                lock_destroy(&file->lock);
+                free(file);
+                file = NULL;
+            }
+        }
+    }
 
-                if (entry_type == NULL_ENTRY)
-                {
-                    // Null entry means end of directory: next directory to go
-                    // into did not exist
-                    return (directory_navigation_result) { NULL, INVALID_REGION };
-                }
+    if (file != NULL)
+    {
+        file->descriptor_count++;
+        descriptor->file = file;
+    }
+
+    unlock_for_writing(&open_files_lock_);
+
+    return file;
+}
+
+virtual_file* find_descriptor(file_descriptor file_descriptor)
+{
+    // A descriptor is only used by one thread at a time, so it can be looked
+    // up without holding a lock. A descriptor without an open file is free
+    // or still being opened
+    if (file_descriptor < 0
+        || (uint64_t)file_descriptor / DESCRIPTOR_CHUNK_SIZE
+           >= atomic_word_load(&descriptor_chunk_count_))
+    {
+        return NULL;
+    }
 
-                // Skip over other entries
-                if (entry_type != DIRECTORY_ENTRY)
+    virtual_file* descriptor = descriptor_at(file_descriptor);
+
+    return descriptor->file != NULL ? descriptor : NULL;
+}
+
+open_file* find_open_file(storage_region metadata_region)
+{
+    if (open_file_buckets_ == NULL)
+    {
+        return NULL;
+    }
+
+    open_file* file = *open_file_bucket(metadata_region);
+
+    while (file != NULL && file->metadata_region != metadata_region)
+    {
+        file = file->next_in_bucket;
+    }
+
+    return file;
+}
+
+int insert_open_file(open_file* file)
+{
+    // The table is doubled when it has more open files than buckets. If a
+    // larger table can't be allocated, the chains just get longer
+    if (open_file_count_ >= open_file_bucket_count_)
+    {
+        size_t bucket_count = open_file_bucket_count_ > 0
+            ? open_file_bucket_count_ * 2 : MIN_OPEN_FILE_BUCKETS;
+        open_file** buckets = calloc(bucket_count, sizeof(open_file*));
+
+        if (buckets == NULL && open_file_buckets_ == NULL)
+        {
+            return -1;
+        }
+
+        if (buckets != NULL)
+        {
+            open_file** old_buckets = open_file_buckets_;
+            size_t old_bucket_count = open_file_bucket_count_;
+
+            open_file_buckets_ = buckets;
+            open_file_bucket_count_ = bucket_count;
+
+            for (size_t i = 0; i < old_bucket_count; i++)
+            {
+                while (old_buckets[i] != NULL)
                 {
-                    storage_seek_in_region(sizeof(storage_region) * 2);
+                    open_file* moved = old_buckets[i];
+                    open_file** bucket =
+                        open_file_bucket(moved->metadata_region);
 
-                    continue;
+                    old_buckets[i] = moved->next_in_bucket;
+                    moved->next_in_bucket = *bucket;
+                    *bucket = moved;
                 }
+            }
 
-                // Read the entry data of a virtual directory
-                storage_region metadata_region;
-                storage_read_in_region(&metadata_region, sizeof(storage_region));
+            free(old_buckets);
+        }
+    }
 
-                storage_region content_region;
-                storage_read_in_region(&content_region, sizeof(storage_region));
+    open_file** bucket = open_file_bucket(file->metadata_region);
 
-                size_t next_entry_position = storage_seek_in_region(0);
+    file->next_in_bucket = *bucket;
+    *bucket = file;
+    open_file_count_++;
 
-                storage_jump_to_region(metadata_region);
+    return 0;
+}
 
-                char entry_name_length;
-                storage_read_in_region(&entry_name_length, sizeof(char));
+void remove_open_file(open_file* file)
+{
+    open_file** link = open_file_bucket(file->metadata_region);
 
-                char* entry_name = malloc(entry_name_length + 1);
-                storage_read_in_region(entry_name, entry_name_length);
-                entry_name[entry_name_length] = '\0';
+    while (*link != file)
+    {
+        link = &(*link)->next_in_bucket;
+    }
 
-                // Compare directory names to see if this is the directory we
-                // are looking for
-                if (strcmp(entry_name, directory_name) == 0)
-                {
-                    free(entry_name);
+    *link = file->next_in_bucket;
+    open_file_count_--;
+}
 
-                    // Directory found: jump into it and look for the next
-                    // directory in the path
-                    directory_region = content_region;
-                    storage_jump_to_region(directory_region);
+open_file** open_file_bucket(storage_region metadata_region)
+{
+    // Multiplicative hashing, taking the well mixed upper bits of the product
+    uint64_t hash = (uint64_t)metadata_region * 0x9E3779B97F4A7C15u;
 
-                    break;
-                }
+    return &open_file_buckets_[(hash >> 32) & (open_file_bucket_count_ - 1)];
+}
 
-                free(entry_name);
+int create_virtual_directory(const char* directory_path)
+{
+    directory_navigation_result navigation_result
+        = navigate_to_virtual_directory(directory_path);
 
-                storage_jump_to_region(directory_region);
-                storage_seek_in_region(next_entry_position);
-            }
+    if (navigation_result.directory_region == INVALID_REGION)
+    {
+        // Could not navigate to the directory where the new directory was to
+        // be created in
+        free(navigation_result.remainder_path);
+
+        return -1;
+    }
+
+    storage_begin_transaction();
+
+    // Allocate regions for the new virtual directory
+    storage_region content_region = storage_allocate_region();
+
+    if (content_region == INVALID_REGION)
+    {
+        storage_end_transaction();
+        free(navigation_result.remainder_path);
+
+        return -1;
+    }
+
+    storage_region metadata_region = storage_allocate_region();
+
+    if (metadata_region == INVALID_REGION)
+    {
+        storage_free_region(content_region);
+        storage_end_transaction();
+        free(navigation_result.remainder_path);
+
+        return -1;
+    }
+
+    // Write the name of the new directory to its metadata and an empty
+    // directory to its content
+    char metadata[1 + UCHAR_MAX];
+    unsigned char remainder_path_length = strlen(navigation_result.remainder_path);
+    metadata[0] = remainder_path_length;
+    memcpy(metadata + 1, navigation_result.remainder_path,
+           remainder_path_length);
+
+    write_virtual_metadata(metadata_region, metadata,
+                           1 + remainder_path_length);
+
+    // Add an entry for the new directory to the directory it was created in
+    directory_entry entry = { DIRECTORY_ENTRY, metadata_region, content_region };
+
+    if (directory_initialize(content_region) == -1
+        || directory_add_entry(navigation_result.directory_region,
+                               navigation_result.remainder_path, &entry) == -1)
+    {
+        storage_free_region(content_region);
+        storage_free_region(metadata_region);
+        storage_end_transaction();
+        free(navigation_result.remainder_path);
+
+        return -1;
+    }
+
+    storage_end_transaction();
+    free(navigation_result.remainder_path);
+
+    return 0;
+}
+
+int delete_virtual_directory(const char* directory_path)
+{
+    directory_navigation_result navigation_result
+        = navigate_to_virtual_directory(directory_path);
+
+    if (navigation_result.directory_region == INVALID_REGION)
+    {
+        // Could not navigate to the directory where the directory was to
+        // be deleted from
+        free(navigation_result.remainder_path);
+
+        return -1;
+    }
+
+    // Find the directory entry of the directory being deleted
+    directory_entry entry;
+
+    if (directory_find_entry(navigation_result.directory_region,
+                             navigation_result.remainder_path,
+                             DIRECTORY_ENTRY, &entry) == -1)
+    {
+        // No directory entry found: directory to be deleted does not exist
+        free(navigation_result.remainder_path);
+
+        return -1;
+    }
+
+    if (!directory_is_empty(entry.content_region))
+    {
+        // This directory contains files or other directories: it can't be
+        // deleted before deleting those first
+        free(navigation_result.remainder_path);
+
+        return -1;
+    }
+
+    // Remove the entry from the directory that contains the deleted directory
+    storage_begin_transaction();
+    directory_remove_entry(navigation_result.directory_region,
+                           navigation_result.remainder_path, DIRECTORY_ENTRY);
+
+    free(navigation_result.remainder_path);
+
+    // Delete the regions used by this directory. Its region ID may be
+    // given to another directory later
+    directory_forget_cached_entries(entry.content_region);
+    storage_free_region(entry.content_region);
+    storage_free_region(entry.metadata_region);
+    storage_end_transaction();
+
+    return 0;
+}
+
+int delete_virtual_file(const char* file_path)
+{
+    directory_navigation_result navigation_result
+        = navigate_to_virtual_directory(file_path);
+
+    if (navigation_result.directory_region == INVALID_REGION)
+    {
+        // Could not navigate to the directory where the file was to be deleted
+        // from
+        free(navigation_result.remainder_path);
+
+        return -1;
+    }
+
+    // Find and remove the directory entry of the file being deleted
+    directory_entry entry;
+
+    if (directory_find_entry(navigation_result.directory_region,
+                             navigation_result.remainder_path,
+                             FILE_ENTRY, &entry) == -1)
+    {
+        // No directory entry found: file to be deleted does not exist
+        free(navigation_result.remainder_path);
+
+        return -1;
+    }
+
+    // Descriptors that are still open must not write their length to the
+    // freed metadata region, which may already belong to another file, and
+    // opening a new file with that metadata region must not share their open
+    // file. This is done before the transaction, as the open file lock comes
+    // before the transaction lock
+    lock_for_writing(&open_files_lock_);
+
+    open_file* file = find_open_file(entry.metadata_region);
+
+    if (file != NULL)
+    {
+        remove_open_file(file);
+
+        lock_for_writing(&file->lock);
+        file->metadata_region = INVALID_REGION;
+    }
+
+    unlock_for_writing(&open_files_lock_);
+
+    storage_begin_transaction();
+    directory_remove_entry(navigation_result.directory_region,
+                           navigation_result.remainder_path, FILE_ENTRY);
+
+    free(navigation_result.remainder_path);
+
+    // Delete the regions used by this file. The open file stays locked until
+    // then, so reads of its blocks that a storage batch hasn't made yet are
+    // made before the blocks can be reused
+    storage_free_region(entry.content_region);
+    storage_free_region(entry.metadata_region);
+    storage_end_transaction();
+
+    if (file != NULL)
+    {
+        unlock_for_writing(&file->lock);
+    }
+
+    return 0;
+}
+
+int list_virtual_directory(const char* directory_path,
+                           const virtual_directory_entry* after,
+                           virtual_directory_entry* entries, int max_entries)
+{
+    directory_navigation_result navigation_result
+        = navigate_to_virtual_directory(directory_path);
+
+    if (navigation_result.directory_region == INVALID_REGION)
+    {
+        // Could not navigate to the directory that contains the directory
+        // being listed
+        free(navigation_result.remainder_path);
+
+        return -1;
+    }
+
+    // A path that ends in a slash, or an empty path for the root directory,
+    // leads straight to the directory being listed. Otherwise the last name
+    // in the path is the directory being listed
+    storage_region directory_region = navigation_result.directory_region;
+
+    if (navigation_result.remainder_path[0] != '\0')
+    {
+        directory_entry entry;
+
+        if (directory_find_entry(directory_region,
+                                 navigation_result.remainder_path,
+                                 DIRECTORY_ENTRY, &entry) == -1)
+        {
+            free(navigation_result.remainder_path);
+
+            return -1;
+        }
+
+        directory_region = entry.content_region;
+    }
+
+    free(navigation_result.remainder_path);
+
+    if (max_entries <= 0)
+    {
+        return 0;
+    }
+
+    directory_listing_entry* listing =
+        malloc(max_entries * sizeof(directory_listing_entry));
+
+    if (listing == NULL)
+    {
+        return -1;
+    }
+
+    int entry_count = directory_list_entries(
+        directory_region, after != NULL ? after->name : NULL,
+        after != NULL && after->is_directory ? DIRECTORY_ENTRY : FILE_ENTRY,
+        listing, max_entries);
+
+    for (int i = 0; i < entry_count; i++)
+    {
+        strcpy(entries[i].name, listing[i].name);
+        entries[i].is_directory = listing[i].entry.type == DIRECTORY_ENTRY;
+    }
+
+    free(listing);
+
+    return entry_count;
+}
+
+open_file find_virtual_file(const char* file_path)
+{
+    directory_navigation_result navigation_result
+        = navigate_to_virtual_directory(file_path);
+
+    if (navigation_result.directory_region == INVALID_REGION)
+    {
+        // Could not navigate to the directory where the file was expected to
+        // be
+        free(navigation_result.remainder_path);
+
+        return found_file(INVALID_REGION, INVALID_REGION, 0);
+    }
+
+    // Find the directory entry of the file
+    directory_entry entry;
+    int result = directory_find_entry(navigation_result.directory_region,
+                                      navigation_result.remainder_path,
+                                      FILE_ENTRY, &entry);
+
+    free(navigation_result.remainder_path);
+
+    if (result == -1)
+    {
+        // No directory entry found: file does not exist
+        return found_file(INVALID_REGION, INVALID_REGION, 0);
+    }
+
+    // The length of the file is at the start of its metadata
+    size_t file_length;
+    read_virtual_metadata(entry.metadata_region, &file_length, sizeof(size_t));
+
+    return found_file(entry.content_region, entry.metadata_region,
+                      file_length);
+}
+
+open_file create_virtual_file(const char* file_path)
+{
+    directory_navigation_result navigation_result
+        = navigate_to_virtual_directory(file_path);
+
+    if (navigation_result.directory_region == INVALID_REGION)
+    {
+        // Could not navigate to the directory where the file was going to be
+        // created in
+        free(navigation_result.remainder_path);
+
+        return found_file(INVALID_REGION, INVALID_REGION, 0);
+    }
+
+    storage_begin_transaction();
+
+    // Allocate regions for the new virtual file
+    storage_region content_region = storage_allocate_region();
+
+    if (content_region == INVALID_REGION)
+    {
+        storage_end_transaction();
+        free(navigation_result.remainder_path);
+
+        return found_file(INVALID_REGION, INVALID_REGION, 0);
+    }
+
+    storage_region metadata_region = storage_allocate_region();
+
+    if (metadata_region == INVALID_REGION)
+    {
+        free(navigation_result.remainder_path);
+        storage_free_region(content_region);
+        storage_end_transaction();
+
+        return found_file(INVALID_REGION, INVALID_REGION, 0);
+    }
+
+    // Write the length and name of the new file to its metadata
+    char metadata[sizeof(size_t) + 1 + UCHAR_MAX];
+    size_t file_length = 0;
+    unsigned char remainder_path_length = strlen(navigation_result.remainder_path);
+    memcpy(metadata, &file_length, sizeof(size_t));
+    metadata[sizeof(size_t)] = remainder_path_length;
+    memcpy(metadata + sizeof(size_t) + 1, navigation_result.remainder_path,
+           remainder_path_length);
+
+    write_virtual_metadata(metadata_region, metadata,
+                           sizeof(size_t) + 1 + remainder_path_length);
+
+    // Add an entry for the new file to the directory it was created in
+    directory_entry entry = { FILE_ENTRY, metadata_region, content_region };
+
+    if (directory_add_entry(navigation_result.directory_region,
+                            navigation_result.remainder_path, &entry) == -1)
+    {
+        free(navigation_result.remainder_path);
+        storage_free_region(content_region);
+        storage_free_region(metadata_region);
+        storage_end_transaction();
+
+        return found_file(INVALID_REGION, INVALID_REGION, 0);
+    }
+
+    storage_end_transaction();
+    free(navigation_result.remainder_path);
+
+    return found_file(content_region, metadata_region, file_length);
+}
+
+open_file found_file(storage_region content_region,
+                     storage_region metadata_region, size_t length)
+{
+    // Only the regions and the length describe the file that was found or
+    // created. The rest is set up when the file is opened
+    open_file file = { 0 };
+    file.content_region = content_region;
+    file.metadata_region = metadata_region;
+    file.length = length;
+
+    return file;
+}
+
+directory_navigation_result navigate_to_virtual_directory(const char* path)
+{
+    initialize_storage_if_needed();
+
+    storage_region directory_region = root_directory_region_;
+    int last_slash_position = -1;
+
+    for (int i = 0; i < strlen(path); i++)
+    {
+        // Split the path according to forward slashes and try to find each
+        // directory in the path starting from the root directory
+        if (path[i] == '/')
+        {
+            // Get the name of the next directory that needs to be found
+            int directory_name_length = (i - 1) - last_slash_position;
+            char* directory_name = malloc(directory_name_length + 1);
+            memcpy(directory_name, path + last_slash_position + 1,
+                directory_name_length);
+            directory_name[directory_name_length] = '\0';
+
+            directory_entry entry;
+            int result = directory_find_entry(directory_region, directory_name,
+                                              DIRECTORY_ENTRY, &entry);
 
             free(directory_name);
 
+            if (result == -1)
+            {
+                // Next directory to go into did not exist
+                return (directory_navigation_result) { NULL, INVALID_REGION };
+            }
+
+            // Directory found: look for the next directory in the path inside
+            // of it
+            directory_region = entry.content_region;
             last_slash_position = i;
         }
     }
@@ -762,31 +1429,326 @@ directory_navigation_result navigate_to_virtual_directory(char* path)
     return (directory_navigation_result) { remainder_name, directory_region };
 }
 
+int read_virtual_metadata(storage_region metadata_region, void* bytes,
+                          size_t n_bytes)
+{
+    lock_for_writing(&metadata_lock_);
+
+    if (metadata_cursor_ == NULL)
+    {
+        metadata_cursor_ = storage_create_cursor();
+    }
+
+    size_t read_bytes = 0;
+
+    if (metadata_cursor_ != NULL
+        && storage_cursor_jump_to_region(metadata_cursor_, metadata_region) == 0)
+    {
+        read_bytes = storage_cursor_read(metadata_cursor_, bytes, n_bytes);
+    }
+
+    unlock_for_writing(&metadata_lock_);
+
+    return read_bytes == n_bytes ? 0 : -1;
+}
+
+int write_virtual_metadata(storage_region metadata_region, void* bytes,
+                           size_t n_bytes)
+{
+    lock_for_writing(&metadata_lock_);
+
+    if (metadata_cursor_ == NULL)
+    {
+        metadata_cursor_ = storage_create_cursor();
+    }
+
+    size_t written_bytes = 0;
+
+    if (metadata_cursor_ != NULL
+        && storage_cursor_jump_to_region(metadata_cursor_, metadata_region) == 0)
+    {
+        written_bytes =
+            storage_cursor_write(metadata_cursor_, bytes, n_bytes);
+    }
+
+    unlock_for_writing(&metadata_lock_);
+
+    return written_bytes == n_bytes ? 0 : -1;
+}
+
 void update_virtual_file_metadata(storage_region metadata_region, size_t file_size)
 {
-    storage_jump_to_region(metadata_region);
-    storage_write_in_region(&file_size, sizeof(size_t));
+    write_virtual_metadata(metadata_region, &file_size, sizeof(size_t));
+}
 
-    invalidate_last_descriptor();
+void grow_virtual_file(open_file* file, size_t end_position)
+{
+    // Update file length if a write wrote past the file's previous length.
+    // The metadata is only updated when the length is flushed
+    if (end_position > file->length)
+    {
+        file->length = end_position;
+        file->length_dirty = true;
+    }
+
+    if (file->length_dirty && length_flush_interval_ >= 0
+        && (length_flush_interval_ == 0
+            || difftime(time(NULL), file->length_flush_time)
+               >= length_flush_interval_))
+    {
+        flush_virtual_file_length(file);
+    }
 }
 
-void invalidate_last_descriptor()
+void flush_virtual_file_length(open_file* file)
 {
-    // This is needed whenever the storage region is changed
-    last_used_descriptor_ = -1;
+    if (file->length_dirty && file->metadata_region != INVALID_REGION)
+    {
+        storage_begin_transaction();
+        update_virtual_file_metadata(file->metadata_region, file->length);
+        storage_end_transaction();
+        file->length_dirty = false;
+    }
+
+    if (length_flush_interval_ > 0)
+    {
+        file->length_flush_time = time(NULL);
+    }
 }
 
-void jump_to_file_if_needed(file_descriptor file_descriptor)
+void follow_relocation(virtual_file* descriptor)
 {
-    // This function optimizes reading and writing by making sure the storage
-    // doesn't jump to the file content region if it's already there
-    if (last_used_descriptor_ == file_descriptor)
+    // Called with the lock of the open file held. A cursor that may be in
+    // blocks that have been moved or freed since it was last used is moved
+    // to its position in the region again. Another descriptor may have
+    // truncated the file below that position, in which case the position
+    // moves to the new end of the file
+    open_file* file = descriptor->file;
+
+    if (descriptor->relocation_count != file->relocation_count)
     {
-        return;
+        if (descriptor->reader_position > file->length)
+        {
+            descriptor->reader_position = file->length;
+        }
+
+        storage_cursor_jump_to_region(descriptor->cursor,
+                                      file->content_region);
+        storage_cursor_seek(descriptor->cursor, descriptor->reader_position);
+        descriptor->relocation_count = file->relocation_count;
+    }
+}
+
+int compact_virtual_directory(compaction_state* state, const char* path)
+{
+    directory_listing_entry* listing =
+        malloc(COMPACTION_PAGE_SIZE * sizeof(directory_listing_entry));
+
+    if (listing == NULL)
+    {
+        return -1;
+    }
+
+    char after_name[UCHAR_MAX + 1];
+    entry_type after_type = FILE_ENTRY;
+    bool listed_any = false;
+    int result = 0;
+    int entry_count = COMPACTION_PAGE_SIZE;
+
+    while (result == 0 && entry_count == COMPACTION_PAGE_SIZE
+           && !state->stopped)
+    {
+        size_t moved_blocks = state->report.moved_blocks;
+
+        // The directory is looked up again for every batch of entries, as it
+        // may have been moved or deleted while the namespace was unlocked
+        lock_for_writing(&namespace_lock_);
+
+        directory_navigation_result navigation_result
+            = navigate_to_virtual_directory(path);
+        storage_region directory_region = navigation_result.directory_region;
+
+        free(navigation_result.remainder_path);
+
+        entry_count = directory_region == INVALID_REGION ? 0
+            : directory_list_entries(directory_region,
+                                     listed_any ? after_name : NULL,
+                                     after_type, listing,
+                                     COMPACTION_PAGE_SIZE);
+
+        for (int i = 0; i < entry_count && result == 0; i++)
+        {
+            if (!compaction_budget_left(state))
+            {
+                state->stopped = true;
+
+                break;
+            }
+
+            compact_virtual_entry(state, directory_region, &listing[i]);
+
+            if (listing[i].entry.type == DIRECTORY_ENTRY)
+            {
+                result = queue_compaction_path(state, path, listing[i].name);
+            }
+
+            strcpy(after_name, listing[i].name);
+            after_type = listing[i].entry.type;
+            listed_any = true;
+        }
+
+        unlock_for_writing(&namespace_lock_);
+
+        // Pace the compaction by sleeping for as long as moving the blocks
+        // of the batch was allowed to take
+        moved_blocks = state->report.moved_blocks - moved_blocks;
+
+        if (state->options.max_blocks_per_second > 0 && moved_blocks > 0)
+        {
+            thread_sleep((unsigned)(moved_blocks * 1000
+                                    / state->options.max_blocks_per_second));
+        }
     }
 
-    storage_jump_to_region(descriptors_[file_descriptor]->content_region);
-    storage_seek_in_region(descriptors_[file_descriptor]->reader_position);
+    free(listing);
+
+    return result;
+}
+
+void compact_virtual_entry(compaction_state* state,
+                           storage_region directory_region,
+                           const directory_listing_entry* listed)
+{
+    // Descriptors of an open file must not use its blocks while they move.
+    // The open file table stays locked too, as closing the last descriptor
+    // would free the open file
+    directory_entry entry = listed->entry;
+    open_file* file = NULL;
+
+    if (entry.type == FILE_ENTRY)
+    {
+        lock_for_writing(&open_files_lock_);
+
+        file = find_open_file(entry.metadata_region);
+
+        if (file != NULL)
+        {
+            lock_for_writing(&file->lock);
+        }
+    }
+
+    storage_begin_transaction();
+
+    size_t metadata_blocks = 0;
+    size_t content_blocks = 0;
+    directory_entry moved = {
+        entry.type,
+        storage_relocate_region(entry.metadata_region, false,
+                                &metadata_blocks),
+        storage_relocate_region(entry.content_region, false, &content_blocks)
+    };
+
+    // A region copied under a new ID replaces the old one once the entry
+    // refers to the copy. If the entry can't be changed, the copy is freed
+    // instead
+    bool metadata_copied = moved.metadata_region != entry.metadata_region;
+    bool content_copied = moved.content_region != entry.content_region;
+    bool replaced = (metadata_copied || content_copied)
+        && directory_replace_entry(directory_region, listed->name,
+                                   &moved) == 0;
+
+    if (metadata_copied)
+    {
+        storage_free_region(replaced ? entry.metadata_region
+                                     : moved.metadata_region);
+        metadata_blocks = replaced ? metadata_blocks : 0;
+    }
+
+    if (content_copied)
+    {
+        storage_free_region(replaced ? entry.content_region
+                                     : moved.content_region);
+        content_blocks = replaced ? content_blocks : 0;
+    }
+
+    storage_end_transaction();
+
+    if (!replaced)
+    {
+        moved = entry;
+    }
+
+    if (entry.type == FILE_ENTRY)
+    {
+        if (file != NULL)
+        {
+            // The open file is keyed by its metadata region
+            if (moved.metadata_region != file->metadata_region)
+            {
+                remove_open_file(file);
+                file->metadata_region = moved.metadata_region;
+                insert_open_file(file);
+            }
+
+            file->content_region = moved.content_region;
+            file->relocation_count += content_blocks > 0;
 
-    last_used_descriptor_ = file_descriptor;
+            unlock_for_writing(&file->lock);
+        }
+
+        unlock_for_writing(&open_files_lock_);
+    }
+
+    state->report.moved_regions += (metadata_blocks > 0)
+        + (content_blocks > 0);
+    state->report.moved_blocks += metadata_blocks + content_blocks;
+}
+
+int queue_compaction_path(compaction_state* state, const char* path,
+                          const char* name)
+{
+    // Paths of directories end in a slash, which leads navigation into the
+    // directory itself. The root directory has an empty path
+    if (state->path_count == state->path_capacity)
+    {
+        size_t capacity = state->path_capacity > 0
+            ? state->path_capacity * 2 : COMPACTION_PAGE_SIZE;
+        char** paths = realloc(state->paths, capacity * sizeof(char*));
+
+        if (paths == NULL)
+        {
+            return -1;
+        }
+
+        state->paths = paths;
+        state->path_capacity = capacity;
+    }
+
+    size_t path_length = strlen(path);
+    size_t name_length = name != NULL ? strlen(name) : 0;
+    char* queued_path = malloc(path_length + name_length + 2);
+
+    if (queued_path == NULL)
+    {
+        return -1;
+    }
+
+    memcpy(queued_path, path, path_length);
+    queued_path[path_length] = '\0';
+
+    if (name != NULL)
+    {
+        memcpy(queued_path + path_length, name, name_length);
+        strcpy(queued_path + path_length + name_length, "/");
+    }
+
+    state->paths[state->path_count++] = queued_path;
+
+    return 0;
+}
+
+bool compaction_budget_left(const compaction_state* state)
+{
+    return state->options.max_moved_blocks == 0
+        || state->report.moved_blocks < state->options.max_moved_blocks;
 }
@@ -3,8 +3,10 @@
 
 // This module provides an interface for creating and accessing virtual files
 // and handles file metadata to keep track of open files, file lengths and file
-// names.
+// names. The functions can be called from several threads at once, but each
+// descriptor should only be used by one thread at a time.
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -12,23 +14,105 @@
 // Windows compatibility
 #ifdef _MSC_VER
 #include <BaseTsd.h>
+#include "virtualStorage.h" // struct iovec
 typedef SSIZE_T ssize_t;
 #else
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
 typedef int file_descriptor;
 
+// An entry of a virtual directory listed by readdir_virtual()
+typedef struct virtual_directory_entry
+{
+    char name[256];
+    bool is_directory;
+} virtual_directory_entry;
+
 file_descriptor open_virtual(const char* path, int flags);
 void close_virtual(file_descriptor file_descriptor);
 
+// Writes the length of a file that has grown to its metadata, flushes the
+// cached blocks of the storage and syncs the storage file to the disk.
+// Returns -1 if the descriptor is not open or the journaled group could not
+// be committed
+int fsync_virtual(file_descriptor file_descriptor);
+
+// The length of a file that grows is kept in memory and only written to its
+// metadata when the file is closed or synced, or on a write that comes at
+// least the given number of seconds after the length was last written. An
+// interval of zero writes the length on every write that grows the file, and
+// a negative interval, which is the default, disables the timer
+void set_length_flush_interval_virtual(int seconds);
+
 int unlink_virtual(const char* path);
 
 int mkdir_virtual(const char* path);
 int rmdir_virtual(const char* path);
 
+// Lists up to max_entries entries of a virtual directory in order of name,
+// starting after the given entry or from the first entry if it's NULL. The
+// last entry listed by a call can be passed to the next call to continue the
+// listing. An empty path lists the root directory. Returns the number of
+// entries listed, or -1 if the directory does not exist
+int readdir_virtual(const char* path, const virtual_directory_entry* after,
+                    virtual_directory_entry* entries, int max_entries);
+
+// Limits of compact_virtual(). A limit of zero means no limit
+typedef struct virtual_compaction_options
+{
+    // Compaction sleeps between batches of directory entries so that it
+    // moves at most this many blocks per second on average
+    size_t max_blocks_per_second;
+
+    // Compaction stops once it has moved at least this many blocks
+    size_t max_moved_blocks;
+} virtual_compaction_options;
+
+// The fragmentation scores are those of storage_fragmentation()
+typedef struct virtual_compaction_report
+{
+    double fragmentation_before;
+    double fragmentation_after;
+    size_t moved_regions;
+    size_t moved_blocks;
+
+    // False if compaction stopped at the block limit before it had been
+    // through every directory
+    bool finished;
+} virtual_compaction_report;
+
+// Moves the blocks of files and directories so that each one continues in
+// adjacent blocks, going through the directories from the root down. Other
+// threads can keep using the file system meanwhile: the namespace is locked
+// for a batch of directory entries at a time, and an open file only while its
+// own blocks move. Regions that no run of free blocks can hold are left as
+// they are.
+// Returns -1 if the storage could not be opened or memory ran out, in which
+// case the report covers the compaction done before that
+int compact_virtual(const virtual_compaction_options* options,
+                    virtual_compaction_report* report);
+
 ssize_t read_virtual(file_descriptor file_descriptor, void* buffer, size_t n_bytes);
 ssize_t write_virtual(file_descriptor file_descriptor, void* buffer, size_t n_bytes);
 off_t seek_virtual(file_descriptor file_descriptor, off_t offset, int whence);
 
+// Read or write at the given offset in the file without using or moving the
+// position of the descriptor. Reads stop at the end of the file, and writes
+// may start at most at the end of the file. Returns -1 if the descriptor is
+// not open or the offset is invalid
+ssize_t pread_virtual(file_descriptor file_descriptor, void* buffer,
+                      size_t n_bytes, off_t offset);
+ssize_t pwrite_virtual(file_descriptor file_descriptor, void* buffer,
+                       size_t n_bytes, off_t offset);
+
+// Read into or write from several buffers in order at the position of the
+// file, like one read_virtual() or write_virtual() of all the buffers back to
+// back
+ssize_t readv_virtual(file_descriptor file_descriptor,
+                      const struct iovec* parts, int part_count);
+ssize_t writev_virtual(file_descriptor file_descriptor,
+                       const struct iovec* parts, int part_count);
+
 #endif // VIRTUALFILESYSTEM_H
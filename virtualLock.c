@@ -0,0 +1,279 @@
+#include "virtualLock.h"
+
+#include <stdlib.h>
+
+#ifndef _MSC_VER
+#include <errno.h>
+#include <time.h>
+#endif
+
+// Threads run their function through a start routine of the type that the
+// platform expects
+typedef struct thread_start_info
+{
+    void (*function)(void*);
+    void* argument;
+} thread_start_info;
+
+#ifdef _MSC_VER
+static BOOL CALLBACK run_once_callback(PINIT_ONCE once, PVOID function,
+                                       PVOID* context)
+{
+    ((void (*)())function)();
+
+    return TRUE;
+}
+
+static DWORD WINAPI thread_start_routine(LPVOID argument)
+#else
+static void* thread_start_routine(void* argument)
+#endif
+{
+    thread_start_info info = *(thread_start_info*)argument;
+    free(argument);
+
+    info.function(info.argument);
+
+    return 0;
+}
+
+void lock_initialize(virtual_lock* lock)
+{
+#ifdef _MSC_VER
+    InitializeSRWLock(lock);
+#else
+    pthread_rwlock_init(lock, NULL);
+#endif
+}
+
+void lock_destroy(virtual_lock* lock)
+{
+    // Slim reader-writer locks don't need to be destroyed
+#ifndef _MSC_VER
+    pthread_rwlock_destroy(lock);
+#endif
+}
+
+void lock_for_reading(virtual_lock* lock)
+{
+#ifdef _MSC_VER
+    AcquireSRWLockShared(lock);
+#else
+    pthread_rwlock_rdlock(lock);
+#endif
+}
+
+bool try_lock_for_reading(virtual_lock* lock)
+{
+#ifdef _MSC_VER
+    return TryAcquireSRWLockShared(lock) != 0;
+#else
+    return pthread_rwlock_tryrdlock(lock) == 0;
+#endif
+}
+
+void unlock_for_reading(virtual_lock* lock)
+{
+#ifdef _MSC_VER
+    ReleaseSRWLockShared(lock);
+#else
+    pthread_rwlock_unlock(lock);
+#endif
+}
+
+void lock_for_writing(virtual_lock* lock)
+{
+#ifdef _MSC_VER
+    AcquireSRWLockExclusive(lock);
+#else
+    pthread_rwlock_wrlock(lock);
+#endif
+}
+
+void unlock_for_writing(virtual_lock* lock)
+{
+#ifdef _MSC_VER
+    ReleaseSRWLockExclusive(lock);
+#else
+    pthread_rwlock_unlock(lock);
+#endif
+}
+
+void run_once(virtual_once* once, void (*function)())
+{
+#ifdef _MSC_VER
+    InitOnceExecuteOnce(once, run_once_callback, (PVOID)function, NULL);
+#else
+    pthread_once(once, function);
+#endif
+}
+
+uint64_t atomic_word_load(atomic_word* word)
+{
+#ifdef _MSC_VER
+    return (uint64_t)InterlockedCompareExchange64(word, 0, 0);
+#else
+    return atomic_load(word);
+#endif
+}
+
+void atomic_word_store(atomic_word* word, uint64_t value)
+{
+#ifdef _MSC_VER
+    InterlockedExchange64(word, (LONG64)value);
+#else
+    atomic_store(word, value);
+#endif
+}
+
+bool atomic_word_compare_swap(atomic_word* word, uint64_t* expected,
+                              uint64_t desired)
+{
+#ifdef _MSC_VER
+    uint64_t previous = (uint64_t)InterlockedCompareExchange64(
+        word, (LONG64)desired, (LONG64)*expected);
+
+    if (previous == *expected)
+    {
+        return true;
+    }
+
+    *expected = previous;
+
+    return false;
+#else
+    return atomic_compare_exchange_strong(word, expected, desired);
+#endif
+}
+
+void mutex_initialize(virtual_mutex* mutex)
+{
+#ifdef _MSC_VER
+    InitializeSRWLock(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mutex_destroy(virtual_mutex* mutex)
+{
+#ifndef _MSC_VER
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void mutex_lock(virtual_mutex* mutex)
+{
+#ifdef _MSC_VER
+    AcquireSRWLockExclusive(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void mutex_unlock(virtual_mutex* mutex)
+{
+#ifdef _MSC_VER
+    ReleaseSRWLockExclusive(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void condition_initialize(virtual_condition* condition)
+{
+#ifdef _MSC_VER
+    InitializeConditionVariable(condition);
+#else
+    pthread_cond_init(condition, NULL);
+#endif
+}
+
+void condition_destroy(virtual_condition* condition)
+{
+    // Windows condition variables don't need to be destroyed either
+#ifndef _MSC_VER
+    pthread_cond_destroy(condition);
+#endif
+}
+
+void condition_wait(virtual_condition* condition, virtual_mutex* mutex)
+{
+#ifdef _MSC_VER
+    SleepConditionVariableSRW(condition, mutex, INFINITE, 0);
+#else
+    pthread_cond_wait(condition, mutex);
+#endif
+}
+
+void condition_signal(virtual_condition* condition)
+{
+#ifdef _MSC_VER
+    WakeConditionVariable(condition);
+#else
+    pthread_cond_signal(condition);
+#endif
+}
+
+void condition_broadcast(virtual_condition* condition)
+{
+#ifdef _MSC_VER
+    WakeAllConditionVariable(condition);
+#else
+    pthread_cond_broadcast(condition);
+#endif
+}
+
+int thread_start(virtual_thread* thread, void (*function)(void*),
+                 void* argument)
+{
+    thread_start_info* info = malloc(sizeof(thread_start_info));
+
+    if (info == NULL)
+    {
+        return -1;
+    }
+
+    info->function = function;
+    info->argument = argument;
+
+#ifdef _MSC_VER
+    *thread = CreateThread(NULL, 0, thread_start_routine, info, 0, NULL);
+
+    if (*thread == NULL)
+#else
+    if (pthread_create(thread, NULL, thread_start_routine, info) != 0)
+#endif
+    {
+        free(info);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+void thread_join(virtual_thread thread)
+{
+#ifdef _MSC_VER
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void thread_sleep(unsigned milliseconds)
+{
+#ifdef _MSC_VER
+    Sleep(milliseconds);
+#else
+    struct timespec remaining = { milliseconds / 1000,
+                                  (long)(milliseconds % 1000) * 1000000 };
+
+    // The sleep is resumed for the time that was left if a signal ends it
+    while (nanosleep(&remaining, &remaining) == -1 && errno == EINTR)
+    {
+    }
+#endif
+}
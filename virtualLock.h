@@ -0,0 +1,89 @@
+#ifndef VIRTUALLOCK_H
+#define VIRTUALLOCK_H
+
+// This module wraps the reader-writer locks of the host platform for the other
+// modules. A lock is held either by any number of readers or by one writer.
+// Locks that only guard short changes to shared state are always locked for
+// writing, which makes them work like mutexes. Locks are not recursive: a
+// thread must not lock a lock it already holds. Locks that can't be set up
+// with the static initializer are set up by a function that is run once.
+// The module also provides atomic 64-bit words for lock-free structures, and
+// mutexes, condition variables and threads for modules that run work in the
+// background or pace it.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+typedef volatile LONG64 atomic_word;
+typedef SRWLOCK virtual_lock;
+typedef INIT_ONCE virtual_once;
+typedef SRWLOCK virtual_mutex;
+typedef CONDITION_VARIABLE virtual_condition;
+typedef HANDLE virtual_thread;
+#define VIRTUAL_LOCK_INITIALIZER SRWLOCK_INIT
+#define VIRTUAL_ONCE_INITIALIZER INIT_ONCE_STATIC_INIT
+#define THREAD_LOCAL __declspec(thread)
+#else
+#include <pthread.h>
+#include <stdatomic.h>
+typedef _Atomic uint64_t atomic_word;
+typedef pthread_rwlock_t virtual_lock;
+typedef pthread_once_t virtual_once;
+typedef pthread_mutex_t virtual_mutex;
+typedef pthread_cond_t virtual_condition;
+typedef pthread_t virtual_thread;
+#define VIRTUAL_LOCK_INITIALIZER PTHREAD_RWLOCK_INITIALIZER
+#define VIRTUAL_ONCE_INITIALIZER PTHREAD_ONCE_INIT
+#define THREAD_LOCAL _Thread_local
+#endif
+
+void lock_initialize(virtual_lock* lock);
+void lock_destroy(virtual_lock* lock);
+
+void lock_for_reading(virtual_lock* lock);
+void unlock_for_reading(virtual_lock* lock);
+
+// Returns false without waiting if the lock can't be locked for reading
+// right away
+bool try_lock_for_reading(virtual_lock* lock);
+void lock_for_writing(virtual_lock* lock);
+void unlock_for_writing(virtual_lock* lock);
+
+// Runs the function unless it has already been run with the same once
+// object. Other threads calling this at the same time wait until it's done
+void run_once(virtual_once* once, void (*function)());
+
+// Sequentially consistent loads and stores of atomic words. Compare and swap
+// replaces the word with the desired value if it still holds the expected
+// value, and otherwise loads its current value into the expected value
+uint64_t atomic_word_load(atomic_word* word);
+void atomic_word_store(atomic_word* word, uint64_t value);
+bool atomic_word_compare_swap(atomic_word* word, uint64_t* expected,
+                              uint64_t desired);
+
+void mutex_initialize(virtual_mutex* mutex);
+void mutex_destroy(virtual_mutex* mutex);
+void mutex_lock(virtual_mutex* mutex);
+void mutex_unlock(virtual_mutex* mutex);
+
+// Waiting releases the mutex, which must be held, until the condition is
+// signaled, and takes it again before returning. Waits may also end without
+// a signal, so the waited-for state has to be checked again after each wait
+void condition_initialize(virtual_condition* condition);
+void condition_destroy(virtual_condition* condition);
+void condition_wait(virtual_condition* condition, virtual_mutex* mutex);
+void condition_signal(virtual_condition* condition);
+void condition_broadcast(virtual_condition* condition);
+
+// Starts a thread that runs the function with the argument. Returns -1 if the
+// thread could not be started
+int thread_start(virtual_thread* thread, void (*function)(void*),
+                 void* argument);
+void thread_join(virtual_thread thread);
+
+// Suspends the calling thread for at least the given number of milliseconds
+void thread_sleep(unsigned milliseconds);
+
+#endif // VIRTUALLOCK_H
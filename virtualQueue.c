@@ -0,0 +1,369 @@
+// Each worker has a ring of its own for the requests waiting for it, while
+// completions from all workers go to a single ring of the queue. Neither ring
+// can overflow, as both have room for the capacity of the queue and
+// submitting stops when that many requests have not been reaped. All state
+// of a queue is guarded by its mutex, which workers only hold while taking
+// requests and handing over completions, not while doing the requests.
+
+// A worker takes up to MAX_WORKER_BATCH requests at a time. Reads are added
+// to the worker's storage batch, which is ended before any other request so
+// that a write or a close is never done before a read submitted ahead of it,
+// and at the end of the requests. The batch keeps the files of the reads
+// locked until it ends, and each read has a flag that the batch sets if any
+// of its storage file reads fail. Completions are handed over once all
+// requests taken have been done, when the batched reads have filled their
+// buffers and their results are known.
+
+#include "virtualQueue.h"
+#include "virtualLock.h"
+#include "virtualStorage.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define MAX_WORKER_BATCH 64
+
+typedef struct queue_worker
+{
+    virtual_queue* queue;
+    virtual_thread thread;
+    virtual_condition requests_available;
+
+    queue_request* requests;
+    size_t first_request;
+    size_t request_count;
+
+    storage_batch* batch;
+} queue_worker;
+
+struct virtual_queue
+{
+    virtual_mutex mutex;
+    virtual_condition completions_available;
+
+    queue_worker* workers;
+    int worker_count;
+    int started_worker_count;
+    int next_open_worker;
+    bool stopping;
+
+    // Requests that have been submitted but not reaped
+    size_t capacity;
+    size_t unreaped_count;
+
+    queue_completion* completions;
+    size_t first_completion;
+    size_t completion_count;
+};
+
+void run_queue_worker(void* argument);
+void do_queue_requests(queue_worker* worker, const queue_request* requests,
+                       queue_completion* completions, int count);
+queue_worker* worker_for_request(virtual_queue* queue,
+                                 const queue_request* request);
+
+virtual_queue* create_queue_virtual(int worker_count, size_t capacity)
+{
+    if (worker_count <= 0 || capacity == 0)
+    {
+        return NULL;
+    }
+
+    virtual_queue* queue = calloc(1, sizeof(virtual_queue));
+
+    if (queue == NULL)
+    {
+        return NULL;
+    }
+
+    queue->workers = calloc(worker_count, sizeof(queue_worker));
+    queue->completions = malloc(capacity * sizeof(queue_completion));
+
+    if (queue->workers == NULL || queue->completions == NULL)
+    {
+        free(queue->workers);
+        free(queue->completions);
+        free(queue);
+
+        return NULL;
+    }
+
+    mutex_initialize(&queue->mutex);
+    condition_initialize(&queue->completions_available);
+
+    queue->worker_count = worker_count;
+    queue->capacity = capacity;
+
+    for (int i = 0; i < worker_count; i++)
+    {
+        queue_worker* worker = &queue->workers[i];
+
+        worker->queue = queue;
+        worker->requests = malloc(capacity * sizeof(queue_request));
+        worker->batch = storage_create_batch();
+        condition_initialize(&worker->requests_available);
+
+        if (worker->requests == NULL || worker->batch == NULL
+            || thread_start(&worker->thread, run_queue_worker, worker) == -1)
+        {
+            // Workers that have already started are stopped and freed along
+            // with this one
+            free(worker->requests);
+            storage_destroy_batch(worker->batch);
+            condition_destroy(&worker->requests_available);
+
+            destroy_queue_virtual(queue);
+
+            return NULL;
+        }
+
+        queue->started_worker_count++;
+    }
+
+    return queue;
+}
+
+void destroy_queue_virtual(virtual_queue* queue)
+{
+    if (queue == NULL)
+    {
+        return;
+    }
+
+    // Workers finish the requests waiting for them before they stop
+    mutex_lock(&queue->mutex);
+
+    queue->stopping = true;
+
+    for (int i = 0; i < queue->started_worker_count; i++)
+    {
+        condition_signal(&queue->workers[i].requests_available);
+    }
+
+    mutex_unlock(&queue->mutex);
+
+    for (int i = 0; i < queue->started_worker_count; i++)
+    {
+        queue_worker* worker = &queue->workers[i];
+
+        thread_join(worker->thread);
+
+        free(worker->requests);
+        storage_destroy_batch(worker->batch);
+        condition_destroy(&worker->requests_available);
+    }
+
+    condition_destroy(&queue->completions_available);
+    mutex_destroy(&queue->mutex);
+
+    free(queue->workers);
+    free(queue->completions);
+    free(queue);
+}
+
+int submit_virtual(virtual_queue* queue, const queue_request* requests,
+                   int count)
+{
+    if (queue == NULL || count <= 0)
+    {
+        return 0;
+    }
+
+    mutex_lock(&queue->mutex);
+
+    int submitted_count = 0;
+
+    while (submitted_count < count && queue->unreaped_count < queue->capacity)
+    {
+        const queue_request* request = &requests[submitted_count];
+        queue_worker* worker = worker_for_request(queue, request);
+
+        size_t slot = (worker->first_request + worker->request_count)
+            % queue->capacity;
+        worker->requests[slot] = *request;
+        worker->request_count++;
+
+        condition_signal(&worker->requests_available);
+
+        queue->unreaped_count++;
+        submitted_count++;
+    }
+
+    mutex_unlock(&queue->mutex);
+
+    return submitted_count;
+}
+
+int reap_virtual(virtual_queue* queue, queue_completion* completions,
+                 int max_completions, int min_completions)
+{
+    if (queue == NULL || max_completions <= 0)
+    {
+        return 0;
+    }
+
+    mutex_lock(&queue->mutex);
+
+    // Waiting for more completions than there are requests to complete would
+    // never end
+    size_t wanted_count = min_completions > 0 ? min_completions : 0;
+
+    if (wanted_count > queue->unreaped_count)
+    {
+        wanted_count = queue->unreaped_count;
+    }
+
+    while (queue->completion_count < wanted_count)
+    {
+        condition_wait(&queue->completions_available, &queue->mutex);
+    }
+
+    int reaped_count = 0;
+
+    while (reaped_count < max_completions && queue->completion_count > 0)
+    {
+        completions[reaped_count++] =
+            queue->completions[queue->first_completion];
+
+        queue->first_completion =
+            (queue->first_completion + 1) % queue->capacity;
+        queue->completion_count--;
+        queue->unreaped_count--;
+    }
+
+    mutex_unlock(&queue->mutex);
+
+    return reaped_count;
+}
+
+void run_queue_worker(void* argument)
+{
+    queue_worker* worker = argument;
+    virtual_queue* queue = worker->queue;
+
+    queue_request requests[MAX_WORKER_BATCH];
+    queue_completion completions[MAX_WORKER_BATCH];
+
+    mutex_lock(&queue->mutex);
+
+    while (true)
+    {
+        while (worker->request_count == 0 && !queue->stopping)
+        {
+            condition_wait(&worker->requests_available, &queue->mutex);
+        }
+
+        if (worker->request_count == 0)
+        {
+            // The queue is being destroyed and no requests are left
+            break;
+        }
+
+        int count = 0;
+
+        while (count < MAX_WORKER_BATCH && worker->request_count > 0)
+        {
+            requests[count++] = worker->requests[worker->first_request];
+
+            worker->first_request =
+                (worker->first_request + 1) % queue->capacity;
+            worker->request_count--;
+        }
+
+        mutex_unlock(&queue->mutex);
+
+        do_queue_requests(worker, requests, completions, count);
+
+        mutex_lock(&queue->mutex);
+
+        for (int i = 0; i < count; i++)
+        {
+            size_t slot = (queue->first_completion + queue->completion_count)
+                % queue->capacity;
+            queue->completions[slot] = completions[i];
+            queue->completion_count++;
+        }
+
+        condition_broadcast(&queue->completions_available);
+    }
+
+    mutex_unlock(&queue->mutex);
+}
+
+void do_queue_requests(queue_worker* worker, const queue_request* requests,
+                       queue_completion* completions, int count)
+{
+    bool batch_started = false;
+    bool read_failed[MAX_WORKER_BATCH] = { false };
+
+    for (int i = 0; i < count; i++)
+    {
+        const queue_request* request = &requests[i];
+        ssize_t result = -1;
+
+        if (request->operation != QUEUE_READ && batch_started)
+        {
+            storage_end_batch();
+            batch_started = false;
+        }
+
+        switch (request->operation)
+        {
+        case QUEUE_READ:
+            if (!batch_started)
+            {
+                storage_start_batch(worker->batch);
+                batch_started = true;
+            }
+
+            storage_report_batch_failures(&read_failed[i]);
+            result = pread_virtual(request->file, request->buffer,
+                                   request->n_bytes, request->offset);
+            break;
+        case QUEUE_WRITE:
+            result = pwrite_virtual(request->file, request->buffer,
+                                    request->n_bytes, request->offset);
+            break;
+        case QUEUE_OPEN:
+            result = open_virtual(request->path, request->flags);
+            break;
+        case QUEUE_CLOSE:
+            close_virtual(request->file);
+            result = 0;
+            break;
+        }
+
+        completions[i].user_data = request->user_data;
+        completions[i].result = result;
+    }
+
+    if (batch_started)
+    {
+        storage_end_batch();
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (read_failed[i])
+        {
+            completions[i].result = -1;
+        }
+    }
+}
+
+queue_worker* worker_for_request(virtual_queue* queue,
+                                 const queue_request* request)
+{
+    // Requests on a descriptor go to the worker chosen by the descriptor, so
+    // they are done in order by a single thread. Opens have no descriptor
+    // yet and are spread over the workers in turn
+    if (request->operation == QUEUE_OPEN || request->file < 0)
+    {
+        queue->next_open_worker =
+            (queue->next_open_worker + 1) % queue->worker_count;
+
+        return &queue->workers[queue->next_open_worker];
+    }
+
+    return &queue->workers[request->file % queue->worker_count];
+}
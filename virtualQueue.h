@@ -0,0 +1,76 @@
+#ifndef VIRTUALQUEUE_H
+#define VIRTUALQUEUE_H
+
+// This module lets many reads, writes and opens of virtual files be in
+// progress at once. Requests are submitted to a queue and done in the
+// background by the queue's worker threads, and their results are reaped
+// from the queue later as completions. Each worker collects the reads it
+// takes from the queue into a storage batch, so the storage file reads of a
+// whole batch of requests are made together, through io_uring on Linux.
+// Requests on the same descriptor are always done by the same worker in the
+// order they were submitted, so a descriptor can have any number of requests
+// in progress, but it must not be used directly until they have completed.
+// Requests on different descriptors may be done in any order, so a read that
+// is in progress at the same time as a write of the same bytes through
+// another descriptor may return the bytes from before or after the write.
+
+#include "virtualFileSystem.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef enum { QUEUE_READ, QUEUE_WRITE, QUEUE_OPEN,
+               QUEUE_CLOSE } queue_operation;
+
+typedef struct queue_request
+{
+    queue_operation operation;
+
+    // Reads and writes work like pread_virtual() and pwrite_virtual(), and
+    // closes like close_virtual()
+    file_descriptor file;
+    void* buffer;
+    size_t n_bytes;
+    off_t offset;
+
+    // Opens work like open_virtual(). The path must stay valid until the
+    // request has completed
+    const char* path;
+    int flags;
+
+    // Passed back as is in the completion of the request
+    void* user_data;
+} queue_request;
+
+typedef struct queue_completion
+{
+    void* user_data;
+
+    // The number of bytes read or written, the descriptor of an opened file,
+    // zero for a close, or -1 if the request failed
+    ssize_t result;
+} queue_completion;
+
+typedef struct virtual_queue virtual_queue;
+
+// The capacity is the number of requests that can be in progress or waiting
+// to be reaped at once. Returns NULL if the workers could not be started
+virtual_queue* create_queue_virtual(int worker_count, size_t capacity);
+
+// Waits for the submitted requests to complete and stops the workers.
+// Completions that haven't been reaped are discarded
+void destroy_queue_virtual(virtual_queue* queue);
+
+// Returns the number of requests submitted, which is less than the count
+// when the queue is full. Requests are submitted in order
+int submit_virtual(virtual_queue* queue, const queue_request* requests,
+                   int count);
+
+// Waits until at least min_completions requests have completed, or all
+// submitted requests if fewer have not been reaped, and reaps up to
+// max_completions completions in the order the requests completed. Returns
+// the number of completions reaped
+int reap_virtual(virtual_queue* queue, queue_completion* completions,
+                 int max_completions, int min_completions);
+
+#endif // VIRTUALQUEUE_H
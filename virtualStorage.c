@@ -5,39 +5,251 @@
 // if the virtual files are large. Deleting files would also leave unevenly
 // sized gaps that might not be easy to reuse.
 
-// The module uses the functions read(), write() and lseek() without checking
-// their return values. The reason for this is because as long as the storage
-// file is structured correctly, these functions should always succeed when
-// used by the module.
+// The module uses the functions pread(), pwrite(), preadv() and pwritev()
+// without checking their return values. The reason for this is because as
+// long as the storage file is structured correctly, these functions should
+// always succeed when used by the module. Batched reads are the exception, as
+// they are made after the read that added them has returned, so their
+// failures are passed on to the caller of the batch.
+
+// All access to the storage file goes through read_storage(), write_storage()
+// and their vectored versions, which take absolute positions in the file. They
+// go through the block cache when it's enabled, and otherwise directly to the
+// backend chosen at initialization: the backend either uses the file
+// functions above or copies to and from a memory mapping of the storage file.
+// The file offset of the storage file is never used, so positions in regions
+// are only kept in cursors. Reads that a thread makes during a batch are
+// handed to the storageBatch module and made when the batch ends.
+
+// The previous and next block of every block are loaded into memory when the
+// storage is initialized, and whether each block is in use is kept in a
+// bitmap. Walking through a region's blocks therefore never reads the storage
+// file. Header changes update the in-memory copy and are written to the
+// storage file right away, unless they belong to a journaled transaction.
+
+// A storage file that runs out of free blocks can grow if a growth policy
+// allows it. The new blocks are added to the end of the file, so existing
+// blocks never move, and the block count in the storage header is updated
+// after the file has been extended. Growth happens under the allocation lock.
+// The links of the blocks are kept in fixed-size chunks that never move once
+// allocated, so threads reading links of existing blocks without the lock
+// are not disturbed when chunks are added for new blocks. The block count
+// is read without the lock too, so it's an atomic counter.
+
+// Freeing blocks only changes their headers, so the host file system keeps
+// their space. When hole punching is enabled, freed runs of blocks are
+// collected under the allocation lock and punched out of the storage file
+// together once enough of them have been collected. Punching a run first
+// extends it over the free blocks next to it, so that small frees next to
+// each other or to earlier frees still cover whole pages, and skips blocks
+// that have been allocated again since they were freed. A punched block
+// reads as zeros, which marks it free, so its header doesn't need to be
+// written. Shrinking cuts the free blocks at the end of the file off instead.
+
+// Blocks only move when a region is relocated to defragment it. Relocation
+// copies the payloads to free blocks under the allocation lock and then frees
+// the blocks it copied from like any other free, which tells block maps that
+// they have to be rebuilt. A region copied as a whole gets a new ID, so its
+// old blocks are only freed by the caller after it has updated the places
+// that refer to the region.
+
+// With journaling enabled, the operations of the modules above run as
+// transactions, and the storageJournal module makes the changes of a group of
+// transactions reach the storage file all together or not at all. Payload
+// writes that a transaction makes are staged in the journal, and the headers
+// it changes are marked pending in a bitmap and encoded from their in-memory
+// copies when the group is committed, so a header changed several times in a
+// group is only journaled once. Until the commit, nothing of the group may
+// reach the storage file: writes outside transactions leave pending headers
+// to the commit too, and blocks freed by a transaction are released to the
+// bitmap of free blocks only when the commit is done, so no other write can
+// land on a block whose old contents a crash would bring back. Copies made
+// while relocating regions go to free blocks that nothing refers to yet, so
+// they are written right away instead of through the journal, and the commit
+// syncs them to the disk before it journals the headers that refer to them.
+// Transactions are serialized by the transaction lock, which the commit also
+// holds, so a group only ever contains whole transactions.
+
+// Regions can be read and written from several threads at once as long as
+// each region is only changed by one thread at a time, which the modules
+// above guarantee with their own locks. Cursors belong to a single thread.
+// Allocating and freeing blocks is serialized by the allocation lock, which
+// guards the bitmap and the headers of blocks changing owner. Reads and
+// writes only take the lock of the block cache, or with the memory-mapped
+// backend the lock that keeps the mapping from being replaced while it's
+// used, so transfers in different regions run in parallel.
+
+// glibc only declares SEEK_DATA along with its other extensions
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include "virtualStorage.h"
+#include "storageBatch.h"
+#include "storageCache.h"
+#include "storageJournal.h"
+#include "virtualLock.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Windows compatibility
 #ifdef _MSC_VER
 #include <BaseTsd.h>
-#include <stdio.h>
 #include <sys/stat.h>
 #include <io.h>
+#include <intrin.h>
 #define S_IRUSR S_IREAD
 #define S_IWUSR S_IWRITE
+#define ftruncate _chsize_s
+#define sync_file _commit
+
+static int count_trailing_zeros(uint64_t word)
+{
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (int)index;
+}
+
+#define count_set_bits(word) (int)__popcnt64(word)
+
+// Aligned volatile words are read and written atomically by MSVC
+typedef volatile size_t shared_counter;
+
+// Windows has no positional reads and writes, so they are emulated with a
+// seek followed by a read or write. The file offset is not used by anything
+// else, but it's shared by all threads, so the seek and the transfer are done
+// together under a lock
+static virtual_lock file_offset_lock_ = VIRTUAL_LOCK_INITIALIZER;
+
+static int pread(int file, void* buffer, size_t n_bytes, __int64 position)
+{
+    lock_for_writing(&file_offset_lock_);
+
+    _lseeki64(file, position, SEEK_SET);
+    int result = _read(file, buffer, (unsigned int)n_bytes);
+
+    unlock_for_writing(&file_offset_lock_);
+
+    return result;
+}
+
+static int pwrite(int file, const void* buffer, size_t n_bytes,
+                  __int64 position)
+{
+    lock_for_writing(&file_offset_lock_);
+
+    _lseeki64(file, position, SEEK_SET);
+    int result = _write(file, buffer, (unsigned int)n_bytes);
+
+    unlock_for_writing(&file_offset_lock_);
+
+    return result;
+}
+
+static __int64 preadv(int file, const struct iovec* parts, int part_count,
+                      __int64 position)
+{
+    __int64 n_bytes = 0;
+
+    for (int i = 0; i < part_count; i++)
+    {
+        int result = pread(file, parts[i].iov_base, parts[i].iov_len,
+                           position);
+
+        if (result == -1)
+        {
+            return -1;
+        }
+
+        n_bytes += result;
+        position += parts[i].iov_len;
+    }
+
+    return n_bytes;
+}
+
+static void pwritev(int file, const struct iovec* parts, int part_count,
+                    __int64 position)
+{
+    for (int i = 0; i < part_count; i++)
+    {
+        pwrite(file, parts[i].iov_base, parts[i].iov_len, position);
+        position += parts[i].iov_len;
+    }
+}
 #else
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #define O_BINARY 0
+typedef atomic_size_t shared_counter;
+#define count_trailing_zeros(word) __builtin_ctzll(word)
+#define count_set_bits(word) __builtin_popcountll(word)
+
+// fdatasync() skips syncing file metadata that reads don't need, but not
+// every platform has it
+#ifdef __linux__
+#define sync_file fdatasync
+#else
+#define sync_file fsync
+#endif
 #endif
 
-#define STORAGE_PATH "./virtualStorage"
-#define DEFAULT_BLOCK_SIZE 10
-#define DEFAULT_BLOCK_COUNT 128
-#define FIRST_BLOCK_POSITION 4
-
-typedef unsigned short block_index;
+#define DEFAULT_STORAGE_PATH "./virtualStorage"
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_BLOCK_COUNT 1024
+#define DEFAULT_GROWTH_PERCENT 50
+#define DEFAULT_MIN_GROWTH_BLOCKS 64
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE (1024 * 1024)
+
+// Storage files made before the format version was added start with a 2-byte
+// block size and a 2-byte block count. Newer files start with a zero in place
+// of the block size, which is never valid in the original format, followed by
+// the format version. Format 2 still uses 2-byte block indices like the
+// original format, format 3 uses 4-byte block indices. Format 4 adds a flags
+// field to the header, and its only flag moves the block headers out of the
+// blocks into a table of their own
+#define LEGACY_FORMAT_VERSION 1
+#define NARROW_INDEX_FORMAT_VERSION 2
+#define WIDE_INDEX_FORMAT_VERSION 3
+#define CURRENT_FORMAT_VERSION 4
+#define LEGACY_HEADER_SIZE 4
+#define UNFLAGGED_HEADER_SIZE 12
+#define HEADER_SIZE 16
+#define HEADER_TABLE_FLAG 1
+#define PAYLOAD_AREA_ALIGNMENT 4096
+#define NARROW_BLOCK_INDEX_SIZE 2
+#define WIDE_BLOCK_INDEX_SIZE 4
+#define NARROW_INVALID_BLOCK 65535
+#define MAX_BLOCK_COUNT 0xFFFFFFFE
+#define BITMAP_WORD_BITS 64
+#define HEADER_LOAD_CHUNK_SIZE 65536
+#define MAX_BLOCKS_PER_HOST_IO 256
+#define MAX_HOST_PARTS 1024
+#define BLOCK_HEADER_MAX_SIZE 16
+#define HEADERS_PER_WRITE 256
+#define BLOCK_MAP_INITIAL_CAPACITY 16
+#define LINK_CHUNK_BITS 16
+#define LINK_CHUNK_SIZE ((size_t)1 << LINK_CHUNK_BITS)
+#define LINK_CHUNK_COUNT (((size_t)MAX_BLOCK_COUNT >> LINK_CHUNK_BITS) + 1)
+#define HOLE_ALIGNMENT 4096
+#define MAX_PENDING_HOLES 256
+#define HOLE_BATCH_BYTES (1024 * 1024)
+
+// Block indices are always 4 bytes in memory regardless of how many bytes
+// they take in the storage file. The in-memory headers don't need anything
+// wider, which keeps them small
+typedef uint32_t block_index;
 
 const char BLOCK_NOT_IN_USE_INDICATOR = 0;
 const char BLOCK_IN_USE_INDICATOR = 1;
 const block_index INVALID_BLOCK = INVALID_REGION;
-const char BLOCK_HEADER_SIZE = sizeof(char) + sizeof(block_index) * 2;
 
 typedef struct block_info
 {
@@ -46,25 +258,220 @@ typedef struct block_info
     block_index next_block;
 } block_info;
 
-int storage_file_ = -1;
-
-unsigned short active_block_size_ = 0;
-unsigned short active_block_count_ = 0;
+// In-memory part of a block header. Whether the block is in use is kept in
+// the free block bitmap instead
+typedef struct block_links
+{
+    block_index previous_block;
+    block_index next_block;
+} block_links;
 
-block_index current_block_index_ = 0;
-size_t current_block_position_ = 0;
-size_t current_region_position_ = 0;
+// Adjacent blocks, from the first block up to but not including the end block
+typedef struct block_run
+{
+    block_index first_block;
+    block_index end_block;
+} block_run;
 
-block_info current_block_;
+// Blocks of a region in order, as far as they have been needed so far. The
+// generation tells whether blocks have been freed since the map was filled in
+typedef struct block_map
+{
+    storage_region region;
+    size_t generation;
+    block_index* blocks;
+    size_t block_count;
+    size_t capacity;
+} block_map;
+
+// Position in the caller's buffers during a read or write
+typedef struct part_position
+{
+    const struct iovec* parts;
+    int part;
+    size_t part_offset;
+} part_position;
 
-void create_storage_file(unsigned short block_size,
-                         unsigned short block_count);
+struct storage_cursor
+{
+    block_index block;
+    size_t block_position;
+    size_t region_position;
+    block_map map;
+};
 
-block_index allocate_block(block_index previous_block);
-void jump_to_block(block_index block);
-void read_block_header();
+int storage_file_ = -1;
+size_t open_count_ = 0;
+
+storage_backend active_backend_ = STORAGE_BACKEND_FILE;
+
+// Mapping of the whole storage file when the memory-mapped backend is used
+char* storage_map_ = NULL;
+size_t storage_map_size_ = 0;
+
+size_t active_block_size_ = 0;
+shared_counter active_block_count_ = 0;
+
+// Where the block count is in the storage header, and how many bytes it takes
+off_t block_count_field_position_ = 0;
+size_t block_count_field_size_ = 0;
+
+// Size of a block index and a block header in the storage file
+size_t block_index_size_ = 0;
+size_t block_header_size_ = 0;
+
+// Start of the block area and the distance between consecutive blocks in it.
+// With a header table the block area only holds the payloads of the blocks,
+// otherwise each block's header is right in front of its payload
+off_t first_block_position_ = 0;
+size_t block_stride_ = 0;
+bool header_table_ = false;
+off_t header_table_position_ = 0;
+
+// Links of block i are entry i % LINK_CHUNK_SIZE of chunk i / LINK_CHUNK_SIZE
+block_links* block_link_chunks_[LINK_CHUNK_COUNT] = { NULL };
+
+storage_cursor default_cursor_ = { 0 };
+
+// Increased whenever blocks are freed, which may leave block maps pointing to
+// blocks that no longer belong to their region
+shared_counter block_map_generation_ = 0;
+
+// One bit per block, set if the block is free. Kept in sync with the usage
+// markers on disk so that allocation never has to read block headers
+uint64_t* free_blocks_ = NULL;
+size_t free_blocks_word_count_ = 0;
+
+storage_allocation_policy allocation_policy_ = STORAGE_ALLOCATE_BEST_FIT;
+storage_growth_policy growth_policy_ = { DEFAULT_GROWTH_PERCENT,
+                                         DEFAULT_MIN_GROWTH_BLOCKS, 0 };
+block_index next_fit_position_ = 0;
+
+// Freed runs of blocks that haven't been punched out of the storage file yet
+bool hole_punching_ = false;
+block_run pending_holes_[MAX_PENDING_HOLES];
+size_t pending_hole_count_ = 0;
+size_t pending_hole_blocks_ = 0;
+
+// Journaling state. The number of transactions that have ended since the
+// last commit is guarded by the transaction lock, the bitmaps and the flag of
+// copies waiting for the commit by the allocation lock
+bool journaling_ = false;
+size_t journal_group_size_ = 0;
+size_t ended_transactions_ = 0;
+bool unjournaled_copies_ = false;
+
+// One bit per block in each: set if the block's header has changed since the
+// last commit, or if the block was freed by a transaction since then
+uint64_t* pending_headers_ = NULL;
+uint64_t* released_blocks_ = NULL;
+size_t journal_bitmap_word_count_ = 0;
+
+virtual_lock allocation_lock_ = VIRTUAL_LOCK_INITIALIZER;
+virtual_lock map_lock_ = VIRTUAL_LOCK_INITIALIZER;
+virtual_lock transaction_lock_ = VIRTUAL_LOCK_INITIALIZER;
+
+// Depth of the transactions the calling thread is in
+THREAD_LOCAL int transaction_depth_ = 0;
+
+// Batch that reads of the calling thread are added to, if it has started one
+THREAD_LOCAL storage_batch* thread_batch_ = NULL;
+
+// Block headers between the payloads of a read are read into this buffer and
+// ignored. It belongs to the thread so that batched reads can still fill it
+// after the read that added them has returned
+THREAD_LOCAL char ignored_headers_[BLOCK_HEADER_MAX_SIZE];
+
+int create_storage_file(const char* path, size_t block_size,
+                        size_t block_count, bool header_table);
+int read_storage_header();
+off_t payload_area_position(size_t block_count, size_t block_header_size);
+int map_storage_file();
+void unmap_storage_file();
+void sync_storage_file();
+int resize_storage_file(size_t size);
+void backend_read(off_t position, void* buffer, size_t n_bytes);
+void backend_write(off_t position, const void* buffer, size_t n_bytes);
+void backend_read_parts(off_t position, const struct iovec* parts,
+                        int part_count);
+int read_batched_parts(off_t position, const struct iovec* parts,
+                       int part_count);
+void backend_write_parts(off_t position, const struct iovec* parts,
+                         int part_count);
+void read_storage(off_t position, void* buffer, size_t n_bytes);
+void write_storage(off_t position, const void* buffer, size_t n_bytes);
+void read_storage_parts(off_t position, const struct iovec* parts,
+                        int part_count);
+bool batching_reads(off_t position);
+void write_storage_parts(off_t position, const struct iovec* parts,
+                         int part_count);
+void read_storage_in_place(off_t position, const struct iovec* parts,
+                           int part_count);
+void write_storage_in_place(off_t position, const void* buffer,
+                            size_t n_bytes);
+bool staging_writes(off_t position);
+int commit_journal();
+int resize_journal_bitmaps(size_t block_count);
+void free_journal_bitmaps();
+void mark_headers_pending(block_index first_block, size_t count);
+bool headers_pending(block_index first_block, size_t count);
+bool links_pending(block_index first_block, size_t count);
+int load_block_headers(bool new_file);
+int reserve_block_links(size_t old_block_count, size_t new_block_count);
+void free_block_links();
+block_links* links_of(block_index block);
+int resize_free_block_bitmap(size_t block_count);
+int grow_storage(size_t wanted_blocks);
+void write_block_count(size_t block_count);
+size_t max_grown_block_count();
+off_t next_data_position(off_t position);
+void mark_block_free(block_index block);
+void mark_block_used(block_index block);
+bool block_is_free(block_index block);
+size_t find_next_free_block(size_t block);
+size_t find_next_used_block(size_t block);
+size_t find_last_used_block();
+void free_block_chain(block_index block);
+void add_pending_hole(block_index first_block, size_t count);
+void punch_pending_holes();
+void punch_free_blocks(block_index first_block, block_index end_block);
+void punch_hole(off_t position, off_t n_bytes);
+int compare_block_runs(const void* first, const void* second);
+int copy_region_blocks(block_index previous_block, block_index first_block,
+                       block_index target_block, size_t count);
+
+block_index find_free_run(block_index previous_block, size_t wanted_blocks,
+                          size_t* run_length);
+block_index allocate_extent(block_index previous_block, size_t wanted_blocks);
+size_t transfer_parts(storage_cursor* cursor, const struct iovec* parts,
+                      int part_count, bool write);
+size_t transfer_adjacent_blocks(storage_cursor* cursor,
+                                part_position* caller_parts, size_t n_bytes,
+                                bool write);
+int add_caller_parts(part_position* caller_parts, size_t n_bytes,
+                     struct iovec* host_parts, int host_part_count,
+                     size_t* added_bytes);
+void encode_block_index(char* bytes, block_index block);
+block_index decode_block_index(const char* bytes);
+void encode_block_header(char* bytes, const block_info* header);
+void decode_block_header(const char* bytes, block_info* header);
+void encode_block_headers(char* bytes, block_index first_block, size_t count);
+void write_block_headers(block_index first_block, size_t count);
+off_t header_position(block_index block);
+off_t payload_position(block_index block);
+off_t cursor_position(const storage_cursor* cursor);
+void move_cursor_to_block(storage_cursor* cursor, block_index block);
+void move_cursor_to_position(storage_cursor* cursor, size_t position);
+block_index find_mapped_block(block_map* map, size_t logical_block);
 
 int storage_initialize()
+{
+    storage_options options = storage_default_options();
+
+    return storage_initialize_with(&options);
+}
+
+int storage_initialize_with(const storage_options* options)
 {
     if (storage_initialized())
     {
@@ -72,14 +479,29 @@ int storage_initialize()
     }
 
     // Try to open existing storage file
-    storage_file_ = open(STORAGE_PATH, O_RDWR | O_BINARY);
+    storage_file_ = open(options->path, O_RDWR | O_BINARY);
+    bool new_file = storage_file_ == -1;
 
-    if (storage_file_ == -1)
+    if (new_file)
     {
-        // Opening existing file failed, try to create a new one
-        create_storage_file(DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT);
+        // Opening existing file failed, try to create a new one with the
+        // given block size and count. An existing file keeps its own
+        if (options->block_size < MIN_BLOCK_SIZE
+            || options->block_size > MAX_BLOCK_SIZE
+            || options->block_count < 1
+            || options->block_count > MAX_BLOCK_COUNT)
+        {
+            return -1;
+        }
+
+        if (create_storage_file(options->path, options->block_size,
+                                options->block_count,
+                                options->header_table) == -1)
+        {
+            return -1;
+        }
 
-        storage_file_ = open(STORAGE_PATH, O_RDWR | O_BINARY);
+        storage_file_ = open(options->path, O_RDWR | O_BINARY);
 
         if (storage_file_ == -1)
         {
@@ -88,308 +510,2586 @@ int storage_initialize()
         }
     }
 
-    // Read storage file header to update active block size and count
-    read(storage_file_, &active_block_size_, sizeof(unsigned short));
-    read(storage_file_, &active_block_count_, sizeof(unsigned short));
+    active_backend_ = options->backend;
+    hole_punching_ = options->punch_holes;
+    journaling_ = options->journal_group_size > 0;
+    journal_group_size_ = options->journal_group_size;
+
+    // A group that was committed before a crash is written again before
+    // anything is read from the storage file, even if journaling is now
+    // disabled
+    if ((active_backend_ == STORAGE_BACKEND_MMAP && map_storage_file() == -1)
+        || journal_open(options->path, journaling_, new_file,
+                        write_storage_in_place, sync_storage_file) == -1
+        || read_storage_header() == -1 || load_block_headers(new_file) == -1
+        || cache_initialize(options->cache_block_count, first_block_position_,
+                            block_stride_, backend_read, backend_write) == -1)
+    {
+        journal_close();
+        journaling_ = false;
+        unmap_storage_file();
+        close(storage_file_);
+        storage_file_ = -1;
+
+        free(free_blocks_);
+        free_blocks_ = NULL;
+        free_blocks_word_count_ = 0;
+        next_fit_position_ = 0;
+
+        free_journal_bitmaps();
+        free_block_links();
+
+        return -1;
+    }
+
+    open_count_++;
 
     return 0;
 }
 
+void storage_close()
+{
+    if (!storage_initialized())
+    {
+        return;
+    }
+
+    if (journaling_)
+    {
+        lock_for_writing(&transaction_lock_);
+        commit_journal();
+        unlock_for_writing(&transaction_lock_);
+
+        journal_close();
+        journaling_ = false;
+    }
+
+    lock_for_writing(&allocation_lock_);
+    punch_pending_holes();
+    unlock_for_writing(&allocation_lock_);
+
+    cache_flush();
+    cache_finalize();
+
+    unmap_storage_file();
+    close(storage_file_);
+    storage_file_ = -1;
+
+    free(free_blocks_);
+    free_blocks_ = NULL;
+    free_blocks_word_count_ = 0;
+    next_fit_position_ = 0;
+
+    free_journal_bitmaps();
+    free_block_links();
+
+    // Cursors can outlive the storage, but their block maps can't be used
+    // with a storage file that is opened later
+    block_map_generation_++;
+}
+
+storage_options storage_default_options()
+{
+    return (storage_options) { DEFAULT_STORAGE_PATH, DEFAULT_BLOCK_SIZE,
+                               DEFAULT_BLOCK_COUNT, STORAGE_BACKEND_FILE, 0,
+                               false, false, 0 };
+}
+
+int storage_flush()
+{
+    int result = 0;
+
+    if (storage_initialized())
+    {
+        // A thread in a transaction can't commit its own group
+        if (journaling_ && transaction_depth_ == 0)
+        {
+            lock_for_writing(&transaction_lock_);
+            result = commit_journal();
+            unlock_for_writing(&transaction_lock_);
+        }
+
+        lock_for_writing(&allocation_lock_);
+        punch_pending_holes();
+        unlock_for_writing(&allocation_lock_);
+
+        sync_storage_file();
+    }
+
+    return result;
+}
+
+storage_cache_statistics storage_get_cache_statistics()
+{
+    return cache_statistics();
+}
+
 bool storage_initialized()
 {
     return storage_file_ != -1;
 }
 
-storage_region storage_allocate_region()
+void storage_begin_transaction()
 {
-    if (!storage_initialized())
+    if (!journaling_)
     {
-        return INVALID_REGION;
+        return;
     }
 
-    // Region IDs are actually just the first block's index in the region
-    return allocate_block(INVALID_BLOCK);
+    if (transaction_depth_++ == 0)
+    {
+        lock_for_writing(&transaction_lock_);
+    }
 }
 
-int storage_free_region(storage_region region)
+int storage_end_transaction()
 {
-    if (!storage_initialized())
+    // A transaction begun before the storage was initialized never took the
+    // lock
+    if (transaction_depth_ == 0 || --transaction_depth_ > 0)
     {
-        return -1;
+        return 0;
     }
 
-    block_index next_block = region;
+    int result = 0;
 
-    // Free all the blocks in this region
-    while (next_block != INVALID_BLOCK)
+    if (++ended_transactions_ >= journal_group_size_)
     {
-        jump_to_block(next_block);
-        next_block = current_block_.next_block;
-
-        // Overwrite the block's header to mark it as unused: the actual data
-        // does not need to be deleted. The block can later be reallocated and
-        // filled with other data
-        lseek(storage_file_, -BLOCK_HEADER_SIZE, SEEK_CUR);
-        write(storage_file_, &BLOCK_NOT_IN_USE_INDICATOR, sizeof(char));
-        write(storage_file_, &INVALID_BLOCK, sizeof(block_index));
-        write(storage_file_, &INVALID_BLOCK, sizeof(block_index));
+        result = commit_journal();
     }
 
-    return 0;
+    unlock_for_writing(&transaction_lock_);
+
+    return result;
 }
 
-int storage_jump_to_region(storage_region region)
+size_t storage_open_count()
+{
+    return open_count_;
+}
+
+void storage_set_allocation_policy(storage_allocation_policy policy)
+{
+    lock_for_writing(&allocation_lock_);
+    allocation_policy_ = policy;
+    unlock_for_writing(&allocation_lock_);
+}
+
+storage_growth_policy storage_default_growth_policy()
+{
+    return (storage_growth_policy) { DEFAULT_GROWTH_PERCENT,
+                                     DEFAULT_MIN_GROWTH_BLOCKS, 0 };
+}
+
+void storage_set_growth_policy(storage_growth_policy policy)
+{
+    lock_for_writing(&allocation_lock_);
+    growth_policy_ = policy;
+    unlock_for_writing(&allocation_lock_);
+}
+
+size_t storage_block_size()
+{
+    return active_block_size_;
+}
+
+size_t storage_block_count()
+{
+    return active_block_count_;
+}
+
+size_t storage_free_block_count()
 {
     if (!storage_initialized())
     {
-        return -1;
+        return 0;
     }
 
-    // Region IDs are actually just the first block's index in the region
-    jump_to_block(region);
+    size_t free_block_count = 0;
 
-    current_region_position_ = 0;
+    lock_for_reading(&allocation_lock_);
 
-    return 0;
+    for (size_t word = 0; word < free_blocks_word_count_; word++)
+    {
+        free_block_count += count_set_bits(free_blocks_[word]);
+    }
+
+    unlock_for_reading(&allocation_lock_);
+
+    return free_block_count;
 }
 
-size_t storage_read_in_region(void* buffer, size_t n_bytes)
+storage_region storage_allocate_region()
 {
     if (!storage_initialized())
     {
-        return 0;
+        return INVALID_REGION;
     }
 
-    size_t read_bytes = 0;
+    // Region IDs are actually just the first block's index in the region
+    lock_for_writing(&allocation_lock_);
+    storage_region region = allocate_extent(INVALID_BLOCK, 1);
+    unlock_for_writing(&allocation_lock_);
+
+    return region;
+}
 
-    // While the amount of bytes to read exceeds the amount of bytes remaining
-    // in the current block
-    while (current_block_position_ + n_bytes - read_bytes >= active_block_size_)
+int storage_free_region(storage_region region)
+{
+    if (!storage_initialized())
     {
-        // Read the rest of the bytes in this block and then jump to the next
-        // block
-        int bytes_to_read = active_block_size_ - current_block_position_;
-        read(storage_file_, (char*)buffer + read_bytes, bytes_to_read);
-        read_bytes += bytes_to_read;
+        return -1;
+    }
 
-        if (current_block_.next_block == INVALID_BLOCK)
-        {
-            return read_bytes;
-        }
+    lock_for_writing(&allocation_lock_);
+    free_block_chain(region);
+    unlock_for_writing(&allocation_lock_);
+
+    return 0;
+}
 
-        jump_to_block(current_block_.next_block);
+int storage_truncate_region(storage_region region)
+{
+    if (!storage_initialized() || region >= active_block_count_)
+    {
+        return -1;
     }
 
-    // The remaining bytes to read are in the current block, no more jumping is
-    // needed. Read them and finish
-    read(storage_file_, (char*)buffer + read_bytes, n_bytes - read_bytes);
+    // The first block stays so that the region keeps its ID
+    lock_for_writing(&allocation_lock_);
 
-    current_block_position_ += n_bytes - read_bytes;
-    current_region_position_ += n_bytes;
+    block_index next_block = links_of(region)->next_block;
 
-    return n_bytes;
+    if (next_block != INVALID_BLOCK)
+    {
+        links_of(region)->next_block = INVALID_BLOCK;
+        write_block_headers(region, 1);
+        free_block_chain(next_block);
+    }
+
+    unlock_for_writing(&allocation_lock_);
+
+    return 0;
 }
 
-size_t storage_write_in_region(void* buffer, size_t n_bytes)
+int storage_shrink()
 {
-    if (!storage_initialized())
+    if (!storage_initialized() || header_table_)
     {
-        return 0;
+        return -1;
     }
 
-    size_t written_bytes = 0;
-
-    // While the amount of bytes to write exceeds the amount of bytes remaining
-    // in the current block
-    while (current_block_position_ + n_bytes - written_bytes
-           >= active_block_size_)
+    // Blocks released by the commit may be cut off too, and pending headers
+    // must not be written past the new end of the file. No transaction can
+    // leave more of them until the file has been cut
+    if (journaling_)
     {
-        // Overwrite the rest of the bytes in this block and then jump to the
-        // next block
-        int bytes_to_write = active_block_size_ - current_block_position_;
-        write(storage_file_, (char*)buffer + written_bytes, bytes_to_write);
-        written_bytes += bytes_to_write;
+        lock_for_writing(&transaction_lock_);
 
-        if (current_block_.next_block != INVALID_BLOCK)
+        if (commit_journal() == -1)
         {
-            jump_to_block(current_block_.next_block);
+            unlock_for_writing(&transaction_lock_);
+
+            return -1;
         }
-        else
-        {
-            // If there is no next block, allocate a new one
-            block_index current_block = current_block_index_;
-            block_index new_block = allocate_block(current_block_index_);
+    }
 
-            if (new_block == INVALID_BLOCK)
-            {
-                // Failed to allocate block: out of storage space. Stop writing
-                return written_bytes;
-            }
+    lock_for_writing(&allocation_lock_);
 
-            jump_to_block(current_block);
+    // Pending holes may lie in the part that is cut off
+    punch_pending_holes();
 
-            // Update the current block's header to point to the new block
-            lseek(storage_file_,
-                  -BLOCK_HEADER_SIZE + sizeof(char) + sizeof(block_index),
-                  SEEK_CUR);
-            write(storage_file_, &new_block, sizeof(block_index));
+    size_t old_block_count = active_block_count_;
+    size_t new_block_count = find_last_used_block() + 1;
+
+    if (new_block_count == old_block_count)
+    {
+        unlock_for_writing(&allocation_lock_);
 
-            jump_to_block(new_block);
+        if (journaling_)
+        {
+            unlock_for_writing(&transaction_lock_);
         }
+
+        return 0;
     }
 
-    // The remaining bytes to write fit in the current block, no more jumping is
-    // needed. Write them and finish
-    write(storage_file_, (char*)buffer + written_bytes, n_bytes - written_bytes);
+    // The header stops counting the blocks before the file is cut, so the
+    // header never counts blocks the file doesn't have. Cached copies of the
+    // blocks that are cut off must not be written back
+    write_block_count(new_block_count);
 
-    current_block_position_ += n_bytes - written_bytes;
-    current_region_position_ += n_bytes;
+    off_t new_end = first_block_position_
+        + (off_t)block_stride_ * new_block_count;
 
-    return n_bytes;
-}
+    cache_discard(new_end, block_stride_ * (old_block_count - new_block_count));
 
-size_t storage_seek_in_region(off_t offset)
-{
-    if (!storage_initialized())
+    lock_for_writing(&map_lock_);
+    int result = resize_storage_file(new_end);
+    unlock_for_writing(&map_lock_);
+
+    // Bits past the last block are never set
+    for (size_t block = new_block_count; block < old_block_count; block++)
     {
-        return current_region_position_;
+        mark_block_used(block);
     }
 
-    off_t sought_bytes = 0;
+    free_blocks_word_count_ =
+        (new_block_count + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    active_block_count_ = new_block_count;
 
-    // This function can only seek from the current position
-    if (offset > 0)
+    // The journal bitmaps were cleared by the commit, and shrink with the
+    // free block bitmap so that growing resizes them together again
+    if (journaling_)
     {
-        // While the amount of bytes to seek exceeds the amount of bytes
-        // remaining in the current block
-        while (current_block_position_ + offset - sought_bytes
-            >= active_block_size_)
-        {
-            // Jump to the next block
-            sought_bytes += active_block_size_ - current_block_position_;
+        journal_bitmap_word_count_ = free_blocks_word_count_;
+    }
 
-            jump_to_block(current_block_.next_block);
-        }
+    if (next_fit_position_ >= new_block_count)
+    {
+        next_fit_position_ = 0;
+    }
 
-        // The final position is in the current block: seek there and finish
-        lseek(storage_file_, offset - sought_bytes, SEEK_CUR);
-        current_block_position_ += offset - sought_bytes;
+    unlock_for_writing(&allocation_lock_);
+
+    if (journaling_)
+    {
+        unlock_for_writing(&transaction_lock_);
     }
-    else if (offset < 0)
+
+    return result;
+}
+
+double storage_fragmentation()
+{
+    if (!storage_initialized())
     {
-        // While the amount of bytes to skip exceeds the amount of bytes
-        // remaining in the current block
-        while (current_block_position_ + offset - sought_bytes < 0)
-        {
-            // Jump to the previous block
-            sought_bytes -= current_block_position_ + 1;
+        return 0;
+    }
 
-            jump_to_block(current_block_.previous_block);
+    size_t link_count = 0;
+    size_t broken_link_count = 0;
 
-            lseek(storage_file_, active_block_size_ - 1, SEEK_CUR);
-            current_block_position_ = active_block_size_ - 1;
-        }
+    lock_for_reading(&allocation_lock_);
+
+    for (size_t block = find_next_used_block(0); block < active_block_count_;
+         block = find_next_used_block(block + 1))
+    {
+        block_index next_block = links_of(block)->next_block;
 
-        // The final position is in the current block: seek there and finish
-        lseek(storage_file_, offset - sought_bytes, SEEK_CUR);
-        current_block_position_ += offset - sought_bytes;
+        if (next_block != INVALID_BLOCK)
+        {
+            link_count++;
+            broken_link_count += next_block != block + 1;
+        }
     }
 
-    current_region_position_ += offset;
+    unlock_for_reading(&allocation_lock_);
 
-    return current_region_position_;
+    return link_count > 0 ? (double)broken_link_count / link_count : 0;
 }
 
-void create_storage_file(unsigned short block_size,
-                         unsigned short block_count)
+storage_region storage_relocate_region(storage_region region, bool keep_id,
+                                       size_t* moved_blocks)
 {
-    // Create an empty storage file for virtual storage. O_BINARY is a Windows-
-    // specific modifier needed so that Windows does not treat the file as text
-    // and automatically add line endings that would break the file structure
-    int file = open(
-        STORAGE_PATH, O_CREAT | O_EXCL | O_BINARY | O_WRONLY, S_IRUSR | S_IWUSR);
-
-    if (file == -1)
+    if (!storage_initialized() || region >= active_block_count_)
     {
-        return;
+        return INVALID_REGION;
     }
 
-    // Write header
-    write(file, &block_size, sizeof(unsigned short));
-    write(file, &block_count, sizeof(unsigned short));
-
-    char* zeroChars = (char*)malloc(block_size);
-    memset(zeroChars, 0, block_size);
+    lock_for_writing(&allocation_lock_);
 
-    // Write reserved empty first block
-    write(file, &BLOCK_IN_USE_INDICATOR, sizeof(char));
-    write(file, &INVALID_BLOCK, sizeof(block_index));
-    write(file, &INVALID_BLOCK, sizeof(block_index));
-    write(file, zeroChars, block_size);
+    // Count the blocks of the region, and how many of them follow the first
+    // block without a gap
+    size_t block_count = 0;
+    size_t contiguous_count = 0;
 
-    // Write the remaining empty blocks
-    for (int i = 1; i < block_count; i++)
+    for (block_index block = region; block != INVALID_BLOCK;
+         block = links_of(block)->next_block)
     {
-        write(file, &BLOCK_NOT_IN_USE_INDICATOR, sizeof(char));
-        write(file, &INVALID_BLOCK, sizeof(block_index));
-        write(file, &INVALID_BLOCK, sizeof(block_index));
-        write(file, zeroChars, block_size);
+        if (contiguous_count == block_count && block == region + block_count)
+        {
+            contiguous_count++;
+        }
+
+        block_count++;
     }
 
-    free(zeroChars);
+    storage_region relocated_region = region;
+    block_index tail_start = region + contiguous_count;
+    size_t tail_count = block_count - contiguous_count;
 
-    close(file);
-}
+    if (tail_count > 0 && tail_start + tail_count <= active_block_count_
+        && find_next_used_block(tail_start) >= tail_start + tail_count)
+    {
+        // The rest of the region fits right after its contiguous start. The
+        // blocks it leaves are freed here, as nothing else refers to them
+        block_index last_block = tail_start - 1;
+        block_index old_tail = links_of(last_block)->next_block;
 
-block_index allocate_block(block_index previous_block)
-{
-    block_index inspected_block_index = 0;
+        if (copy_region_blocks(last_block, old_tail, tail_start,
+                               tail_count) == 0)
+        {
+            write_block_headers(last_block, tail_count + 1);
+            free_block_chain(old_tail);
 
-    // Find, reserve and return the first free block by going through them one
-    // at a time. This could be optimized by caching a list of available blocks
-    while (inspected_block_index < active_block_count_)
+            *moved_blocks += tail_count;
+        }
+    }
+    else if (tail_count > 0 && !keep_id)
     {
-        jump_to_block(inspected_block_index);
+        size_t run_length;
+        block_index first_block =
+            find_free_run(INVALID_BLOCK, block_count, &run_length);
 
-        if (!current_block_.in_use)
+        if (first_block != INVALID_BLOCK && run_length >= block_count
+            && copy_region_blocks(INVALID_BLOCK, region, first_block,
+                                  block_count) == 0)
         {
-            // Set header data of new block
-            lseek(storage_file_, -BLOCK_HEADER_SIZE, SEEK_CUR);
-            write(storage_file_, &BLOCK_IN_USE_INDICATOR, sizeof(char));
-            write(storage_file_, &previous_block, sizeof(block_index));
-            write(storage_file_, &INVALID_BLOCK, sizeof(block_index));
+            write_block_headers(first_block, block_count);
 
-            return inspected_block_index;
+            relocated_region = first_block;
+            *moved_blocks += block_count;
         }
+    }
+
+    unlock_for_writing(&allocation_lock_);
+
+    return relocated_region;
+}
 
-        inspected_block_index++;
+storage_cursor* storage_create_cursor()
+{
+    storage_cursor* cursor = calloc(1, sizeof(storage_cursor));
+
+    if (cursor == NULL)
+    {
+        return NULL;
     }
 
-    // Went through every block and none were available: out of storage space
-    return INVALID_BLOCK;
+    cursor->map.region = INVALID_REGION;
+
+    return cursor;
 }
 
-void jump_to_block(block_index block)
+void storage_destroy_cursor(storage_cursor* cursor)
 {
-    if (block >= active_block_count_)
+    if (cursor == NULL)
     {
         return;
     }
 
-    lseek(storage_file_, FIRST_BLOCK_POSITION
-          + (active_block_size_ + BLOCK_HEADER_SIZE)
-          * block, SEEK_SET);
+    free(cursor->map.blocks);
+    free(cursor);
+}
+
+size_t storage_region_size()
+{
+    return block_index_size_;
+}
 
-    read_block_header();
+void storage_encode_region_id(char* bytes, storage_region region)
+{
+    encode_block_index(bytes, region);
+}
 
-    current_block_index_ = block;
+storage_region storage_decode_region_id(const char* bytes)
+{
+    return decode_block_index(bytes);
 }
 
-void read_block_header()
+int storage_cursor_jump_to_region(storage_cursor* cursor,
+                                  storage_region region)
 {
-    read(storage_file_, &current_block_.in_use, sizeof(char));
-    read(storage_file_, &current_block_.previous_block, sizeof(block_index));
-    read(storage_file_, &current_block_.next_block, sizeof(block_index));
+    if (!storage_initialized() || cursor == NULL
+        || region >= active_block_count_)
+    {
+        return -1;
+    }
+
+    // Region IDs are actually just the first block's index in the region
+    move_cursor_to_block(cursor, region);
+
+    cursor->region_position = 0;
+
+    // Jumping back to the same region keeps the block map
+    if (cursor->map.region != region)
+    {
+        cursor->map.region = region;
+        cursor->map.block_count = 0;
+    }
+
+    return 0;
+}
+
+size_t storage_cursor_read_region_id(storage_cursor* cursor,
+                                     storage_region* region)
+{
+    char bytes[WIDE_BLOCK_INDEX_SIZE];
+
+    if (storage_cursor_read(cursor, bytes, block_index_size_)
+        != block_index_size_)
+    {
+        *region = INVALID_REGION;
+
+        return 0;
+    }
+
+    *region = decode_block_index(bytes);
+
+    return block_index_size_;
+}
+
+size_t storage_cursor_write_region_id(storage_cursor* cursor,
+                                      storage_region region)
+{
+    char bytes[WIDE_BLOCK_INDEX_SIZE];
+    encode_block_index(bytes, region);
+
+    return storage_cursor_write(cursor, bytes, block_index_size_);
+}
+
+size_t storage_cursor_read(storage_cursor* cursor, void* buffer,
+                           size_t n_bytes)
+{
+    struct iovec part = { buffer, n_bytes };
+
+    return transfer_parts(cursor, &part, 1, false);
+}
+
+size_t storage_cursor_write(storage_cursor* cursor, void* buffer,
+                            size_t n_bytes)
+{
+    struct iovec part = { buffer, n_bytes };
+
+    return transfer_parts(cursor, &part, 1, true);
+}
+
+size_t storage_cursor_readv(storage_cursor* cursor, const struct iovec* parts,
+                            int part_count)
+{
+    return transfer_parts(cursor, parts, part_count, false);
+}
+
+size_t storage_cursor_writev(storage_cursor* cursor, const struct iovec* parts,
+                             int part_count)
+{
+    return transfer_parts(cursor, parts, part_count, true);
+}
+
+size_t storage_cursor_seek(storage_cursor* cursor, off_t offset)
+{
+    if (cursor == NULL)
+    {
+        return 0;
+    }
+
+    if (!storage_initialized())
+    {
+        return cursor->region_position;
+    }
+
+    // Seeking before the start of the region stops at the start
+    if (offset < 0 && (size_t)-offset > cursor->region_position)
+    {
+        offset = -(off_t)cursor->region_position;
+    }
+
+    move_cursor_to_position(cursor, cursor->region_position + offset);
+
+    return cursor->region_position;
+}
+
+storage_batch* storage_create_batch()
+{
+    return batch_create(read_batched_parts);
+}
+
+void storage_destroy_batch(storage_batch* batch)
+{
+    batch_destroy(batch);
+}
+
+void storage_start_batch(storage_batch* batch)
+{
+    thread_batch_ = batch;
+}
+
+void storage_end_batch()
+{
+    if (thread_batch_ == NULL)
+    {
+        return;
+    }
+
+    batch_issue(thread_batch_, storage_file_);
+    batch_report_failures(thread_batch_, NULL);
+    thread_batch_ = NULL;
+}
+
+void storage_issue_batch()
+{
+    if (thread_batch_ != NULL)
+    {
+        batch_issue(thread_batch_, storage_file_);
+    }
+}
+
+void storage_report_batch_failures(bool* failed)
+{
+    if (thread_batch_ != NULL)
+    {
+        batch_report_failures(thread_batch_, failed);
+    }
+}
+
+bool storage_batch_keep_lock(virtual_lock* lock)
+{
+    if (thread_batch_ == NULL)
+    {
+        return false;
+    }
+
+    if (batch_hold_lock(thread_batch_, lock) == -1)
+    {
+        // The reads that need the lock are made before the caller releases
+        // it, and the batch goes on empty
+        batch_issue(thread_batch_, storage_file_);
+
+        return false;
+    }
+
+    return true;
+}
+
+bool storage_batch_holds_lock(const virtual_lock* lock)
+{
+    return thread_batch_ != NULL && batch_holds_lock(thread_batch_, lock);
+}
+
+int storage_jump_to_region(storage_region region)
+{
+    return storage_cursor_jump_to_region(&default_cursor_, region);
+}
+
+size_t storage_read_region_id(storage_region* region)
+{
+    return storage_cursor_read_region_id(&default_cursor_, region);
+}
+
+size_t storage_write_region_id(storage_region region)
+{
+    return storage_cursor_write_region_id(&default_cursor_, region);
+}
+
+size_t storage_read_in_region(void* buffer, size_t n_bytes)
+{
+    return storage_cursor_read(&default_cursor_, buffer, n_bytes);
+}
+
+size_t storage_write_in_region(void* buffer, size_t n_bytes)
+{
+    return storage_cursor_write(&default_cursor_, buffer, n_bytes);
+}
+
+size_t storage_seek_in_region(off_t offset)
+{
+    return storage_cursor_seek(&default_cursor_, offset);
+}
+
+int create_storage_file(const char* path, size_t block_size,
+                        size_t block_count, bool header_table)
+{
+    // Create an empty storage file for virtual storage. O_BINARY is a Windows-
+    // specific modifier needed so that Windows does not treat the file as text
+    // and automatically add line endings that would break the file structure
+    int file = open(
+        path, O_CREAT | O_EXCL | O_BINARY | O_WRONLY, S_IRUSR | S_IWUSR);
+
+    if (file == -1)
+    {
+        return -1;
+    }
+
+    // The file is extended to its full size first, which leaves every block
+    // filled with zeros without writing them. A zero in-use marker means that
+    // a block is free, so only the storage header and the header of the
+    // reserved first block need to be written. The links of free blocks are
+    // never used, so they can stay zero
+    size_t block_header_size = sizeof(char) + WIDE_BLOCK_INDEX_SIZE * 2;
+    off_t file_size = header_table
+        ? payload_area_position(block_count, block_header_size)
+          + (off_t)block_size * block_count
+        : HEADER_SIZE + (off_t)(block_size + block_header_size) * block_count;
+
+    if (ftruncate(file, file_size) != 0)
+    {
+        close(file);
+        remove(path);
+
+        return -1;
+    }
+
+    unsigned short format_marker = 0;
+    unsigned short format_version = CURRENT_FORMAT_VERSION;
+    uint32_t header_block_size = block_size;
+    uint32_t header_block_count = block_count;
+    uint32_t header_flags = header_table ? HEADER_TABLE_FLAG : 0;
+
+    // The first block's header follows the storage header both when it's the
+    // first entry of the header table and when it's in front of the first
+    // block. Invalid block indices have every bit set regardless of their size
+    char header[HEADER_SIZE + sizeof(char) + WIDE_BLOCK_INDEX_SIZE * 2];
+
+    memcpy(header, &format_marker, sizeof(unsigned short));
+    memcpy(header + 2, &format_version, sizeof(unsigned short));
+    memcpy(header + 4, &header_block_size, sizeof(uint32_t));
+    memcpy(header + 8, &header_block_count, sizeof(uint32_t));
+    memcpy(header + 12, &header_flags, sizeof(uint32_t));
+    header[HEADER_SIZE] = BLOCK_IN_USE_INDICATOR;
+    memset(header + HEADER_SIZE + 1, 0xFF, WIDE_BLOCK_INDEX_SIZE * 2);
+
+    write(file, header, sizeof(header));
+    close(file);
+
+    return 0;
+}
+
+int read_storage_header()
+{
+    // Read storage file header to update active block size and count
+    unsigned short legacy_block_size;
+    unsigned short legacy_block_count;
+
+    struct stat file_status;
+
+    if (fstat(storage_file_, &file_status) == -1
+        || file_status.st_size < LEGACY_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    read_storage(0, &legacy_block_size, sizeof(unsigned short));
+    read_storage(sizeof(unsigned short), &legacy_block_count,
+                 sizeof(unsigned short));
+
+    if (legacy_block_size != 0)
+    {
+        active_block_size_ = legacy_block_size;
+        active_block_count_ = legacy_block_count;
+        block_count_field_position_ = sizeof(unsigned short);
+        block_count_field_size_ = sizeof(unsigned short);
+        block_index_size_ = NARROW_BLOCK_INDEX_SIZE;
+        block_header_size_ = sizeof(char) + block_index_size_ * 2;
+        header_table_ = false;
+        first_block_position_ = LEGACY_HEADER_SIZE;
+        block_stride_ = active_block_size_ + block_header_size_;
+
+        return 0;
+    }
+
+    // In newer formats the second field is the format version
+    unsigned short format_version = legacy_block_count;
+
+    off_t header_size = format_version == CURRENT_FORMAT_VERSION
+        ? HEADER_SIZE : UNFLAGGED_HEADER_SIZE;
+
+    if (format_version < NARROW_INDEX_FORMAT_VERSION
+        || format_version > CURRENT_FORMAT_VERSION
+        || file_status.st_size < header_size)
+    {
+        return -1;
+    }
+
+    block_index_size_ = format_version == NARROW_INDEX_FORMAT_VERSION
+        ? NARROW_BLOCK_INDEX_SIZE : WIDE_BLOCK_INDEX_SIZE;
+    block_header_size_ = sizeof(char) + block_index_size_ * 2;
+
+    uint32_t block_size;
+    uint32_t block_count;
+
+    read_storage(sizeof(unsigned short) * 2, &block_size, sizeof(uint32_t));
+    read_storage(sizeof(unsigned short) * 2 + sizeof(uint32_t), &block_count,
+                 sizeof(uint32_t));
+
+    uint32_t flags = 0;
+
+    if (format_version == CURRENT_FORMAT_VERSION)
+    {
+        read_storage(UNFLAGGED_HEADER_SIZE, &flags, sizeof(uint32_t));
+    }
+
+    if (block_size == 0 || block_count > MAX_BLOCK_COUNT
+        || (block_index_size_ == NARROW_BLOCK_INDEX_SIZE
+            && block_count >= NARROW_INVALID_BLOCK)
+        || (flags & ~HEADER_TABLE_FLAG) != 0)
+    {
+        return -1;
+    }
+
+    active_block_size_ = block_size;
+    active_block_count_ = block_count;
+    block_count_field_position_ = sizeof(unsigned short) * 2
+        + sizeof(uint32_t);
+    block_count_field_size_ = sizeof(uint32_t);
+    header_table_ = (flags & HEADER_TABLE_FLAG) != 0;
+
+    if (header_table_)
+    {
+        header_table_position_ = header_size;
+        first_block_position_ =
+            payload_area_position(block_count, block_header_size_);
+        block_stride_ = block_size;
+    }
+    else
+    {
+        first_block_position_ = header_size;
+        block_stride_ = block_size + block_header_size_;
+    }
+
+    return 0;
+}
+
+off_t payload_area_position(size_t block_count, size_t block_header_size)
+{
+    // With a header table the payloads start after the table, at a multiple
+    // of the page size so that block payloads don't share pages with headers
+    off_t table_end = HEADER_SIZE + (off_t)block_header_size * block_count;
+
+    return (table_end + PAYLOAD_AREA_ALIGNMENT - 1)
+        / PAYLOAD_AREA_ALIGNMENT * PAYLOAD_AREA_ALIGNMENT;
+}
+
+int load_block_headers(bool new_file)
+{
+    // All links start out invalid, and only blocks in use get others. On
+    // failure the caller frees the bitmaps and links
+    if (resize_free_block_bitmap(active_block_count_) == -1
+        || resize_journal_bitmaps(active_block_count_) == -1
+        || reserve_block_links(0, active_block_count_) == -1)
+    {
+        return -1;
+    }
+
+    // A header table is read all at once. Otherwise the blocks are read in
+    // large chunks instead of one header at a time, and only the header at
+    // the start of each block is used. The cache is not used yet, so this
+    // reads past it
+    size_t header_stride = header_table_ ? block_header_size_ : block_stride_;
+    size_t blocks_per_chunk = header_table_
+        ? active_block_count_ : HEADER_LOAD_CHUNK_SIZE / block_stride_;
+
+    if (blocks_per_chunk == 0)
+    {
+        blocks_per_chunk = 1;
+    }
+
+    char* chunk = malloc(blocks_per_chunk * header_stride);
+
+    if (chunk == NULL)
+    {
+        return -1;
+    }
+
+    // A storage file that was just created has no blocks in use besides the
+    // first, so there is no need to read its headers
+    if (new_file)
+    {
+        for (size_t i = 1; i < active_block_count_; i++)
+        {
+            mark_block_free(i);
+        }
+
+        free(chunk);
+
+        return 0;
+    }
+
+    off_t data_position = 0;
+
+    for (size_t first = 0; first < active_block_count_;
+         first += blocks_per_chunk)
+    {
+        size_t chunk_blocks = active_block_count_ - first;
+
+        if (chunk_blocks > blocks_per_chunk)
+        {
+            chunk_blocks = blocks_per_chunk;
+        }
+
+        // Parts of the storage file that have never been written are holes
+        // that read as zeros, so their blocks are free without reading them
+        off_t chunk_position = header_position(first);
+
+        if (data_position < chunk_position)
+        {
+            data_position = next_data_position(chunk_position);
+        }
+
+        if (data_position >= chunk_position
+                             + (off_t)(chunk_blocks * header_stride))
+        {
+            for (size_t i = first; i < first + chunk_blocks; i++)
+            {
+                mark_block_free(i);
+            }
+
+            continue;
+        }
+
+        backend_read(header_position(first), chunk,
+                     chunk_blocks * header_stride);
+
+        for (size_t i = 0; i < chunk_blocks; i++)
+        {
+            block_info header;
+            decode_block_header(chunk + i * header_stride, &header);
+
+            // Free blocks may have zeros in place of their links
+            if (!header.in_use)
+            {
+                mark_block_free(first + i);
+
+                continue;
+            }
+
+            links_of(first + i)->previous_block = header.previous_block;
+            links_of(first + i)->next_block = header.next_block;
+        }
+    }
+
+    free(chunk);
+
+    return 0;
+}
+
+int reserve_block_links(size_t old_block_count, size_t new_block_count)
+{
+    // Allocate the chunks that the new blocks fall in, and make their links
+    // invalid. Chunks that already exist are left where they are
+    for (size_t block = old_block_count; block < new_block_count;
+         block = (block / LINK_CHUNK_SIZE + 1) * LINK_CHUNK_SIZE)
+    {
+        size_t chunk = block / LINK_CHUNK_SIZE;
+
+        if (block_link_chunks_[chunk] == NULL)
+        {
+            block_link_chunks_[chunk] =
+                malloc(LINK_CHUNK_SIZE * sizeof(block_links));
+
+            if (block_link_chunks_[chunk] == NULL)
+            {
+                return -1;
+            }
+        }
+    }
+
+    for (size_t block = old_block_count; block < new_block_count; block++)
+    {
+        links_of(block)->previous_block = INVALID_BLOCK;
+        links_of(block)->next_block = INVALID_BLOCK;
+    }
+
+    return 0;
+}
+
+void free_block_links()
+{
+    for (size_t chunk = 0; chunk < LINK_CHUNK_COUNT
+         && block_link_chunks_[chunk] != NULL; chunk++)
+    {
+        free(block_link_chunks_[chunk]);
+        block_link_chunks_[chunk] = NULL;
+    }
+}
+
+block_links* links_of(block_index block)
+{
+    return &block_link_chunks_[block >> LINK_CHUNK_BITS]
+                              [block & (LINK_CHUNK_SIZE - 1)];
+}
+
+int resize_free_block_bitmap(size_t block_count)
+{
+    // New words start with every bit clear, which marks their blocks in use
+    // until they are known to be free. Bits past the last block stay clear
+    size_t word_count = (block_count + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+
+    if (word_count <= free_blocks_word_count_)
+    {
+        return 0;
+    }
+
+    uint64_t* words = realloc(free_blocks_, word_count * sizeof(uint64_t));
+
+    if (words == NULL)
+    {
+        return -1;
+    }
+
+    memset(words + free_blocks_word_count_, 0,
+           (word_count - free_blocks_word_count_) * sizeof(uint64_t));
+
+    free_blocks_ = words;
+    free_blocks_word_count_ = word_count;
+
+    return 0;
+}
+
+int grow_storage(size_t wanted_blocks)
+{
+    // Add blocks to the end of the storage file: by the policy's share of the
+    // current block count, but at least by the minimum and by the number of
+    // blocks wanted, and never beyond the maximum block count
+    size_t old_block_count = active_block_count_;
+    size_t max_block_count = max_grown_block_count();
+
+    if (old_block_count >= max_block_count)
+    {
+        return -1;
+    }
+
+    size_t growth = old_block_count / 100 * growth_policy_.growth_percent
+        + old_block_count % 100 * growth_policy_.growth_percent / 100;
+
+    if (growth < growth_policy_.min_growth_blocks)
+    {
+        growth = growth_policy_.min_growth_blocks;
+    }
+
+    if (growth < wanted_blocks)
+    {
+        growth = wanted_blocks;
+    }
+
+    size_t new_block_count = growth < max_block_count - old_block_count
+        ? old_block_count + growth : max_block_count;
+
+    if (reserve_block_links(old_block_count, new_block_count) == -1
+        || resize_free_block_bitmap(new_block_count) == -1
+        || resize_journal_bitmaps(new_block_count) == -1)
+    {
+        return -1;
+    }
+
+    // The new blocks are holes that read as zeros, which marks them free.
+    // The file is extended before the header counts the new blocks, so the
+    // header never counts blocks the file doesn't have
+    lock_for_writing(&map_lock_);
+    int result = resize_storage_file(first_block_position_
+                                     + (off_t)block_stride_ * new_block_count);
+    unlock_for_writing(&map_lock_);
+
+    if (result == -1)
+    {
+        return -1;
+    }
+
+    write_block_count(new_block_count);
+
+    for (size_t block = old_block_count; block < new_block_count; block++)
+    {
+        mark_block_free(block);
+    }
+
+    active_block_count_ = new_block_count;
+
+    return 0;
+}
+
+void write_block_count(size_t block_count)
+{
+    uint32_t header_block_count = block_count;
+    unsigned short legacy_block_count = block_count;
+
+    write_storage(block_count_field_position_,
+                  block_count_field_size_ == sizeof(uint32_t)
+                  ? (void*)&header_block_count : (void*)&legacy_block_count,
+                  block_count_field_size_);
+}
+
+size_t max_grown_block_count()
+{
+    // With a header table the payloads start right after the table, so the
+    // table has no room for more headers without moving every payload
+    if (header_table_)
+    {
+        return 0;
+    }
+
+    size_t max_block_count = growth_policy_.max_block_count;
+    size_t format_limit = block_index_size_ == NARROW_BLOCK_INDEX_SIZE
+        ? NARROW_INVALID_BLOCK - 1 : MAX_BLOCK_COUNT;
+
+    return max_block_count < format_limit ? max_block_count : format_limit;
+}
+
+off_t next_data_position(off_t position)
+{
+    // Finding holes needs SEEK_DATA, which not every platform has. Without
+    // it, everything is taken to be data
+#ifdef SEEK_DATA
+    off_t data_position = lseek(storage_file_, position, SEEK_DATA);
+
+    if (data_position != -1)
+    {
+        return data_position;
+    }
+
+    // There is no data after the position, or the file system can't tell
+    if (errno == ENXIO)
+    {
+        return lseek(storage_file_, 0, SEEK_END);
+    }
+#endif
+
+    return position;
+}
+
+void mark_block_free(block_index block)
+{
+    free_blocks_[block / BITMAP_WORD_BITS] |=
+        (uint64_t)1 << (block % BITMAP_WORD_BITS);
+}
+
+void mark_block_used(block_index block)
+{
+    free_blocks_[block / BITMAP_WORD_BITS] &=
+        ~((uint64_t)1 << (block % BITMAP_WORD_BITS));
+}
+
+bool block_is_free(block_index block)
+{
+    return (free_blocks_[block / BITMAP_WORD_BITS]
+            >> (block % BITMAP_WORD_BITS)) & 1;
+}
+
+size_t find_next_free_block(size_t block)
+{
+    if (block >= active_block_count_)
+    {
+        return active_block_count_;
+    }
+
+    size_t word = block / BITMAP_WORD_BITS;
+    uint64_t bits = free_blocks_[word]
+        & (~(uint64_t)0 << (block % BITMAP_WORD_BITS));
+
+    while (bits == 0)
+    {
+        if (++word == free_blocks_word_count_)
+        {
+            return active_block_count_;
+        }
+
+        bits = free_blocks_[word];
+    }
+
+    return word * BITMAP_WORD_BITS + count_trailing_zeros(bits);
+}
+
+size_t find_next_used_block(size_t block)
+{
+    if (block >= active_block_count_)
+    {
+        return active_block_count_;
+    }
+
+    size_t word = block / BITMAP_WORD_BITS;
+    uint64_t bits = ~free_blocks_[word]
+        & (~(uint64_t)0 << (block % BITMAP_WORD_BITS));
+
+    while (bits == 0)
+    {
+        if (++word == free_blocks_word_count_)
+        {
+            return active_block_count_;
+        }
+
+        bits = ~free_blocks_[word];
+    }
+
+    // Bits past the last block are never set, so the search may stop there
+    size_t used_block = word * BITMAP_WORD_BITS + count_trailing_zeros(bits);
+
+    return used_block < active_block_count_ ? used_block : active_block_count_;
+}
+
+size_t find_last_used_block()
+{
+    // The first block is always in use, so the search always finds a block
+    size_t word = (active_block_count_ - 1) / BITMAP_WORD_BITS;
+    size_t valid_bits = active_block_count_ - word * BITMAP_WORD_BITS;
+    uint64_t bits = ~free_blocks_[word];
+
+    if (valid_bits < BITMAP_WORD_BITS)
+    {
+        bits &= ((uint64_t)1 << valid_bits) - 1;
+    }
+
+    while (bits == 0 && word > 0)
+    {
+        bits = ~free_blocks_[--word];
+    }
+
+    int highest_bit = BITMAP_WORD_BITS - 1;
+
+    while (highest_bit > 0 && !((bits >> highest_bit) & 1))
+    {
+        highest_bit--;
+    }
+
+    return word * BITMAP_WORD_BITS + highest_bit;
+}
+
+void free_block_chain(block_index block)
+{
+    block_index run_start = block;
+
+    block_map_generation_++;
+
+    // Free all the blocks from this block on by following the in-memory
+    // headers. The headers of adjacent blocks are written out together
+    while (block < active_block_count_)
+    {
+        block_index next_block = links_of(block)->next_block;
+
+        // Mark the block as unused: the actual data does not need to be
+        // deleted. The block can later be reallocated and filled with other
+        // data. A block freed by a transaction is only released at the
+        // commit, as until then a crash would leave it in use
+        links_of(block)->previous_block = INVALID_BLOCK;
+        links_of(block)->next_block = INVALID_BLOCK;
+
+        if (journaling_ && transaction_depth_ > 0)
+        {
+            released_blocks_[block / BITMAP_WORD_BITS] |=
+                (uint64_t)1 << (block % BITMAP_WORD_BITS);
+        }
+        else
+        {
+            mark_block_free(block);
+        }
+
+        if (next_block != block + 1)
+        {
+            write_block_headers(run_start, block - run_start + 1);
+
+            if (!journaling_ || transaction_depth_ == 0)
+            {
+                add_pending_hole(run_start, block - run_start + 1);
+            }
+
+            run_start = next_block;
+        }
+
+        block = next_block;
+    }
+}
+
+void add_pending_hole(block_index first_block, size_t count)
+{
+    if (!hole_punching_)
+    {
+        return;
+    }
+
+    if (pending_hole_count_ == MAX_PENDING_HOLES)
+    {
+        punch_pending_holes();
+    }
+
+    pending_holes_[pending_hole_count_].first_block = first_block;
+    pending_holes_[pending_hole_count_].end_block = first_block + count;
+    pending_hole_count_++;
+    pending_hole_blocks_ += count;
+
+    if (pending_hole_blocks_ * block_stride_ >= HOLE_BATCH_BYTES)
+    {
+        punch_pending_holes();
+    }
+}
+
+void punch_pending_holes()
+{
+    if (pending_hole_count_ == 0)
+    {
+        return;
+    }
+
+    // Runs that touch or overlap are punched together
+    qsort(pending_holes_, pending_hole_count_, sizeof(block_run),
+          compare_block_runs);
+
+    block_run run = pending_holes_[0];
+
+    for (size_t i = 1; i <= pending_hole_count_; i++)
+    {
+        if (i < pending_hole_count_
+            && pending_holes_[i].first_block <= run.end_block)
+        {
+            if (pending_holes_[i].end_block > run.end_block)
+            {
+                run.end_block = pending_holes_[i].end_block;
+            }
+
+            continue;
+        }
+
+        punch_free_blocks(run.first_block, run.end_block);
+
+        if (i < pending_hole_count_)
+        {
+            run = pending_holes_[i];
+        }
+    }
+
+    pending_hole_count_ = 0;
+    pending_hole_blocks_ = 0;
+}
+
+void punch_free_blocks(block_index first_block, block_index end_block)
+{
+    // Free blocks next to the run complete the pages at its ends. Going
+    // further than a page's worth of blocks wouldn't complete any more pages
+    size_t reach = HOLE_ALIGNMENT / block_stride_ + 1;
+
+    for (size_t i = 0; i < reach && first_block > 0
+         && block_is_free(first_block - 1); i++)
+    {
+        first_block--;
+    }
+
+    for (size_t i = 0; i < reach && end_block < active_block_count_
+         && block_is_free(end_block); i++)
+    {
+        end_block++;
+    }
+
+    // Only the blocks that are still free are punched
+    size_t block = find_next_free_block(first_block);
+
+    while (block < end_block)
+    {
+        size_t run_end = find_next_used_block(block);
+
+        if (run_end > end_block)
+        {
+            run_end = end_block;
+        }
+
+        // Only whole pages are punched, so the blocks around the run keep
+        // their contents. Whole blocks inside the hole are dropped from the
+        // cache, as writing them back would fill the hole again
+        off_t start = first_block_position_ + (off_t)block_stride_ * block;
+        off_t end = first_block_position_ + (off_t)block_stride_ * run_end;
+
+        start = (start + HOLE_ALIGNMENT - 1) / HOLE_ALIGNMENT * HOLE_ALIGNMENT;
+        end = end / HOLE_ALIGNMENT * HOLE_ALIGNMENT;
+
+        if (start < end)
+        {
+            cache_discard(start, end - start);
+            punch_hole(start, end - start);
+        }
+
+        block = find_next_free_block(run_end);
+    }
+}
+
+void punch_hole(off_t position, off_t n_bytes)
+{
+    // Punching holes needs fallocate(), which only Linux has. Elsewhere the
+    // freed blocks simply keep their space
+#ifdef FALLOC_FL_PUNCH_HOLE
+    fallocate(storage_file_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              position, n_bytes);
+#else
+    (void)position;
+    (void)n_bytes;
+#endif
+}
+
+int compare_block_runs(const void* first, const void* second)
+{
+    block_index first_block = ((const block_run*)first)->first_block;
+    block_index second_block = ((const block_run*)second)->first_block;
+
+    return (first_block > second_block) - (first_block < second_block);
+}
+
+int copy_region_blocks(block_index previous_block, block_index first_block,
+                       block_index target_block, size_t count)
+{
+    // Copy the payloads of the blocks of a region from the first block on to
+    // the free blocks from the target block on, and link the copies after the
+    // previous block. The blocks copied from keep their links, so the caller
+    // can still free them by following the links. Headers are left for the
+    // caller to write
+    char* payload = malloc(active_block_size_);
+
+    if (payload == NULL)
+    {
+        return -1;
+    }
+
+    block_index block = first_block;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        block_index target = target_block + i;
+
+        read_storage(payload_position(block), payload, active_block_size_);
+
+        // Copies are too large to stage, and only need to reach the disk
+        // before the headers that link them, so with journaling they are
+        // written right away and synced by the commit
+        if (journaling_)
+        {
+            struct iovec part = { payload, active_block_size_ };
+
+            journal_update(payload_position(target), &part, 1);
+            write_storage_in_place(payload_position(target), payload,
+                                   active_block_size_);
+            unjournaled_copies_ = true;
+        }
+        else
+        {
+            write_storage(payload_position(target), payload,
+                          active_block_size_);
+        }
+
+        links_of(target)->previous_block =
+            i == 0 ? previous_block : target - 1;
+        links_of(target)->next_block =
+            i == count - 1 ? INVALID_BLOCK : target + 1;
+        mark_block_used(target);
+
+        block = links_of(block)->next_block;
+    }
+
+    if (previous_block != INVALID_BLOCK)
+    {
+        links_of(previous_block)->next_block = target_block;
+    }
+
+    free(payload);
+
+    return 0;
+}
+
+block_index find_free_run(block_index previous_block, size_t wanted_blocks,
+                          size_t* run_length)
+{
+    // Continuing right after the previous block keeps the region contiguous,
+    // so that is preferred over any allocation policy. The last block has no
+    // block after it
+    if (previous_block != INVALID_BLOCK
+        && previous_block + 1 < active_block_count_
+        && find_next_free_block(previous_block + 1) == previous_block + 1)
+    {
+        *run_length = find_next_used_block(previous_block + 1)
+            - (previous_block + 1);
+
+        return previous_block + 1;
+    }
+
+    // Go through the runs of free blocks in the bitmap. Next-fit starts from
+    // where the previous allocation ended and wraps around, the other policies
+    // start from the first block
+    size_t search_start = allocation_policy_ == STORAGE_ALLOCATE_NEXT_FIT
+        ? next_fit_position_ : 0;
+    size_t search_end = active_block_count_;
+    size_t position = search_start;
+
+    block_index best_run = INVALID_BLOCK;
+    size_t best_run_length = 0;
+
+    while (true)
+    {
+        size_t run_start = find_next_free_block(position);
+
+        if (run_start >= search_end)
+        {
+            if (search_start == 0 || search_end != active_block_count_)
+            {
+                break;
+            }
+
+            // Wrap around to search the blocks before the starting point
+            search_end = search_start;
+            position = 0;
+
+            continue;
+        }
+
+        size_t run_end = find_next_used_block(run_start);
+        size_t length = run_end - run_start;
+        position = run_end;
+
+        // Runs that are too short are only used if no run is long enough, in
+        // which case the longest one is used
+        bool long_enough = length >= wanted_blocks;
+        bool best_long_enough = best_run_length >= wanted_blocks;
+
+        if (best_run == INVALID_BLOCK
+            || (long_enough && !best_long_enough)
+            || (!best_long_enough && length > best_run_length)
+            || (long_enough && allocation_policy_ == STORAGE_ALLOCATE_BEST_FIT
+                && length < best_run_length))
+        {
+            best_run = run_start;
+            best_run_length = length;
+        }
+
+        // Best-fit has to see every run unless it finds an exact fit, the
+        // other policies take the first run that is long enough
+        if (long_enough && (allocation_policy_ != STORAGE_ALLOCATE_BEST_FIT
+                            || length == wanted_blocks))
+        {
+            break;
+        }
+    }
+
+    *run_length = best_run_length;
+
+    return best_run;
+}
+
+block_index allocate_extent(block_index previous_block, size_t wanted_blocks)
+{
+    // Reserve a run of adjacent free blocks, up to the amount wanted, and
+    // chain them after the previous block. The run is found using only the
+    // bitmap, so the storage file is just written to
+    size_t run_length;
+    block_index first_block =
+        find_free_run(previous_block, wanted_blocks, &run_length);
+
+    if (first_block == INVALID_BLOCK)
+    {
+        // No bits set in the bitmap: the storage has to grow to make room,
+        // or it's out of space
+        if (grow_storage(wanted_blocks) == -1)
+        {
+            return INVALID_BLOCK;
+        }
+
+        first_block = find_free_run(previous_block, wanted_blocks,
+                                    &run_length);
+    }
+
+    if (run_length > wanted_blocks)
+    {
+        run_length = wanted_blocks;
+    }
+
+    for (size_t i = 0; i < run_length; i++)
+    {
+        block_index block = first_block + i;
+
+        links_of(block)->previous_block =
+            i == 0 ? previous_block : block - 1;
+        links_of(block)->next_block =
+            i == run_length - 1 ? INVALID_BLOCK : block + 1;
+        mark_block_used(block);
+    }
+
+    // The previous block's header changes too. When the run continues right
+    // after it, its header is written together with the new ones
+    if (previous_block == INVALID_BLOCK)
+    {
+        write_block_headers(first_block, run_length);
+    }
+    else
+    {
+        links_of(previous_block)->next_block = first_block;
+
+        if (first_block == previous_block + 1)
+        {
+            write_block_headers(previous_block, run_length + 1);
+        }
+        else
+        {
+            write_block_headers(previous_block, 1);
+            write_block_headers(first_block, run_length);
+        }
+    }
+
+    next_fit_position_ = first_block + run_length;
+
+    return first_block;
+}
+
+size_t transfer_parts(storage_cursor* cursor, const struct iovec* parts,
+                      int part_count, bool write)
+{
+    if (!storage_initialized() || cursor == NULL)
+    {
+        return 0;
+    }
+
+    size_t n_bytes = 0;
+
+    for (int i = 0; i < part_count; i++)
+    {
+        n_bytes += parts[i].iov_len;
+    }
+
+    part_position caller_parts = { parts, 0, 0 };
+    size_t transferred_bytes = 0;
+
+    while (transferred_bytes < n_bytes)
+    {
+        // A cursor at the end of its block continues from the next block of
+        // the region only when there is more to read or write, so a transfer
+        // that ends at the end of a block never allocates a block it doesn't
+        // use
+        if (cursor->block_position == active_block_size_)
+        {
+            block_index next_block = links_of(cursor->block)->next_block;
+
+            if (next_block == INVALID_BLOCK && write)
+            {
+                // Allocate enough new blocks for the rest of the write at
+                // once, preferably right after the current block. They are
+                // linked after the current block as they are allocated
+                size_t remaining_bytes = n_bytes - transferred_bytes;
+
+                lock_for_writing(&allocation_lock_);
+                next_block = allocate_extent(cursor->block,
+                    (remaining_bytes + active_block_size_ - 1)
+                    / active_block_size_);
+                unlock_for_writing(&allocation_lock_);
+            }
+
+            if (next_block == INVALID_BLOCK)
+            {
+                // The region ends here, or the storage is out of space for
+                // the rest of the write
+                break;
+            }
+
+            move_cursor_to_block(cursor, next_block);
+        }
+
+        transferred_bytes += transfer_adjacent_blocks(
+            cursor, &caller_parts, n_bytes - transferred_bytes, write);
+    }
+
+    cursor->region_position += transferred_bytes;
+
+    return transferred_bytes;
+}
+
+size_t transfer_adjacent_blocks(storage_cursor* cursor,
+                                part_position* caller_parts, size_t n_bytes,
+                                bool write)
+{
+    // Find out from the in-memory headers how many of the blocks physically
+    // following the current block continue the region, as far as the
+    // transfer reaches
+    size_t wanted_blocks =
+        (cursor->block_position + n_bytes) / active_block_size_;
+
+    if (wanted_blocks > MAX_BLOCKS_PER_HOST_IO - 1)
+    {
+        wanted_blocks = MAX_BLOCKS_PER_HOST_IO - 1;
+    }
+
+    size_t run_blocks = 0;
+
+    while (run_blocks < wanted_blocks
+           && links_of(cursor->block + run_blocks)->next_block
+              == cursor->block + run_blocks + 1)
+    {
+        run_blocks++;
+    }
+
+    // Outside transactions the headers between the payloads are written in
+    // place, so the run ends before a block whose header is waiting for the
+    // commit: it's written by the next call, where it's the first block
+    if (write && journaling_ && !header_table_ && run_blocks > 0
+        && transaction_depth_ == 0)
+    {
+        lock_for_reading(&allocation_lock_);
+
+        for (size_t i = 1; i <= run_blocks; i++)
+        {
+            if (headers_pending(cursor->block + i, 1))
+            {
+                run_blocks = i - 1;
+                break;
+            }
+        }
+
+        unlock_for_reading(&allocation_lock_);
+    }
+
+    // Transfer from the current position to the end of the run, or less if
+    // the transfer ends earlier
+    size_t end_position = (run_blocks + 1) * active_block_size_;
+
+    if (cursor->block_position + n_bytes < end_position)
+    {
+        end_position = cursor->block_position + n_bytes;
+    }
+
+    size_t bytes_to_transfer = end_position - cursor->block_position;
+
+    // The payloads are transferred to and from the caller's buffers with a
+    // single vectored call. Without a header table, the block headers between
+    // the payloads are read into a scratch buffer, and written back unchanged
+    // from their in-memory copies
+    struct iovec host_parts[MAX_HOST_PARTS];
+    char headers[MAX_BLOCKS_PER_HOST_IO][BLOCK_HEADER_MAX_SIZE];
+    int host_part_count = 0;
+    size_t transferred_bytes = 0;
+
+    for (size_t i = 0; i <= run_blocks && transferred_bytes < bytes_to_transfer;
+         i++)
+    {
+        if (i > 0 && !header_table_)
+        {
+            if (host_part_count == MAX_HOST_PARTS)
+            {
+                break;
+            }
+
+            if (write)
+            {
+                block_index block = cursor->block + i;
+                block_info header = { true,
+                                      links_of(block)->previous_block,
+                                      links_of(block)->next_block };
+                encode_block_header(headers[i], &header);
+            }
+
+            host_parts[host_part_count].iov_base =
+                write ? headers[i] : ignored_headers_;
+            host_parts[host_part_count].iov_len = block_header_size_;
+            host_part_count++;
+        }
+
+        size_t start = i == 0 ? cursor->block_position : 0;
+        size_t payload_bytes = active_block_size_ - start;
+
+        if (payload_bytes > bytes_to_transfer - transferred_bytes)
+        {
+            payload_bytes = bytes_to_transfer - transferred_bytes;
+        }
+
+        size_t added_bytes = 0;
+        host_part_count = add_caller_parts(caller_parts, payload_bytes,
+                                           host_parts, host_part_count,
+                                           &added_bytes);
+        transferred_bytes += added_bytes;
+
+        if (added_bytes < payload_bytes)
+        {
+            // Too many small caller buffers for one call: the rest is
+            // transferred by the next call
+            break;
+        }
+    }
+
+    // A transfer within one buffer and one block is the common case of
+    // small reads and writes, and doesn't need a vectored call
+    if (host_part_count == 1 && write)
+    {
+        write_storage(cursor_position(cursor), host_parts[0].iov_base,
+                      host_parts[0].iov_len);
+    }
+    else if (host_part_count == 1)
+    {
+        read_storage(cursor_position(cursor), host_parts[0].iov_base,
+                     host_parts[0].iov_len);
+    }
+    else if (write)
+    {
+        write_storage_parts(cursor_position(cursor), host_parts,
+                            host_part_count);
+    }
+    else
+    {
+        read_storage_parts(cursor_position(cursor), host_parts,
+                           host_part_count);
+    }
+
+    // Move to the block where the transfer ended. A transfer that ends
+    // exactly at the end of the run stays at the end of its last block
+    end_position = cursor->block_position + transferred_bytes;
+    size_t advanced_blocks = end_position / active_block_size_;
+
+    if (advanced_blocks > run_blocks)
+    {
+        advanced_blocks = run_blocks;
+    }
+
+    cursor->block += advanced_blocks;
+    cursor->block_position =
+        end_position - advanced_blocks * active_block_size_;
+
+    return transferred_bytes;
+}
+
+int add_caller_parts(part_position* caller_parts, size_t n_bytes,
+                     struct iovec* host_parts, int host_part_count,
+                     size_t* added_bytes)
+{
+    // Add the next n_bytes of the caller's buffers to the host parts, as far
+    // as there is room for them. Returns the new number of host parts
+    *added_bytes = 0;
+
+    while (*added_bytes < n_bytes && host_part_count < MAX_HOST_PARTS)
+    {
+        const struct iovec* part = &caller_parts->parts[caller_parts->part];
+        size_t part_bytes = part->iov_len - caller_parts->part_offset;
+
+        if (part_bytes > n_bytes - *added_bytes)
+        {
+            part_bytes = n_bytes - *added_bytes;
+        }
+
+        if (part_bytes > 0)
+        {
+            host_parts[host_part_count].iov_base =
+                (char*)part->iov_base + caller_parts->part_offset;
+            host_parts[host_part_count].iov_len = part_bytes;
+            host_part_count++;
+        }
+
+        *added_bytes += part_bytes;
+        caller_parts->part_offset += part_bytes;
+
+        if (caller_parts->part_offset == part->iov_len)
+        {
+            caller_parts->part++;
+            caller_parts->part_offset = 0;
+        }
+    }
+
+    return host_part_count;
+}
+
+void encode_block_index(char* bytes, block_index block)
+{
+    if (block_index_size_ == NARROW_BLOCK_INDEX_SIZE)
+    {
+        unsigned short narrow_block = block == INVALID_BLOCK
+            ? NARROW_INVALID_BLOCK : block;
+        memcpy(bytes, &narrow_block, sizeof(unsigned short));
+    }
+    else
+    {
+        memcpy(bytes, &block, sizeof(block_index));
+    }
+}
+
+block_index decode_block_index(const char* bytes)
+{
+    if (block_index_size_ == NARROW_BLOCK_INDEX_SIZE)
+    {
+        unsigned short narrow_block;
+        memcpy(&narrow_block, bytes, sizeof(unsigned short));
+
+        return narrow_block == NARROW_INVALID_BLOCK
+            ? INVALID_BLOCK : narrow_block;
+    }
+
+    block_index block;
+    memcpy(&block, bytes, sizeof(block_index));
+
+    return block;
+}
+
+void encode_block_header(char* bytes, const block_info* header)
+{
+    bytes[0] = header->in_use
+        ? BLOCK_IN_USE_INDICATOR : BLOCK_NOT_IN_USE_INDICATOR;
+    encode_block_index(bytes + sizeof(char), header->previous_block);
+    encode_block_index(bytes + sizeof(char) + block_index_size_,
+                       header->next_block);
+}
+
+void decode_block_header(const char* bytes, block_info* header)
+{
+    header->in_use = bytes[0] != BLOCK_NOT_IN_USE_INDICATOR;
+    header->previous_block = decode_block_index(bytes + sizeof(char));
+    header->next_block =
+        decode_block_index(bytes + sizeof(char) + block_index_size_);
+}
+
+void encode_block_headers(char* bytes, block_index first_block, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        block_index block = first_block + i;
+        block_info header = {
+            !block_is_free(block),
+            links_of(block)->previous_block,
+            links_of(block)->next_block
+        };
+
+        encode_block_header(bytes + i * block_header_size_, &header);
+    }
+}
+
+void write_block_headers(block_index first_block, size_t count)
+{
+    // Headers changed by a transaction are left to the commit, and so are
+    // later changes to them and headers that link to them, which must not
+    // reach the storage file before the commit either
+    if (journaling_ && (transaction_depth_ > 0
+                        || headers_pending(first_block, count)
+                        || links_pending(first_block, count)))
+    {
+        mark_headers_pending(first_block, count);
+
+        return;
+    }
+
+    // Write the in-memory headers of a run of adjacent blocks to the storage
+    // file. In a header table they are next to each other and can be written
+    // together, otherwise each one is written in front of its payload
+    char bytes[HEADERS_PER_WRITE * BLOCK_HEADER_MAX_SIZE];
+    size_t headers_per_write = header_table_ ? HEADERS_PER_WRITE : 1;
+
+    for (size_t first = 0; first < count; first += headers_per_write)
+    {
+        size_t batch = count - first;
+
+        if (batch > headers_per_write)
+        {
+            batch = headers_per_write;
+        }
+
+        encode_block_headers(bytes, first_block + first, batch);
+        write_storage(header_position(first_block + first), bytes,
+                      batch * block_header_size_);
+    }
+}
+
+off_t header_position(block_index block)
+{
+    if (header_table_)
+    {
+        return header_table_position_ + (off_t)block_header_size_ * block;
+    }
+
+    return first_block_position_ + (off_t)block_stride_ * block;
+}
+
+off_t payload_position(block_index block)
+{
+    off_t position = first_block_position_ + (off_t)block_stride_ * block;
+
+    if (!header_table_)
+    {
+        position += block_header_size_;
+    }
+
+    return position;
+}
+
+off_t cursor_position(const storage_cursor* cursor)
+{
+    return payload_position(cursor->block) + cursor->block_position;
+}
+
+void move_cursor_to_block(storage_cursor* cursor, block_index block)
+{
+    if (block >= active_block_count_)
+    {
+        return;
+    }
+
+    cursor->block = block;
+    cursor->block_position = 0;
+}
+
+void move_cursor_to_position(storage_cursor* cursor, size_t position)
+{
+    if (cursor->map.region >= active_block_count_)
+    {
+        return;
+    }
+
+    size_t logical_block = position / active_block_size_;
+    block_index block = find_mapped_block(&cursor->map, logical_block);
+
+    if (block == INVALID_BLOCK)
+    {
+        if (cursor->map.block_count == 0)
+        {
+            return;
+        }
+
+        // The position is past the last block of the region: stop at the end
+        // of the last block
+        logical_block = cursor->map.block_count - 1;
+        block = cursor->map.blocks[logical_block];
+        position = (logical_block + 1) * active_block_size_;
+    }
+
+    cursor->block = block;
+    cursor->block_position = position - logical_block * active_block_size_;
+    cursor->region_position = position;
+}
+
+block_index find_mapped_block(block_map* map, size_t logical_block)
+{
+    if (map->generation != block_map_generation_)
+    {
+        // Blocks have been freed since the map was last used, so it's started
+        // over from the first block of the region
+        map->block_count = 0;
+        map->generation = block_map_generation_;
+    }
+
+    // Extend the map by following the in-memory headers. Blocks are only ever
+    // added to the end of a region, so the part already mapped stays valid
+    while (map->block_count <= logical_block)
+    {
+        block_index next_block = map->block_count == 0 ? map->region
+            : links_of(map->blocks[map->block_count - 1])->next_block;
+
+        if (next_block == INVALID_BLOCK)
+        {
+            return INVALID_BLOCK;
+        }
+
+        if (map->block_count == map->capacity)
+        {
+            size_t capacity = map->capacity == 0
+                ? BLOCK_MAP_INITIAL_CAPACITY : map->capacity * 2;
+            block_index* blocks =
+                realloc(map->blocks, capacity * sizeof(block_index));
+
+            if (blocks == NULL)
+            {
+                return INVALID_BLOCK;
+            }
+
+            map->blocks = blocks;
+            map->capacity = capacity;
+        }
+
+        map->blocks[map->block_count++] = next_block;
+    }
+
+    return map->blocks[logical_block];
+}
+
+int map_storage_file()
+{
+#ifdef _MSC_VER
+    // Memory mapping is not implemented for Windows
+    return -1;
+#else
+    struct stat file_status;
+
+    if (fstat(storage_file_, &file_status) == -1 || file_status.st_size == 0)
+    {
+        return -1;
+    }
+
+    void* map = mmap(NULL, file_status.st_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, storage_file_, 0);
+
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    storage_map_ = map;
+    storage_map_size_ = file_status.st_size;
+
+    return 0;
+#endif
+}
+
+void unmap_storage_file()
+{
+#ifndef _MSC_VER
+    if (storage_map_ != NULL)
+    {
+        munmap(storage_map_, storage_map_size_);
+    }
+#endif
+
+    storage_map_ = NULL;
+    storage_map_size_ = 0;
+}
+
+void sync_storage_file()
+{
+    cache_flush();
+
+#ifndef _MSC_VER
+    if (storage_map_ != NULL)
+    {
+        lock_for_reading(&map_lock_);
+        msync(storage_map_, storage_map_size_, MS_SYNC);
+        unlock_for_reading(&map_lock_);
+    }
+#endif
+
+    sync_file(storage_file_);
+}
+
+int resize_storage_file(size_t size)
+{
+    // The mapping can't grow in place, so it's replaced with a new mapping of
+    // the resized file
+    bool mapped = storage_map_ != NULL;
+
+    unmap_storage_file();
+
+    if (ftruncate(storage_file_, size) == -1)
+    {
+        return mapped ? map_storage_file() - 1 : -1;
+    }
+
+    return mapped ? map_storage_file() : 0;
+}
+
+void backend_read(off_t position, void* buffer, size_t n_bytes)
+{
+    struct iovec part = { buffer, n_bytes };
+
+    backend_read_parts(position, &part, 1);
+}
+
+void backend_write(off_t position, const void* buffer, size_t n_bytes)
+{
+    struct iovec part = { (void*)buffer, n_bytes };
+
+    backend_write_parts(position, &part, 1);
+}
+
+void backend_read_parts(off_t position, const struct iovec* parts,
+                        int part_count)
+{
+    if (active_backend_ == STORAGE_BACKEND_MMAP)
+    {
+        // The mapping is only replaced while no thread is copying from it.
+        // Reads past the end of the mapping stop there like pread() would,
+        // which only happens after the storage has shrunk under a cursor
+        // left in a freed region
+        lock_for_reading(&map_lock_);
+
+        for (int i = 0; i < part_count
+             && position + parts[i].iov_len <= storage_map_size_; i++)
+        {
+            memcpy(parts[i].iov_base, storage_map_ + position,
+                   parts[i].iov_len);
+            position += parts[i].iov_len;
+        }
+
+        unlock_for_reading(&map_lock_);
+
+        return;
+    }
+
+    if (part_count == 1)
+    {
+        pread(storage_file_, parts[0].iov_base, parts[0].iov_len, position);
+
+        return;
+    }
+
+    preadv(storage_file_, parts, part_count, position);
+}
+
+int read_batched_parts(off_t position, const struct iovec* parts,
+                       int part_count)
+{
+    // Reads are only batched with the file backend
+    size_t n_bytes = 0;
+
+    for (int i = 0; i < part_count; i++)
+    {
+        n_bytes += parts[i].iov_len;
+    }
+
+    return (long long)preadv(storage_file_, parts, part_count, position)
+        == (long long)n_bytes ? 0 : -1;
+}
+
+void backend_write_parts(off_t position, const struct iovec* parts,
+                         int part_count)
+{
+    if (active_backend_ == STORAGE_BACKEND_MMAP)
+    {
+        size_t n_bytes = 0;
+
+        for (int i = 0; i < part_count; i++)
+        {
+            n_bytes += parts[i].iov_len;
+        }
+
+        // Writing past the end of the file makes it grow like write() would.
+        // Growing replaces the mapping, which needs the lock for writing
+        lock_for_reading(&map_lock_);
+
+        if (position + n_bytes > storage_map_size_)
+        {
+            unlock_for_reading(&map_lock_);
+            lock_for_writing(&map_lock_);
+
+            int result = position + n_bytes > storage_map_size_
+                ? resize_storage_file(position + n_bytes) : 0;
+
+            unlock_for_writing(&map_lock_);
+
+            if (result == -1)
+            {
+                return;
+            }
+
+            lock_for_reading(&map_lock_);
+        }
+
+        for (int i = 0; i < part_count; i++)
+        {
+            memcpy(storage_map_ + position, parts[i].iov_base,
+                   parts[i].iov_len);
+            position += parts[i].iov_len;
+        }
+
+        unlock_for_reading(&map_lock_);
+
+        return;
+    }
+
+    if (part_count == 1)
+    {
+        pwrite(storage_file_, parts[0].iov_base, parts[0].iov_len, position);
+
+        return;
+    }
+
+    pwritev(storage_file_, parts, part_count, position);
+}
+
+void read_storage(off_t position, void* buffer, size_t n_bytes)
+{
+    struct iovec part = { buffer, n_bytes };
+
+    read_storage_parts(position, &part, 1);
+}
+
+void write_storage(off_t position, const void* buffer, size_t n_bytes)
+{
+    struct iovec part = { (void*)buffer, n_bytes };
+
+    if (staging_writes(position) && journal_write(position, &part, 1) == 0)
+    {
+        return;
+    }
+
+    // Staged bytes that the write overlaps must not undo it at the commit
+    if (journaling_)
+    {
+        journal_update(position, &part, 1);
+    }
+
+    write_storage_in_place(position, buffer, n_bytes);
+}
+
+void read_storage_parts(off_t position, const struct iovec* parts,
+                        int part_count)
+{
+    // Staged writes are read right away along with the rest of the read
+    if (journal_read(position, parts, part_count, read_storage_in_place))
+    {
+        return;
+    }
+
+    if (batching_reads(position))
+    {
+        batch_add_read(thread_batch_, position, parts, part_count);
+
+        return;
+    }
+
+    read_storage_in_place(position, parts, part_count);
+}
+
+bool batching_reads(off_t position)
+{
+    // Only reads in the block area are batched, as the storage header and the
+    // header table are read by the module itself
+    return thread_batch_ != NULL && position >= first_block_position_
+        && active_backend_ == STORAGE_BACKEND_FILE && !cache_enabled();
+}
+
+void write_storage_parts(off_t position, const struct iovec* parts,
+                         int part_count)
+{
+    if (staging_writes(position)
+        && journal_write(position, parts, part_count) == 0)
+    {
+        return;
+    }
+
+    if (journaling_)
+    {
+        journal_update(position, parts, part_count);
+    }
+
+    if (cache_enabled())
+    {
+        for (int i = 0; i < part_count; i++)
+        {
+            cache_write(position, parts[i].iov_base, parts[i].iov_len);
+            position += parts[i].iov_len;
+        }
+
+        return;
+    }
+
+    backend_write_parts(position, parts, part_count);
+}
+
+void read_storage_in_place(off_t position, const struct iovec* parts,
+                           int part_count)
+{
+    // The storage file header and the header table are never cached
+    if (cache_enabled() && position >= first_block_position_)
+    {
+        for (int i = 0; i < part_count; i++)
+        {
+            cache_read(position, parts[i].iov_base, parts[i].iov_len);
+            position += parts[i].iov_len;
+        }
+
+        return;
+    }
+
+    backend_read_parts(position, parts, part_count);
+}
+
+void write_storage_in_place(off_t position, const void* buffer,
+                            size_t n_bytes)
+{
+    if (cache_enabled() && position >= first_block_position_)
+    {
+        cache_write(position, buffer, n_bytes);
+
+        return;
+    }
+
+    backend_write(position, buffer, n_bytes);
+}
+
+bool staging_writes(off_t position)
+{
+    // Only writes to the block area are staged: the storage header is
+    // written right away, and headers are journaled by the commit
+    return journaling_ && transaction_depth_ > 0
+        && position >= first_block_position_;
+}
+
+int commit_journal()
+{
+    // Called with the transaction lock held
+    lock_for_writing(&allocation_lock_);
+
+    // Blocks freed by the group become free in the headers that are
+    // journaled, and can be reused once the commit has succeeded
+    for (size_t word = 0; word < journal_bitmap_word_count_; word++)
+    {
+        free_blocks_[word] |= released_blocks_[word];
+    }
+
+    // Pending headers are added in runs as large as write_block_headers()
+    // writes them. A header that can't be added to the batch is written
+    // right away instead
+    char bytes[HEADERS_PER_WRITE * BLOCK_HEADER_MAX_SIZE];
+    size_t headers_per_write = header_table_ ? HEADERS_PER_WRITE : 1;
+    size_t block = 0;
+
+    while (block < active_block_count_)
+    {
+        if (pending_headers_[block / BITMAP_WORD_BITS] == 0)
+        {
+            block = (block / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS;
+            continue;
+        }
+
+        if (!headers_pending(block, 1))
+        {
+            block++;
+            continue;
+        }
+
+        size_t count = 1;
+
+        while (count < headers_per_write
+               && block + count < active_block_count_
+               && headers_pending(block + count, 1))
+        {
+            count++;
+        }
+
+        encode_block_headers(bytes, block, count);
+
+        if (journal_add(header_position(block), bytes,
+                        count * block_header_size_) == -1)
+        {
+            write_storage_in_place(header_position(block), bytes,
+                                   count * block_header_size_);
+        }
+
+        block += count;
+    }
+
+    // A group that couldn't be journaled has still been written in place,
+    // but isn't safe from a crash. Its headers stay pending and its blocks
+    // stay released, so that the next commit journals them again
+    ended_transactions_ = 0;
+
+    if (journal_commit(unjournaled_copies_) == -1)
+    {
+        for (size_t word = 0; word < journal_bitmap_word_count_; word++)
+        {
+            free_blocks_[word] &= ~released_blocks_[word];
+        }
+
+        unlock_for_writing(&allocation_lock_);
+
+        return -1;
+    }
+
+    // The released blocks can only be punched out now that no header refers
+    // to them on the disk
+    block = 0;
+
+    while (block < active_block_count_)
+    {
+        size_t word = block / BITMAP_WORD_BITS;
+
+        if (released_blocks_[word] == 0)
+        {
+            block = (word + 1) * BITMAP_WORD_BITS;
+            continue;
+        }
+
+        if (!((released_blocks_[word] >> (block % BITMAP_WORD_BITS)) & 1))
+        {
+            block++;
+            continue;
+        }
+
+        size_t run_start = block;
+
+        while (block < active_block_count_
+               && ((released_blocks_[block / BITMAP_WORD_BITS]
+                    >> (block % BITMAP_WORD_BITS)) & 1))
+        {
+            block++;
+        }
+
+        add_pending_hole(run_start, block - run_start);
+    }
+
+    memset(pending_headers_, 0, journal_bitmap_word_count_ * sizeof(uint64_t));
+    memset(released_blocks_, 0, journal_bitmap_word_count_ * sizeof(uint64_t));
+    unjournaled_copies_ = false;
+
+    unlock_for_writing(&allocation_lock_);
+
+    return 0;
+}
+
+int resize_journal_bitmaps(size_t block_count)
+{
+    size_t word_count = (block_count + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+
+    if (!journaling_ || word_count <= journal_bitmap_word_count_)
+    {
+        return 0;
+    }
+
+    uint64_t* pending = realloc(pending_headers_,
+                                word_count * sizeof(uint64_t));
+
+    if (pending == NULL)
+    {
+        return -1;
+    }
+
+    pending_headers_ = pending;
+
+    uint64_t* released = realloc(released_blocks_,
+                                 word_count * sizeof(uint64_t));
+
+    if (released == NULL)
+    {
+        return -1;
+    }
+
+    released_blocks_ = released;
+
+    size_t added_words = word_count - journal_bitmap_word_count_;
+
+    memset(pending_headers_ + journal_bitmap_word_count_, 0,
+           added_words * sizeof(uint64_t));
+    memset(released_blocks_ + journal_bitmap_word_count_, 0,
+           added_words * sizeof(uint64_t));
+    journal_bitmap_word_count_ = word_count;
+
+    return 0;
+}
+
+void free_journal_bitmaps()
+{
+    free(pending_headers_);
+    free(released_blocks_);
+    pending_headers_ = NULL;
+    released_blocks_ = NULL;
+    journal_bitmap_word_count_ = 0;
+}
+
+void mark_headers_pending(block_index first_block, size_t count)
+{
+    for (size_t block = first_block; block < first_block + count; block++)
+    {
+        pending_headers_[block / BITMAP_WORD_BITS] |=
+            (uint64_t)1 << (block % BITMAP_WORD_BITS);
+    }
+}
+
+bool headers_pending(block_index first_block, size_t count)
+{
+    for (size_t block = first_block; block < first_block + count; block++)
+    {
+        if ((pending_headers_[block / BITMAP_WORD_BITS]
+             >> (block % BITMAP_WORD_BITS)) & 1)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool links_pending(block_index first_block, size_t count)
+{
+    for (size_t block = first_block; block < first_block + count; block++)
+    {
+        block_index previous_block = links_of(block)->previous_block;
+        block_index next_block = links_of(block)->next_block;
+
+        if ((previous_block < active_block_count_
+             && headers_pending(previous_block, 1))
+            || (next_block < active_block_count_
+                && headers_pending(next_block, 1)))
+        {
+            return true;
+        }
+    }
 
-    current_block_position_ = 0;
+    return false;
 }
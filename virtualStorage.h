@@ -5,24 +5,253 @@
 // single file. The storage system is used by allocating regions which can
 // then be written to and read from like byte streams. The module underneath
 // handles allocating and freeing memory blocks as necessary and writing the
-// data to the disk. Only one region is active at a time, and it must be
-// switched manually to access another region.
+// data to the disk. Regions are accessed through cursors, which each have
+// their own position in a region, so several regions can be read and written
+// at the same time without jumping back and forth between them. Different
+// regions can be read and written from different threads at the same time,
+// but a region must only be written by one thread at a time, a cursor must
+// only be used by one thread at a time, and initializing and closing the
+// storage must not overlap other calls.
+
+#include "virtualLock.h"
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
-#define INVALID_REGION 65535
+// Windows compatibility
+#ifdef _MSC_VER
+struct iovec
+{
+    void* iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+#define INVALID_REGION 0xFFFFFFFF
+
+typedef uint32_t storage_region;
+
+// A position in a region. Each cursor keeps a map of the blocks of its
+// region, so seeking to any position in the region takes constant time
+// instead of walking through the region's blocks
+typedef struct storage_cursor storage_cursor;
+
+// A collection of reads of the storage file that are made together
+typedef struct storage_batch storage_batch;
+
+// Decides where new blocks are allocated when a region can't simply continue
+// into the block right after its last block. First-fit uses the first run of
+// free blocks that is long enough, next-fit does the same but starts searching
+// from where the previous allocation ended, and best-fit uses the shortest run
+// that is long enough
+typedef enum { STORAGE_ALLOCATE_FIRST_FIT, STORAGE_ALLOCATE_NEXT_FIT,
+               STORAGE_ALLOCATE_BEST_FIT } storage_allocation_policy;
+
+// Decides whether and how much the storage file grows when it runs out of
+// free blocks. Each time it grows by the given percentage of its block count,
+// but at least by the minimum number of blocks and by as many blocks as the
+// write that ran out of space still needs, up to the maximum block count. A
+// maximum of zero, which is the default, keeps the storage file at the size
+// it was created with. New blocks are added to the end of the file without
+// moving existing ones, so storage files with a header table can't grow, and
+// storage files with 2-byte block indices only grow to 65534 blocks
+typedef struct storage_growth_policy
+{
+    size_t growth_percent;
+    size_t min_growth_blocks;
+    size_t max_block_count;
+} storage_growth_policy;
+
+// The file backend accesses the storage file with read() and write() calls,
+// the memory-mapped backend maps the whole storage file into memory and
+// copies data to and from the mapping. The memory-mapped backend is not
+// available on Windows
+typedef enum { STORAGE_BACKEND_FILE, STORAGE_BACKEND_MMAP } storage_backend;
 
-typedef unsigned short storage_region;
+// Settings for storage_initialize_with(). The block size and count are only
+// used when a new storage file is created: an existing storage file keeps the
+// ones it was created with. The block size must be between 512 bytes and
+// 1 MiB. The header table setting is also only used for new storage files: it
+// stores all block headers together in a table before the blocks instead of
+// in front of each block. The cache block count is the number of blocks kept
+// in the block cache, and zero disables the cache. Punching holes returns the
+// space of freed blocks to the host file system, in batches of many freed
+// blocks, where the host supports it. The journal group size is the number of
+// transactions committed together to the journal, and zero, which is the
+// default, disables the journal
+typedef struct storage_options
+{
+    const char* path;
+    size_t block_size;
+    size_t block_count;
+    storage_backend backend;
+    size_t cache_block_count;
+    bool header_table;
+    bool punch_holes;
+    size_t journal_group_size;
+} storage_options;
+
+// Counters of the block cache since the storage was initialized
+typedef struct storage_cache_statistics
+{
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t write_backs;
+} storage_cache_statistics;
+
+storage_options storage_default_options();
 
 int storage_initialize();
+int storage_initialize_with(const storage_options* options);
 bool storage_initialized();
 
+// Counts the times the storage has been opened. Modules that keep parts of the
+// storage in memory compare it to notice when the storage has been closed and
+// possibly opened with another storage file in between
+size_t storage_open_count();
+void storage_close();
+
+// Changes to cached blocks are only written to the storage file when they are
+// evicted from the cache, when the storage is flushed and when it's closed.
+// Freed blocks that are waiting to be punched out are punched at the same
+// times. Flushing also syncs the storage file to the disk. Returns -1 if the
+// journaled group could not be committed
+int storage_flush();
+storage_cache_statistics storage_get_cache_statistics();
+
+// With the journal enabled, the block links and the writes to regions made
+// between the beginning and the end of a transaction reach the storage file
+// together or not at all, even if the program or the host crashes in
+// between. Ended transactions are committed in groups, with a few syncs of
+// the host file per group: a group is committed when the group size is
+// reached, when the storage is flushed and when it's closed, and a group that
+// was committed before a crash is finished when the storage is initialized
+// again. Only one thread at a time can be in a transaction, and a thread can
+// begin a transaction inside another one, which then ends with the outermost
+// one. Blocks freed in a transaction are reused only after it's committed.
+// Ending a transaction returns -1 if it committed a group that could not be
+// written to the journal: the changes of the group are still made, but they
+// are only safe from a crash once a later commit succeeds. Without the
+// journal, beginning and ending a transaction does nothing
+void storage_begin_transaction();
+int storage_end_transaction();
+
+void storage_set_allocation_policy(storage_allocation_policy policy);
+
+storage_growth_policy storage_default_growth_policy();
+void storage_set_growth_policy(storage_growth_policy policy);
+
+size_t storage_block_size();
+size_t storage_block_count();
+size_t storage_free_block_count();
+
 storage_region storage_allocate_region();
 int storage_free_region(storage_region region);
 
-int storage_jump_to_region(storage_region region);
+// Frees every block of the region except the first, so the region keeps its
+// ID but is left with a single block
+int storage_truncate_region(storage_region region);
+
+// Cuts the free blocks at the end of the storage file off, leaving the last
+// block in use as the last block. Storage files with a header table can't
+// shrink, like they can't grow, and a journaled storage doesn't shrink if
+// the group committed first could not be written to the journal
+int storage_shrink();
+
+// The share of links between consecutive blocks of regions that lead
+// somewhere other than the adjacent block, from 0 when every region continues
+// in adjacent blocks to 1 when no block is followed by its neighbour
+double storage_fragmentation();
+
+// Moves the blocks of a region so that it continues in adjacent blocks. If
+// the blocks after its contiguous start are free, only the rest of the region
+// is moved there and the region keeps its ID. Otherwise, unless the ID has to
+// be kept, the whole region is copied to a free run of blocks and the ID of
+// the copy is returned: the original is left as it was, and the caller frees
+// it once nothing refers to it anymore. Returns the region itself if it was
+// already contiguous or there was no room to move it. The caller must make
+// sure the region isn't used while it's moved, and cursors that were in it
+// have to jump to it again. The number of blocks copied is added to
+// moved_blocks
+storage_region storage_relocate_region(storage_region region, bool keep_id,
+                                       size_t* moved_blocks);
+
+storage_cursor* storage_create_cursor();
+void storage_destroy_cursor(storage_cursor* cursor);
+
+// Region IDs take 2 or 4 bytes in the storage file depending on its format.
+// The region ID functions read and write region IDs using the storage file's
+// own format, and the encoding functions convert them to and from that format
+// in memory for data that is written in larger pieces
+size_t storage_region_size();
+void storage_encode_region_id(char* bytes, storage_region region);
+storage_region storage_decode_region_id(const char* bytes);
 
+int storage_cursor_jump_to_region(storage_cursor* cursor,
+                                  storage_region region);
+size_t storage_cursor_read_region_id(storage_cursor* cursor,
+                                     storage_region* region);
+size_t storage_cursor_write_region_id(storage_cursor* cursor,
+                                      storage_region region);
+size_t storage_cursor_read(storage_cursor* cursor, void* buffer,
+                           size_t n_bytes);
+size_t storage_cursor_write(storage_cursor* cursor, void* buffer,
+                            size_t n_bytes);
+
+// Vectored reads and writes go through the parts in order as if they were one
+// buffer, so a region that continues in adjacent blocks takes a single host
+// read or write however many parts there are
+size_t storage_cursor_readv(storage_cursor* cursor, const struct iovec* parts,
+                            int part_count);
+size_t storage_cursor_writev(storage_cursor* cursor, const struct iovec* parts,
+                             int part_count);
+size_t storage_cursor_seek(storage_cursor* cursor, off_t offset);
+
+// While a batch is started, reads of regions made by the calling thread only
+// walk their blocks and add the reads of the storage file they need to the
+// batch, returning the number of bytes they will read. Ending the batch makes
+// all the reads at once and returns when they are done, so the buffers of the
+// reads must not be used before then, and reads whose result is needed right
+// away, like reads of region IDs, must not be made during a batch. Reads go
+// through the batch only with the file backend and without the block cache;
+// otherwise they are made right away as usual. Each batch belongs to one
+// thread at a time
+storage_batch* storage_create_batch();
+void storage_destroy_batch(storage_batch* batch);
+void storage_start_batch(storage_batch* batch);
+void storage_end_batch();
+
+// Makes the reads added to the calling thread's batch so far and releases
+// the locks it keeps, without ending the batch. Does nothing without a
+// started batch
+void storage_issue_batch();
+
+// Reads of the calling thread's batch that are added after this set the flag
+// if they fail, which is known once the batch has ended. A NULL flag stops
+// reporting failures. Does nothing without a started batch
+void storage_report_batch_failures(bool* failed);
+
+// Hands a lock the calling thread holds for reading over to its batch, which
+// releases it when the batch ends, so that whatever the lock guards can't
+// change before the batched reads are made. Returns false without a started
+// batch, in which case the caller releases the lock itself. A thread must
+// not lock a lock that its batch holds again, and must not wait for a lock
+// while its batch keeps others, as the threads holding that lock may be
+// waiting for the kept ones
+bool storage_batch_keep_lock(virtual_lock* lock);
+bool storage_batch_holds_lock(const virtual_lock* lock);
+
+// These functions use a default cursor owned by the storage, for code that
+// only needs one region at a time. As there is only one default cursor, they
+// must not be used by several threads at once
+int storage_jump_to_region(storage_region region);
+size_t storage_read_region_id(storage_region* region);
+size_t storage_write_region_id(storage_region region);
 size_t storage_read_in_region(void* buffer, size_t n_bytes);
 size_t storage_write_in_region(void* buffer, size_t n_bytes);
 size_t storage_seek_in_region(off_t offset);